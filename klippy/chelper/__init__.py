@@ -17,8 +17,9 @@ COMPILE_ARGS = ("-Wall -g -O2 -shared -fPIC"
                 " -o %s %s")
 SSE_FLAGS = "-mfpmath=sse -msse2"
 SOURCE_FILES = [
-    'pyhelper.c', 'serialqueue.c', 'stepcompress.c', 'itersolve.c', 'trapq.c',
-    'pollreactor.c', 'msgblock.c', 'trdispatch.c',
+    'pyhelper.c', 'serialqueue.c', 'sqtransport.c', 'stepcompress.c',
+    'itersolve.c', 'trapq.c', 'pollreactor.c', 'msgblock.c', 'trdispatch.c',
+    'stepgen.c', 'bulk_sensor.c', 'lookahead.c', 'gcode_parse.c',
     'kin_cartesian.c', 'kin_corexy.c', 'kin_corexz.c', 'kin_delta.c',
     'kin_deltesian.c', 'kin_polar.c', 'kin_rotary_delta.c', 'kin_winch.c',
     'kin_extruder.c', 'kin_shaper.c', 'kin_idex.c',
@@ -26,22 +27,27 @@ SOURCE_FILES = [
 DEST_LIB = "c_helper.so"
 OTHER_FILES = [
     'list.h', 'serialqueue.h', 'stepcompress.h', 'itersolve.h', 'pyhelper.h',
-    'trapq.h', 'pollreactor.h', 'msgblock.h'
+    'trapq.h', 'pollreactor.h', 'msgblock.h', 'kin_shaper.h', 'sqtransport.h',
+    'lookahead.h'
 ]
 
 defs_stepcompress = """
     struct pull_history_steps {
         uint64_t first_clock, last_clock;
         int64_t start_position;
-        int step_count, interval, add;
+        int step_count, interval, add, add2;
     };
 
     struct stepcompress *stepcompress_alloc(uint32_t oid);
     void stepcompress_fill(struct stepcompress *sc, uint32_t max_error
         , int32_t queue_step_msgtag, int32_t set_next_step_dir_msgtag);
+    void stepcompress_set_add2_msgtag(struct stepcompress *sc
+        , int32_t msgtag);
     void stepcompress_set_invert_sdir(struct stepcompress *sc
         , uint32_t invert_sdir);
     void stepcompress_free(struct stepcompress *sc);
+    int stepcompress_append_clocks(struct stepcompress *sc, int sdir
+        , uint64_t *clocks, int count);
     int stepcompress_reset(struct stepcompress *sc, uint64_t last_step_clock);
     int stepcompress_set_last_position(struct stepcompress *sc
         , uint64_t clock, int64_t last_position);
@@ -80,10 +86,23 @@ defs_itersolve = """
     double itersolve_get_commanded_pos(struct stepper_kinematics *sk);
 """
 
+defs_stepgen = """
+    struct stepgen_pool *stepgen_pool_alloc(int num_threads);
+    void stepgen_pool_free(struct stepgen_pool *sp);
+    int32_t stepgen_pool_generate_steps(struct stepgen_pool *sp
+        , struct stepper_kinematics **sk_list, int sk_num, double flush_time);
+"""
+
 defs_trapq = """
+    struct trapq_record {
+        struct trapq *tq;
+        double print_time, accel_t, cruise_t, decel_t;
+        double start_pos[3], axes_r[3];
+        double start_v, cruise_v, accel, jerk;
+    };
     struct pull_move {
         double print_time, move_t;
-        double start_v, accel;
+        double start_v, accel, jerk;
         double start_x, start_y, start_z;
         double x_r, y_r, z_r;
     };
@@ -95,12 +114,39 @@ defs_trapq = """
         , double start_pos_x, double start_pos_y, double start_pos_z
         , double axes_r_x, double axes_r_y, double axes_r_z
         , double start_v, double cruise_v, double accel);
+    void trapq_append_scurve(struct trapq *tq, double print_time
+        , double accel_t, double cruise_t, double decel_t
+        , double start_pos_x, double start_pos_y, double start_pos_z
+        , double axes_r_x, double axes_r_y, double axes_r_z
+        , double start_v, double cruise_v, double accel, double jerk);
+    void trapq_append_batch(struct trapq_record *records, int count);
     void trapq_finalize_moves(struct trapq *tq, double print_time
         , double clear_history_time);
     void trapq_set_position(struct trapq *tq, double print_time
         , double pos_x, double pos_y, double pos_z);
     int trapq_extract_old(struct trapq *tq, struct pull_move *p, int max
         , double start_time, double end_time);
+    void trapq_get_stats(struct trapq *tq, char *buf, int len);
+"""
+
+defs_lookahead = """
+    struct lookahead *lookahead_alloc(double flush_time);
+    void lookahead_free(struct lookahead *lh);
+    void lookahead_reset(struct lookahead *lh);
+    void lookahead_set_jerk(struct lookahead *lh, double jerk);
+    void lookahead_set_flush_time(struct lookahead *lh, double flush_time);
+    void lookahead_set_default_flush_time(struct lookahead *lh
+        , double flush_time);
+    int lookahead_add_move(struct lookahead *lh, double start_x
+        , double start_y, double start_z, double start_e, double axes_r_x
+        , double axes_r_y, double axes_r_z, double axes_r_e
+        , double move_d, double accel
+        , double junction_deviation, double min_move_t
+        , double max_cruise_v2, double delta_v2, double smooth_delta_v2
+        , int is_kinematic_move, double extruder_v2);
+    int lookahead_flush(struct lookahead *lh, int lazy);
+    double lookahead_queue_moves(struct lookahead *lh, struct trapq *tq
+        , struct trapq *etq, double print_time, double *end_times);
 """
 
 defs_kin_cartesian = """
@@ -144,6 +190,11 @@ defs_kin_extruder = """
     struct stepper_kinematics *extruder_stepper_alloc(void);
     void extruder_set_pressure_advance(struct stepper_kinematics *sk
         , double pressure_advance, double smooth_time);
+    int extruder_set_pressure_advance_taper(struct stepper_kinematics *sk
+        , int n, double velocities[], double factors[]);
+    int extruder_set_shaper_params(struct stepper_kinematics *sk
+        , int n, double a[], double t[]);
+    double extruder_get_step_generation_window(struct stepper_kinematics *sk);
 """
 
 defs_kin_shaper = """
@@ -179,6 +230,8 @@ defs_serialqueue = """
     void serialqueue_free(struct serialqueue *sq);
     struct command_queue *serialqueue_alloc_commandqueue(void);
     void serialqueue_free_commandqueue(struct command_queue *cq);
+    void serialqueue_set_commandqueue_priority(struct command_queue *cq
+        , int priority);
     void serialqueue_send(struct serialqueue *sq, struct command_queue *cq
         , uint8_t *msg, int len, uint64_t min_clock, uint64_t req_clock
         , uint64_t notify_id);
@@ -188,6 +241,7 @@ defs_serialqueue = """
         , double frequency);
     void serialqueue_set_receive_window(struct serialqueue *sq
         , int receive_window);
+    void serialqueue_set_sack(struct serialqueue *sq, int msgtag);
     void serialqueue_set_clock_est(struct serialqueue *sq, double est_freq
         , double conv_time, uint64_t conv_clock, uint64_t last_clock);
     void serialqueue_get_stats(struct serialqueue *sq, char *buf, int len);
@@ -208,6 +262,39 @@ defs_trdispatch = """
         , uint64_t expire_ticks, uint64_t min_extend_ticks);
 """
 
+defs_bulk_sensor = """
+    struct accel_decode {
+        int format, axes_pos[3];
+        double axes_scale[3];
+        double time_base, chip_base, inv_freq;
+        int error_count, last_index;
+    };
+    struct angle_decode {
+        int is_tcode_absolute, time_shift;
+        double sample_ticks, static_delay;
+        double last_chip_mcu_clock, last_chip_clock, chip_freq;
+        double clock_base, time_base, inv_freq;
+        int64_t last_angle;
+        int error_count;
+    };
+
+    int accel_decode_block(struct accel_decode *ad, double chip_clock
+        , uint8_t *data, int len, double *out, int max_samples);
+    int angle_decode_block(struct angle_decode *ad, double msg_mclock
+        , uint8_t *data, int len, double *times, int64_t *angles
+        , int max_samples);
+"""
+
+defs_gcode_parse = """
+    struct gcode_params {
+        uint32_t mask;
+        double values[26];
+    };
+
+    int gcode_parse_line(struct gcode_params *gp, const char *line
+        , int len);
+"""
+
 defs_pyhelper = """
     void set_python_logging_callback(void (*func)(const char *));
     double get_monotonic(void);
@@ -219,10 +306,11 @@ defs_std = """
 
 defs_all = [
     defs_pyhelper, defs_serialqueue, defs_std, defs_stepcompress,
-    defs_itersolve, defs_trapq, defs_trdispatch,
+    defs_itersolve, defs_stepgen, defs_trapq, defs_lookahead, defs_trdispatch,
     defs_kin_cartesian, defs_kin_corexy, defs_kin_corexz, defs_kin_delta,
     defs_kin_deltesian, defs_kin_polar, defs_kin_rotary_delta, defs_kin_winch,
-    defs_kin_extruder, defs_kin_shaper, defs_kin_idex,
+    defs_kin_extruder, defs_kin_shaper, defs_kin_idex, defs_bulk_sensor,
+    defs_gcode_parse,
 ]
 
 # Update filenames to an absolute path
@@ -0,0 +1,211 @@
+// Decoding of bulk sensor measurement messages
+//
+// Copyright (C) 2026  agent <agent@local>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include <math.h> // round
+#include <stdint.h> // uint8_t
+#include "compiler.h" // __visible
+
+// The host receives thousands of sensor measurements per second.
+// This code converts the raw measurement data in each mcu message
+// into an array of doubles (that the caller may then process in bulk
+// instead of processing each sample in python).
+
+#define AD_ADXL345 'a'
+#define AD_INT16_LE 'l'
+#define AD_INT16_BE 'b'
+#define AD_COMPRESSED 'c'
+
+struct accel_decode {
+    // Parameters set by caller
+    int format, axes_pos[3];
+    double axes_scale[3];
+    double time_base, chip_base, inv_freq;
+    // Results
+    int error_count, last_index;
+};
+
+// Round a value to six decimal places
+static double
+round6(double v)
+{
+    return round(v * 1000000.) / 1000000.;
+}
+
+// Store a decoded accelerometer sample
+static double *
+accel_store(struct accel_decode *ad, double *out, double chip_clock
+            , int32_t *raw)
+{
+    out[0] = round6(ad->time_base + (chip_clock - ad->chip_base)*ad->inv_freq);
+    int i;
+    for (i=0; i<3; i++)
+        out[i+1] = round6(raw[ad->axes_pos[i]] * ad->axes_scale[i]);
+    return out + 4;
+}
+
+// Decode the data in an adxl345 message
+static int
+decode_adxl345(struct accel_decode *ad, double chip_clock, uint8_t *data
+               , int len, double *out)
+{
+    int i, count = len / 5;
+    double *o = out;
+    for (i=0; i<count; i++, data+=5) {
+        uint8_t xzhigh = data[3], yzhigh = data[4];
+        if (yzhigh & 0x80) {
+            ad->error_count++;
+            continue;
+        }
+        int32_t raw[3];
+        raw[0] = (data[0] | ((xzhigh & 0x1f) << 8)) - ((xzhigh & 0x10) << 9);
+        raw[1] = (data[1] | ((yzhigh & 0x1f) << 8)) - ((yzhigh & 0x10) << 9);
+        raw[2] = ((data[2] | ((xzhigh & 0xe0) << 3) | ((yzhigh & 0xe0) << 6))
+                  - ((yzhigh & 0x40) << 7));
+        o = accel_store(ad, o, chip_clock + i, raw);
+    }
+    if (count)
+        ad->last_index = count - 1;
+    return (o - out) / 4;
+}
+
+// Decode messages containing 16bit two's complement x, y, z values
+static int
+decode_int16(struct accel_decode *ad, double chip_clock, uint8_t *data
+             , int len, double *out, int is_big_endian)
+{
+    int i, j, count = len / 6;
+    double *o = out;
+    for (i=0; i<count; i++, data+=6) {
+        int32_t raw[3];
+        for (j=0; j<3; j++) {
+            uint8_t b0 = data[j*2], b1 = data[j*2 + 1];
+            raw[j] = is_big_endian ? (int16_t)((b0 << 8) | b1)
+                                   : (int16_t)((b1 << 8) | b0);
+        }
+        o = accel_store(ad, o, chip_clock + i, raw);
+    }
+    if (count)
+        ad->last_index = count - 1;
+    return count;
+}
+
+// Decode messages compressed by the mcu code in src/sensor_bulk.c
+static int
+decode_compressed(struct accel_decode *ad, double chip_clock, uint8_t *data
+                  , int len, double *out, int max_samples)
+{
+    int32_t vals[3] = {0, 0, 0};
+    int axis = 0, count = 0, pos = 0;
+    double *o = out;
+    while (pos < len) {
+        uint32_t v = 0;
+        int shift = 0;
+        for (;;) {
+            uint8_t c = data[pos++];
+            v |= (uint32_t)(c & 0x7f) << shift;
+            shift += 7;
+            if (!(c & 0x80) || pos >= len || shift > 21)
+                break;
+        }
+        if (!axis) {
+            if (v & 1) {
+                // Sample could not be read
+                ad->error_count++;
+                count++;
+                continue;
+            }
+            v >>= 1;
+        }
+        vals[axis] += (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+        if (++axis < 3)
+            continue;
+        axis = 0;
+        if (o - out >= max_samples * 4)
+            break;
+        o = accel_store(ad, o, chip_clock + count, vals);
+        count++;
+    }
+    if (count)
+        ad->last_index = count - 1;
+    return (o - out) / 4;
+}
+
+// Decode the accelerometer samples in a message.  The time, x, y,
+// and z values of each sample are stored in 'out'.  Returns the
+// number of samples stored.
+int __visible
+accel_decode_block(struct accel_decode *ad, double chip_clock
+                   , uint8_t *data, int len, double *out, int max_samples)
+{
+    switch (ad->format) {
+    case AD_ADXL345:
+        if (len / 5 > max_samples)
+            return -1;
+        return decode_adxl345(ad, chip_clock, data, len, out);
+    case AD_INT16_LE:
+    case AD_INT16_BE:
+        if (len / 6 > max_samples)
+            return -1;
+        return decode_int16(ad, chip_clock, data, len, out
+                            , ad->format == AD_INT16_BE);
+    case AD_COMPRESSED:
+        return decode_compressed(ad, chip_clock, data, len, out, max_samples);
+    }
+    return -1;
+}
+
+#define TCODE_ERROR 0xff
+
+struct angle_decode {
+    // Parameters set by caller
+    int is_tcode_absolute, time_shift;
+    double sample_ticks, static_delay;
+    double last_chip_mcu_clock, last_chip_clock, chip_freq;
+    double clock_base, time_base, inv_freq;
+    // State and results
+    int64_t last_angle;
+    int error_count;
+};
+
+// Decode the angle samples in a message.  The print time and angle
+// of each sample are stored in 'times' and 'angles'.  Returns the
+// number of samples stored.
+int __visible
+angle_decode_block(struct angle_decode *ad, double msg_mclock
+                   , uint8_t *data, int len, double *times, int64_t *angles
+                   , int max_samples)
+{
+    int i, count = 0;
+    for (i=0; i<len/3; i++, data+=3) {
+        uint8_t tcode = data[0];
+        if (tcode == TCODE_ERROR) {
+            ad->error_count++;
+            continue;
+        }
+        if (count >= max_samples)
+            return -1;
+        uint16_t raw_angle = data[1] | (data[2] << 8);
+        int16_t angle_diff = raw_angle - (uint16_t)ad->last_angle;
+        ad->last_angle += angle_diff;
+        double mclock = msg_mclock + i * ad->sample_ticks, sclock;
+        if (ad->is_tcode_absolute) {
+            // tcode is tle5012b frame counter
+            double mdiff = mclock - ad->last_chip_mcu_clock;
+            int64_t chip_mclock = (ad->last_chip_clock
+                                   + (int64_t)(mdiff * ad->chip_freq + .5));
+            int16_t cdiff = (tcode << 10) - chip_mclock;
+            sclock = mclock + (cdiff - 0x800) / ad->chip_freq;
+        } else {
+            // tcode is mcu clock offset shifted by time_shift
+            sclock = mclock + (tcode << ad->time_shift);
+        }
+        double ptime = ad->time_base + (sclock - ad->clock_base)*ad->inv_freq;
+        times[count] = round6(ptime - ad->static_delay);
+        angles[count] = ad->last_angle;
+        count++;
+    }
+    return count;
+}
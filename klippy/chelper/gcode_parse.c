@@ -0,0 +1,135 @@
+// Fast parsing of traditional g-code commands
+//
+// Copyright (C) 2026  agent <agent@local>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include <stdint.h> // uint32_t
+#include <stdlib.h> // strtod
+#include <string.h> // memcpy
+#include "compiler.h" // __visible
+
+// G-Code files contain many thousands of simple move commands (eg,
+// "G1 X10.5 Y20 E0.3"). This code decodes a "traditional" command (a
+// letter and a number) with single letter numeric parameters into an
+// array of doubles, so that the caller does not need to split the
+// line and build a parameter dictionary in python.  Lines in any
+// other form are rejected so that the caller uses the full parser.
+
+struct gcode_params {
+    uint32_t mask;
+    double values[26];
+};
+
+#define MAX_NUMBER 64
+
+static int
+is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v'
+        || c == '\f';
+}
+
+static int
+is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static int
+to_upper(char c)
+{
+    return c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c;
+}
+
+static int
+is_letter(char c)
+{
+    c = to_upper(c);
+    return c >= 'A' && c <= 'Z';
+}
+
+static const char *
+skip_space(const char *p, const char *end)
+{
+    while (p < end && is_space(*p))
+        p++;
+    return p;
+}
+
+// Parse a number of the form "[+-]digits[.digits]" (as accepted by
+// python's float()).  Returns NULL if the text is not such a number.
+static const char *
+parse_number(const char *p, const char *end, double *value)
+{
+    const char *start = p;
+    if (p < end && (*p == '+' || *p == '-'))
+        p++;
+    int digits = 0, dot = 0;
+    for (; p < end; p++) {
+        if (is_digit(*p))
+            digits++;
+        else if (*p == '.' && !dot)
+            dot = 1;
+        else
+            break;
+    }
+    int len = p - start;
+    if (!digits || len >= MAX_NUMBER)
+        return NULL;
+    // Copy the number so strtod() can't parse past its end (eg, "1E5")
+    char buf[MAX_NUMBER];
+    memcpy(buf, start, len);
+    buf[len] = '\0';
+    *value = strtod(buf, NULL);
+    return p;
+}
+
+// Decode a g-code line.  Returns a command id of (letter << 16) |
+// number on success, or zero if the line is not a simple traditional
+// command.
+int __visible
+gcode_parse_line(struct gcode_params *gp, const char *line, int len)
+{
+    const char *p = line, *end = line + len;
+    const char *comment = memchr(line, ';', len);
+    if (comment)
+        end = comment;
+    // Command letter and number (without leading zeros or fraction)
+    p = skip_space(p, end);
+    if (p >= end || !is_letter(*p))
+        return 0;
+    int letter = to_upper(*p++);
+    if (letter == 'N')
+        return 0;
+    if (p >= end || !is_digit(*p) || (*p == '0' && p + 1 < end
+                                      && is_digit(p[1])))
+        return 0;
+    uint32_t number = 0;
+    while (p < end && is_digit(*p)) {
+        number = number * 10 + *p++ - '0';
+        if (number > 0xffff)
+            return 0;
+    }
+    // Parameters
+    gp->mask = 0;
+    for (;;) {
+        p = skip_space(p, end);
+        if (p >= end)
+            break;
+        if (!is_letter(*p))
+            return 0;
+        int param = to_upper(*p++);
+        uint32_t bit = 1 << (param - 'A');
+        if (gp->mask & bit)
+            return 0;
+        p = skip_space(p, end);
+        p = parse_number(p, end, &gp->values[param - 'A']);
+        if (!p)
+            return 0;
+        gp->mask |= bit;
+        if (p < end && !is_space(*p) && !is_letter(*p))
+            return 0;
+    }
+    return (letter << 16) | number;
+}
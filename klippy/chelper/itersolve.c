@@ -26,8 +26,8 @@ struct timepos {
 
 // Generate step times for a portion of a move
 static int32_t
-itersolve_gen_steps_range(struct stepper_kinematics *sk, struct move *m
-                          , double abs_start, double abs_end)
+itersolve_gen_steps_search(struct stepper_kinematics *sk, struct move *m
+                           , double abs_start, double abs_end)
 {
     sk_calc_callback calc_position_cb = sk->calc_position_cb;
     double half_step = .5 * sk->step_dist;
@@ -128,6 +128,267 @@ itersolve_gen_steps_range(struct stepper_kinematics *sk, struct move *m
 }
 
 
+/****************************************************************
+ * Pre-sampled solver
+ ****************************************************************/
+
+// Kinematics that can evaluate many positions in a single call
+// (calc_position_batch_cb) are sampled at regular time intervals
+// across the move.  The samples locate each step crossing and the
+// exact step time is then refined using only the positions that
+// bracket the step.
+
+#define PRESAMPLE_TIME .000250
+#define PRESAMPLE_COUNT 32
+
+// Quadratic fit of position vs time across three samples (which is
+// exact for moves on linear kinematics)
+struct sample_fit {
+    double time, position, b, c;
+};
+
+static void
+fit_samples(struct sample_fit *sf, struct timepos s0, struct timepos s1
+            , struct timepos s2)
+{
+    double h1 = s1.time - s0.time, h2 = s2.time - s1.time;
+    double d1 = (s2.position - s1.position) / h2;
+    sf->c = (d1 - (s1.position - s0.position) / h1) / (h1 + h2);
+    sf->b = d1 - sf->c * h2;
+    sf->time = s1.time;
+    sf->position = s1.position;
+}
+
+// Estimate the time a step occurs using a sample fit
+static double
+guess_step_time(struct sample_fit *sf, double target)
+{
+    // Solve c*u^2 + b*u + (position - target) = 0 for u = t - time
+    double b = sf->b, p = sf->position - target;
+    double disc = b*b - 4. * sf->c * p;
+    if (disc < 0.)
+        return -1.;
+    double q = b + (b < 0. ? -sqrt(disc) : sqrt(disc));
+    return sf->time - 2. * p / q;
+}
+
+// Find the time a step occurs given a bracketing low and high guess
+static double
+find_step_time(struct stepper_kinematics *sk, struct move *m, double target
+               , int sdir, struct timepos low, struct timepos high
+               , double next_time)
+{
+    // Use the "Illinois" variant of the false position method
+    double low_dist = low.position - target, high_dist = high.position - target;
+    int side = 0;
+    for (;;) {
+        if (!(next_time > low.time && next_time < high.time)) { // or NaN
+            next_time = ((low.time*high_dist - high.time*low_dist)
+                         / (high_dist - low_dist));
+            if (!(next_time > low.time && next_time < high.time))
+                next_time = (low.time + high.time) * .5;
+        }
+        double dist = sk->calc_position_cb(sk, m, next_time) - target;
+        if (fabs(dist) <= .000000001)
+            return next_time;
+        if (sdir ? dist > 0. : dist < 0.) {
+            high.time = next_time;
+            high_dist = dist;
+            if (side > 0)
+                low_dist *= .5;
+            side = 1;
+        } else {
+            low.time = next_time;
+            low_dist = dist;
+            if (side < 0)
+                high_dist *= .5;
+            side = -1;
+        }
+        if (high.time - low.time <= .000000001)
+            return next_time;
+        next_time = -1.;
+    }
+}
+
+// Generate step times for a portion of a move using batch evaluation
+static int32_t
+itersolve_gen_steps_presampled(struct stepper_kinematics *sk, struct move *m
+                               , double abs_start, double abs_end)
+{
+    double half_step = .5 * sk->step_dist;
+    double start = abs_start - m->print_time, end = abs_end - m->print_time;
+    if (start < 0.)
+        start = 0.;
+    if (end > m->move_t)
+        end = m->move_t;
+    int sdir = stepcompress_get_step_dir(sk->sc);
+    double target = sk->commanded_pos + (sdir ? half_step : -half_step);
+    int count = (end - start) * (1. / PRESAMPLE_TIME) + 1., pos = 0;
+    double sample_time = (end - start) / count;
+    struct timepos low = {start, sk->commanded_pos}, s0 = low, s1 = low;
+    struct sample_fit sf = { 0. };
+    int sample_count = 0;
+    double times[PRESAMPLE_COUNT], positions[PRESAMPLE_COUNT];
+    while (start < end && pos < count) {
+        // Evaluate the next batch of samples
+        int num = count - pos, i;
+        if (num > PRESAMPLE_COUNT)
+            num = PRESAMPLE_COUNT;
+        for (i=0; i<num; i++)
+            times[i] = start + (pos + i + 1) * sample_time;
+        pos += num;
+        if (pos >= count)
+            times[num-1] = end;
+        sk->calc_position_batch_cb(sk, m, times, positions, num);
+        // Generate any steps between samples
+        for (i=0; i<num; i++) {
+            struct timepos high = {times[i], positions[i]};
+            int is_dir_change = 0;
+            double rel_dist;
+            if (sample_count >= 2)
+                fit_samples(&sf, s0, s1, high);
+            for (;;) {
+                double dist = high.position - target;
+                rel_dist = sdir ? dist : -dist;
+                if (rel_dist >= -.000000001) {
+                    // Found position past target - submit step
+                    double guess = -1.;
+                    if (sample_count >= 2 && !is_dir_change)
+                        guess = guess_step_time(&sf, target);
+                    double step_time = find_step_time(sk, m, target, sdir
+                                                      , low, high, guess);
+                    int ret = stepcompress_append(sk->sc, sdir, m->print_time
+                                                  , step_time);
+                    if (ret)
+                        return ret;
+                    low.time = step_time;
+                    low.position = target;
+                    target = (sdir ? target + half_step + half_step
+                              : target - half_step - half_step);
+                    continue;
+                }
+                if (rel_dist < -(half_step + half_step + .000000010)) {
+                    // Found direction change
+                    sdir = !sdir;
+                    target = (sdir ? target + half_step + half_step
+                              : target - half_step - half_step);
+                    is_dir_change = 1;
+                    continue;
+                }
+                break;
+            }
+            if (!is_dir_change && rel_dist >= -half_step)
+                // Avoid rollback if stepper fully reaches step position
+                stepcompress_commit(sk->sc);
+            s0 = s1;
+            low = s1 = high;
+            sample_count++;
+        }
+    }
+    sk->commanded_pos = target - (sdir ? half_step : -half_step);
+    if (sk->post_cb)
+        sk->post_cb(sk);
+    return 0;
+}
+
+
+
+/****************************************************************
+ * Closed-form solver
+ ****************************************************************/
+
+// Kinematics where the stepper position is 'base + scale * distance'
+// along a move (calc_linear_cb) have a stepper position that is a
+// quadratic in time on constant acceleration moves.  The step times
+// can then be calculated directly.
+
+// Generate step times for a portion of a move on linear kinematics
+static int32_t
+itersolve_gen_steps_linear(struct stepper_kinematics *sk, struct move *m
+                           , double abs_start, double abs_end)
+{
+    double start = abs_start - m->print_time, end = abs_end - m->print_time;
+    if (start < 0.)
+        start = 0.;
+    if (end > m->move_t)
+        end = m->move_t;
+    double base, scale;
+    sk->calc_linear_cb(sk, m, &base, &scale);
+    double commanded_pos = sk->commanded_pos;
+    if (scale && start < end) {
+        // Split the move at the point the velocity reaches zero (if any)
+        double start_v = m->start_v, half_accel = m->half_accel;
+        double seg_times[3] = { start, end, end };
+        if (half_accel) {
+            double zero_v_time = -start_v / (2. * half_accel);
+            if (zero_v_time > start && zero_v_time < end)
+                seg_times[1] = zero_v_time;
+        }
+        double inv_scale = 1. / scale;
+        double seg_start = start, seg_start_dist = move_get_distance(m, start);
+        int i;
+        for (i=1; i<3; i++) {
+            double seg_end = seg_times[i];
+            if (seg_end <= seg_start)
+                continue;
+            double seg_end_dist = move_get_distance(m, seg_end);
+            double seg_end_pos = base + scale * seg_end_dist;
+            int sdir = scale * (seg_end_dist - seg_start_dist) > 0.;
+            double step_dist = sdir ? sk->step_dist : -sk->step_dist;
+            double target = commanded_pos + .5 * step_dist;
+            double seg_v = start_v + 2. * half_accel * seg_start;
+            double rel_dist;
+            for (;;) {
+                rel_dist = sdir ? seg_end_pos - target : target - seg_end_pos;
+                if (rel_dist < -.000000001)
+                    break;
+                // Solve half_accel*t^2 + seg_v*t = dist for t
+                double dist = (target - base) * inv_scale - seg_start_dist;
+                double disc = seg_v * seg_v + 4. * half_accel * dist;
+                double q = disc > 0. ? sqrt(disc) : 0.;
+                if (seg_v < 0. || (!seg_v && dist < 0.))
+                    q = -q;
+                double step_time = seg_start;
+                if (seg_v + q)
+                    step_time += 2. * dist / (seg_v + q);
+                if (step_time > seg_end)
+                    step_time = seg_end;
+                else if (!(step_time >= seg_start)) // or NaN
+                    step_time = seg_start;
+                int ret = stepcompress_append(sk->sc, sdir, m->print_time
+                                              , step_time);
+                if (ret)
+                    return ret;
+                commanded_pos = target + .5 * step_dist;
+                target += step_dist;
+            }
+            if (rel_dist >= -.5 * sk->step_dist)
+                // Avoid rollback if stepper fully reaches step position
+                stepcompress_commit(sk->sc);
+            seg_start = seg_end;
+            seg_start_dist = seg_end_dist;
+        }
+    }
+    sk->commanded_pos = commanded_pos;
+    if (sk->post_cb)
+        sk->post_cb(sk);
+    return 0;
+}
+
+// Generate step times for a portion of a move
+static int32_t
+itersolve_gen_steps_range(struct stepper_kinematics *sk, struct move *m
+                          , double abs_start, double abs_end)
+{
+    // The closed-form solver requires constant acceleration
+    if (sk->calc_linear_cb && !m->sixth_jerk)
+        return itersolve_gen_steps_linear(sk, m, abs_start, abs_end);
+    if (sk->calc_position_batch_cb)
+        return itersolve_gen_steps_presampled(sk, m, abs_start, abs_end);
+    return itersolve_gen_steps_search(sk, m, abs_start, abs_end);
+}
+
+
 /****************************************************************
  * Interface functions
  ****************************************************************/
@@ -278,3 +539,18 @@ itersolve_get_commanded_pos(struct stepper_kinematics *sk)
 {
     return sk->commanded_pos;
 }
+
+// Evaluate the stepper position at several times in a move
+void
+itersolve_calc_position_batch(struct stepper_kinematics *sk, struct move *m
+                              , double *move_times, double *positions
+                              , int count)
+{
+    if (sk->calc_position_batch_cb) {
+        sk->calc_position_batch_cb(sk, m, move_times, positions, count);
+        return;
+    }
+    int i;
+    for (i=0; i<count; i++)
+        positions[i] = sk->calc_position_cb(sk, m, move_times[i]);
+}
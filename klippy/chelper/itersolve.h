@@ -11,6 +11,12 @@ struct stepper_kinematics;
 struct move;
 typedef double (*sk_calc_callback)(struct stepper_kinematics *sk, struct move *m
                                    , double move_time);
+typedef void (*sk_calc_batch_callback)(struct stepper_kinematics *sk
+                                       , struct move *m, double *move_times
+                                       , double *positions, int count);
+typedef void (*sk_calc_linear_callback)(struct stepper_kinematics *sk
+                                        , struct move *m, double *base
+                                        , double *scale);
 typedef void (*sk_post_callback)(struct stepper_kinematics *sk);
 struct stepper_kinematics {
     double step_dist, commanded_pos;
@@ -22,6 +28,8 @@ struct stepper_kinematics {
     double gen_steps_pre_active, gen_steps_post_active;
 
     sk_calc_callback calc_position_cb;
+    sk_calc_batch_callback calc_position_batch_cb;
+    sk_calc_linear_callback calc_linear_cb;
     sk_post_callback post_cb;
 };
 
@@ -37,5 +45,8 @@ double itersolve_calc_position_from_coord(struct stepper_kinematics *sk
 void itersolve_set_position(struct stepper_kinematics *sk
                             , double x, double y, double z);
 double itersolve_get_commanded_pos(struct stepper_kinematics *sk);
+void itersolve_calc_position_batch(struct stepper_kinematics *sk
+                                   , struct move *m, double *move_times
+                                   , double *positions, int count);
 
 #endif // itersolve.h
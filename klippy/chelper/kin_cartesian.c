@@ -32,6 +32,57 @@ cart_stepper_z_calc_position(struct stepper_kinematics *sk, struct move *m
     return move_get_coord(m, move_time).z;
 }
 
+static void
+cart_stepper_x_calc_position_batch(struct stepper_kinematics *sk
+                                   , struct move *m, double *move_times
+                                   , double *positions, int count)
+{
+    move_get_position_batch(m, m->start_pos.x, m->axes_r.x
+                            , move_times, positions, count);
+}
+
+static void
+cart_stepper_y_calc_position_batch(struct stepper_kinematics *sk
+                                   , struct move *m, double *move_times
+                                   , double *positions, int count)
+{
+    move_get_position_batch(m, m->start_pos.y, m->axes_r.y
+                            , move_times, positions, count);
+}
+
+static void
+cart_stepper_z_calc_position_batch(struct stepper_kinematics *sk
+                                   , struct move *m, double *move_times
+                                   , double *positions, int count)
+{
+    move_get_position_batch(m, m->start_pos.z, m->axes_r.z
+                            , move_times, positions, count);
+}
+
+static void
+cart_stepper_x_calc_linear(struct stepper_kinematics *sk, struct move *m
+                            , double *base, double *scale)
+{
+    *base = m->start_pos.x;
+    *scale = m->axes_r.x;
+}
+
+static void
+cart_stepper_y_calc_linear(struct stepper_kinematics *sk, struct move *m
+                            , double *base, double *scale)
+{
+    *base = m->start_pos.y;
+    *scale = m->axes_r.y;
+}
+
+static void
+cart_stepper_z_calc_linear(struct stepper_kinematics *sk, struct move *m
+                            , double *base, double *scale)
+{
+    *base = m->start_pos.z;
+    *scale = m->axes_r.z;
+}
+
 struct stepper_kinematics * __visible
 cartesian_stepper_alloc(char axis)
 {
@@ -39,12 +90,18 @@ cartesian_stepper_alloc(char axis)
     memset(sk, 0, sizeof(*sk));
     if (axis == 'x') {
         sk->calc_position_cb = cart_stepper_x_calc_position;
+        sk->calc_position_batch_cb = cart_stepper_x_calc_position_batch;
+        sk->calc_linear_cb = cart_stepper_x_calc_linear;
         sk->active_flags = AF_X;
     } else if (axis == 'y') {
         sk->calc_position_cb = cart_stepper_y_calc_position;
+        sk->calc_position_batch_cb = cart_stepper_y_calc_position_batch;
+        sk->calc_linear_cb = cart_stepper_y_calc_linear;
         sk->active_flags = AF_Y;
     } else if (axis == 'z') {
         sk->calc_position_cb = cart_stepper_z_calc_position;
+        sk->calc_position_batch_cb = cart_stepper_z_calc_position_batch;
+        sk->calc_linear_cb = cart_stepper_z_calc_linear;
         sk->active_flags = AF_Z;
     }
     return sk;
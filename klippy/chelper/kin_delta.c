@@ -27,6 +27,27 @@ delta_stepper_calc_position(struct stepper_kinematics *sk, struct move *m
     return sqrt(ds->arm2 - dx*dx - dy*dy) + c.z;
 }
 
+static void
+delta_stepper_calc_position_batch(struct stepper_kinematics *sk, struct move *m
+                                  , double *move_times, double *positions
+                                  , int count)
+{
+    struct delta_stepper *ds = container_of(sk, struct delta_stepper, sk);
+    double arm2 = ds->arm2;
+    double dx0 = ds->tower_x - m->start_pos.x, rx = m->axes_r.x;
+    double dy0 = ds->tower_y - m->start_pos.y, ry = m->axes_r.y;
+    double z0 = m->start_pos.z, rz = m->axes_r.z;
+    double start_v = m->start_v, half_accel = m->half_accel;
+    double sixth_jerk = m->sixth_jerk;
+    int i;
+    for (i=0; i<count; i++) {
+        double t = move_times[i];
+        double move_dist = (start_v + (half_accel + sixth_jerk * t) * t) * t;
+        double dx = dx0 - rx * move_dist, dy = dy0 - ry * move_dist;
+        positions[i] = sqrt(arm2 - dx*dx - dy*dy) + z0 + rz * move_dist;
+    }
+}
+
 struct stepper_kinematics * __visible
 delta_stepper_alloc(double arm2, double tower_x, double tower_y)
 {
@@ -36,6 +57,7 @@ delta_stepper_alloc(double arm2, double tower_x, double tower_y)
     ds->tower_x = tower_x;
     ds->tower_y = tower_y;
     ds->sk.calc_position_cb = delta_stepper_calc_position;
+    ds->sk.calc_position_batch_cb = delta_stepper_calc_position_batch;
     ds->sk.active_flags = AF_X | AF_Y | AF_Z;
     return &ds->sk;
 }
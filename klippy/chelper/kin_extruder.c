@@ -4,11 +4,13 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
+#include <math.h> // sqrt
 #include <stddef.h> // offsetof
 #include <stdlib.h> // malloc
 #include <string.h> // memset
 #include "compiler.h" // __visible
 #include "itersolve.h" // struct stepper_kinematics
+#include "kin_shaper.h" // struct shaper_pulses
 #include "pyhelper.h" // errorf
 #include "trapq.h" // move_get_distance
 
@@ -19,107 +21,473 @@
 // deceleration). The formula is:
 //     pa_position(t) = (nominal_position(t)
 //                       + pressure_advance * nominal_velocity(t))
+// (A non-linear pressure advance may also be used - see below.)
 // Which is then "smoothed" using a weighted average:
 //     smooth_position(t) = (
 //         definitive_integral(pa_position(x) * (smooth_time/2 - abs(t-x)) * dx,
 //                             from=t-smooth_time/2, to=t+smooth_time/2)
 //         / ((smooth_time/2)**2))
+// An input shaper may then be applied to the resulting position:
+//     shaped_position(t) = sum(a_i * smooth_position(t + t_i))
 
 // Calculate the definitive integral of the motion formula:
-//   position(t) = base + t * (start_v + t * half_accel)
+//   position(t) = base + t * (start_v + t * (half_accel + t * sixth_jerk))
 static double
 extruder_integrate(double base, double start_v, double half_accel
-                   , double start, double end)
+                   , double sixth_jerk, double start, double end)
 {
     double half_v = .5 * start_v, sixth_a = (1. / 3.) * half_accel;
-    double si = start * (base + start * (half_v + start * sixth_a));
-    double ei = end * (base + end * (half_v + end * sixth_a));
+    double quarter_j = .25 * sixth_jerk;
+    double si = start * (base + start * (half_v + start * (
+                                             sixth_a + start * quarter_j)));
+    double ei = end * (base + end * (half_v + end * (
+                                         sixth_a + end * quarter_j)));
     return ei - si;
 }
 
 // Calculate the definitive integral of time weighted position:
-//   weighted_position(t) = t * (base + t * (start_v + t * half_accel))
+//   weighted_position(t) = t * position(t)
 static double
 extruder_integrate_time(double base, double start_v, double half_accel
-                        , double start, double end)
+                        , double sixth_jerk, double start, double end)
 {
     double half_b = .5 * base, third_v = (1. / 3.) * start_v;
-    double eighth_a = .25 * half_accel;
-    double si = start * start * (half_b + start * (third_v + start * eighth_a));
-    double ei = end * end * (half_b + end * (third_v + end * eighth_a));
+    double eighth_a = .25 * half_accel, fifth_j = .2 * sixth_jerk;
+    double si = start * start * (half_b + start * (third_v + start * (
+                                                       eighth_a
+                                                       + start * fifth_j)));
+    double ei = end * end * (half_b + end * (third_v + end * (
+                                                 eighth_a + end * fifth_j)));
     return ei - si;
 }
 
+// Return the nominal velocity of a move at the given move time
+static inline double
+move_get_velocity(struct move *m, double move_time)
+{
+    return m->start_v + (2. * m->half_accel + 3. * m->sixth_jerk * move_time)
+                        * move_time;
+}
+
+// A non-linear pressure advance may be configured as a piecewise
+// linear function of the nominal velocity - above each of a list of
+// velocities a different pressure advance coefficient is used:
+//     pa_position(t) = (nominal_position(t) + band_offset
+//                       + band_advance * nominal_velocity(t))
+// (with the band offsets chosen so that pa_position() is continuous).
+// Within each band the position is then a polynomial in time just
+// like it is with linear pressure advance.
+
+#define PA_MAX_BANDS 8
+
+struct pa_curve {
+    int num_bands;
+    struct {
+        double velocity, factor, advance, offset;
+    } bands[PA_MAX_BANDS];
+};
+
+// Calculate the advance and offset of each band
+static void
+pa_curve_update(struct pa_curve *pc, double pressure_advance)
+{
+    pc->bands[0].velocity = pc->bands[0].offset = 0.;
+    pc->bands[0].factor = 1.;
+    pc->bands[0].advance = pressure_advance;
+    int i;
+    for (i = 1; i < pc->num_bands; i++) {
+        double velocity = pc->bands[i].velocity;
+        double advance = pressure_advance * pc->bands[i].factor;
+        pc->bands[i].advance = advance;
+        pc->bands[i].offset = (pc->bands[i-1].offset
+                               + (pc->bands[i-1].advance - advance) * velocity);
+    }
+}
+
+// Find the pressure advance band in use at the given velocity
+static inline int
+pa_curve_band(struct pa_curve *pc, double velocity)
+{
+    int band = 0;
+    while (band + 1 < pc->num_bands && velocity >= pc->bands[band+1].velocity)
+        band++;
+    return band;
+}
+
+// Calculate the position polynomial of a move (relative to the start
+// of the move) when using the given pressure advance band
+static inline void
+pa_band_coefs(struct move *m, struct pa_curve *pc, int band
+              , double *base, double *start_v, double *half_accel)
+{
+    double advance = pc->bands[band].advance;
+    *base += pc->bands[band].offset + advance * m->start_v;
+    *start_v = m->start_v + advance * 2. * m->half_accel;
+    *half_accel = m->half_accel + advance * 3. * m->sixth_jerk;
+}
+
+// Find the move time at which the velocity of a move reaches the
+// given velocity.  The velocity of each move on the trapq changes
+// monotonically, so there is at most one such time within the move.
+static double
+move_velocity_time(struct move *m, double velocity)
+{
+    double a = 3. * m->sixth_jerk, b = 2. * m->half_accel;
+    double c = m->start_v - velocity;
+    if (!a)
+        return -c / b;
+    // Solve a*t^2 + b*t + c = 0 (using a numerically stable form)
+    double disc = b * b - 4. * a * c;
+    if (disc < 0.)
+        return m->move_t;
+    double q = -.5 * (b + (b < 0. ? -sqrt(disc) : sqrt(disc)));
+    double t1 = q / a, t2 = q ? c / q : t1;
+    if (t1 > t2) {
+        double t = t1;
+        t1 = t2;
+        t2 = t;
+    }
+    return t1 >= 0. ? t1 : t2;
+}
+
+// Find the move time at which the velocity of a move leaves the
+// given pressure advance band (and the band that follows it)
+static inline double
+pa_band_end(struct move *m, struct pa_curve *pc, int band, int *next_band)
+{
+    double dir = m->half_accel + 1.5 * m->sixth_jerk * m->move_t, velocity;
+    if (dir > 0. && band + 1 < pc->num_bands) {
+        *next_band = band + 1;
+        velocity = pc->bands[band+1].velocity;
+    } else if (dir < 0. && band > 0) {
+        *next_band = band - 1;
+        velocity = pc->bands[band].velocity;
+    } else {
+        *next_band = band;
+        return m->move_t;
+    }
+    double end = move_velocity_time(m, velocity);
+    return end < m->move_t ? end : m->move_t;
+}
+
 // Calculate the definitive integral of extruder for a given move
 static double
-pa_move_integrate(struct move *m, double pressure_advance
+pa_move_integrate(struct move *m, struct pa_curve *pc
                   , double base, double start, double end, double time_offset)
 {
     if (start < 0.)
         start = 0.;
     if (end > m->move_t)
         end = m->move_t;
-    // Calculate base position and velocity with pressure advance
+    double ha = m->half_accel, sj = m->sixth_jerk;
     int can_pressure_advance = m->axes_r.y != 0.;
-    if (!can_pressure_advance)
-        pressure_advance = 0.;
-    base += pressure_advance * m->start_v;
-    double start_v = m->start_v + pressure_advance * 2. * m->half_accel;
-    // Calculate definitive integral
-    double ha = m->half_accel;
-    double iext = extruder_integrate(base, start_v, ha, start, end);
-    double wgt_ext = extruder_integrate_time(base, start_v, ha, start, end);
-    return wgt_ext - time_offset * iext;
+    if (!can_pressure_advance) {
+        double iext = extruder_integrate(base, m->start_v, ha, sj, start, end);
+        double wgt_ext = extruder_integrate_time(base, m->start_v, ha, sj
+                                                 , start, end);
+        return wgt_ext - time_offset * iext;
+    }
+    // Integrate each pressure advance band crossed by the move
+    double res = 0.;
+    int band = pa_curve_band(pc, move_get_velocity(m, start));
+    for (;;) {
+        int next_band;
+        double band_end = pa_band_end(m, pc, band, &next_band);
+        if (band_end > end)
+            band_end = end;
+        if (band_end > start) {
+            // Calculate base position and velocity with pressure advance
+            double band_base = base, start_v, band_ha;
+            pa_band_coefs(m, pc, band, &band_base, &start_v, &band_ha);
+            // Calculate definitive integral
+            double iext = extruder_integrate(band_base, start_v, band_ha, sj
+                                             , start, band_end);
+            double wgt_ext = extruder_integrate_time(band_base, start_v
+                                                     , band_ha, sj
+                                                     , start, band_end);
+            res += wgt_ext - time_offset * iext;
+            start = band_end;
+        }
+        if (band_end >= end)
+            return res;
+        band = next_band;
+    }
 }
 
 // Calculate the definitive integral of the extruder over a range of moves
 static double
 pa_range_integrate(struct move *m, double move_time
-                   , double pressure_advance, double hst)
+                   , struct pa_curve *pc, double hst)
 {
     // Calculate integral for the current move
     double res = 0., start = move_time - hst, end = move_time + hst;
     double start_base = m->start_pos.x;
-    res += pa_move_integrate(m, pressure_advance, 0., start, move_time, start);
-    res -= pa_move_integrate(m, pressure_advance, 0., move_time, end, end);
+    res += pa_move_integrate(m, pc, 0., start, move_time, start);
+    res -= pa_move_integrate(m, pc, 0., move_time, end, end);
     // Integrate over previous moves
     struct move *prev = m;
     while (unlikely(start < 0.)) {
         prev = list_prev_entry(prev, node);
         start += prev->move_t;
         double base = prev->start_pos.x - start_base;
-        res += pa_move_integrate(prev, pressure_advance, base, start
-                                 , prev->move_t, start);
+        res += pa_move_integrate(prev, pc, base, start, prev->move_t, start);
     }
     // Integrate over future moves
     while (unlikely(end > m->move_t)) {
         end -= m->move_t;
         m = list_next_entry(m, node);
         double base = m->start_pos.x - start_base;
-        res -= pa_move_integrate(m, pressure_advance, base, 0., end, end);
+        res -= pa_move_integrate(m, pc, base, 0., end, end);
     }
     return res;
 }
 
+/****************************************************************
+ * Per-move cache of the pressure advance integrals
+ ****************************************************************/
+
+// The smoothed position may also be written in terms of the running
+// integrals I0(t) = integral(pa_position(x) * dx) and
+// I1(t) = integral(x * pa_position(x) * dx) (from any fixed time):
+//     smooth_position(t) = (2*I1(t) - I1(t-hst) - I1(t+hst)
+//                           - 2*t*I0(t) + (t-hst)*I0(t-hst)
+//                           + (t+hst)*I0(t+hst)) / hst**2
+// The running integrals at the start of each move (or pressure
+// advance band within a move) near a move are computed once, so that
+// the position within the move may then be found with a few
+// polynomial evaluations (instead of integrating over all the
+// neighbouring moves on each evaluation).  The trapq is only
+// guaranteed to contain the moves needed for the current step
+// generation range, so the integrals are computed starting from the
+// first requested time and the cache is reset after each range.
+
+#define PA_CACHE_SEGMENTS 256
+
+struct pa_cache {
+    struct move *m;
+    double start_time;
+    int num_segments, last_segment;
+    struct {
+        double start, end, base, start_v, half_accel, sixth_jerk, i0, i1;
+    } segments[PA_CACHE_SEGMENTS];
+};
+
+// Build the running integrals for the moves from 'before' seconds
+// prior to 'start_time' until 'after' seconds past the end of 'm'
+static void
+pa_cache_fill(struct pa_cache *pc, struct move *m, double start_time
+              , struct pa_curve *curve, double before, double after)
+{
+    pc->m = m;
+    pc->start_time = start_time;
+    pc->num_segments = pc->last_segment = 0;
+    if (!m->node.next)
+        // Not a move on a trapq (eg, from calc_position_from_coord)
+        return;
+    struct move *pm = m;
+    double move_start = 0.;
+    while (move_start > start_time - before) {
+        pm = list_prev_entry(pm, node);
+        move_start -= pm->move_t;
+    }
+    double i0 = 0., i1 = 0., seg_start = 0.;
+    int can_pressure_advance = pm->axes_r.y != 0.;
+    int band = can_pressure_advance ? pa_curve_band(curve, pm->start_v) : 0;
+    int n = 0;
+    for (;;) {
+        if (n >= PA_CACHE_SEGMENTS) {
+            // Too many short moves - don't use the cache for this move
+            pc->num_segments = 0;
+            return;
+        }
+        // Find the position polynomial of the next segment of the move
+        double base = pm->start_pos.x - m->start_pos.x, start_v = pm->start_v;
+        double ha = pm->half_accel, sj = pm->sixth_jerk, seg_end = pm->move_t;
+        int next_band = band;
+        if (can_pressure_advance) {
+            pa_band_coefs(pm, curve, band, &base, &start_v, &ha);
+            seg_end = pa_band_end(pm, curve, band, &next_band);
+        }
+        if (seg_end > seg_start) {
+            if (pm == m && !seg_start)
+                pc->last_segment = n;
+            // Shift the polynomial to start at the segment start time
+            base += seg_start * (start_v + seg_start * (ha + seg_start * sj));
+            start_v += (2. * ha + 3. * sj * seg_start) * seg_start;
+            ha += 3. * sj * seg_start;
+            double start = move_start + seg_start, end = move_start + seg_end;
+            pc->segments[n].start = start;
+            pc->segments[n].end = end;
+            pc->segments[n].base = base;
+            pc->segments[n].start_v = start_v;
+            pc->segments[n].half_accel = ha;
+            pc->segments[n].sixth_jerk = sj;
+            pc->segments[n].i0 = i0;
+            pc->segments[n].i1 = i1;
+            n++;
+            if (end >= m->move_t + after)
+                break;
+            double iext = extruder_integrate(base, start_v, ha, sj, 0.
+                                             , end - start);
+            i0 += iext;
+            i1 += start * iext + extruder_integrate_time(base, start_v, ha, sj
+                                                         , 0., end - start);
+            seg_start = end - move_start;
+        }
+        if (seg_end < pm->move_t) {
+            band = next_band;
+            continue;
+        }
+        // Advance to the next move
+        move_start += pm->move_t;
+        pm = list_next_entry(pm, node);
+        seg_start = 0.;
+        can_pressure_advance = pm->axes_r.y != 0.;
+        band = can_pressure_advance ? pa_curve_band(curve, pm->start_v) : 0;
+    }
+    pc->num_segments = n;
+}
+
+// Make sure the cache describes the given move at the given time
+static inline int
+pa_cache_check(struct pa_cache *pc, struct move *m, double move_time
+               , struct pa_curve *curve, double before, double after)
+{
+    if (unlikely(pc->m != m || move_time < pc->start_time))
+        pa_cache_fill(pc, m, move_time, curve, before, after);
+    return pc->num_segments;
+}
+
+// Find the cached segment containing the given time (starting from
+// segment 'i')
+static inline int
+pa_cache_find(struct pa_cache *pc, double time, int i)
+{
+    while (i > 0 && time < pc->segments[i].start)
+        i--;
+    while (i < pc->num_segments - 1 && time > pc->segments[i].end)
+        i++;
+    return i;
+}
+
+// Evaluate the running integrals at a time within cached segment 'i'
+static inline void
+pa_cache_integrals(struct pa_cache *pc, int i, double time
+                   , double *i0, double *i1)
+{
+    double base = pc->segments[i].base, start_v = pc->segments[i].start_v;
+    double ha = pc->segments[i].half_accel, sj = pc->segments[i].sixth_jerk;
+    double t = time - pc->segments[i].start;
+    double iext = extruder_integrate(base, start_v, ha, sj, 0., t);
+    *i0 = pc->segments[i].i0 + iext;
+    *i1 = (pc->segments[i].i1 + pc->segments[i].start * iext
+           + extruder_integrate_time(base, start_v, ha, sj, 0., t));
+}
+
+// Calculate the weighted area of the smoothed position at the given
+// time (relative to the start position and time of the cached move)
+static double
+pa_cache_area(struct pa_cache *pc, double time, double hst)
+{
+    double i0, i1, p0, p1, n0, n1;
+    int i = pa_cache_find(pc, time, pc->last_segment);
+    pc->last_segment = i;
+    pa_cache_integrals(pc, i, time, &i0, &i1);
+    double ptime = time - hst, ntime = time + hst;
+    pa_cache_integrals(pc, pa_cache_find(pc, ptime, i), ptime, &p0, &p1);
+    pa_cache_integrals(pc, pa_cache_find(pc, ntime, i), ntime, &n0, &n1);
+    return (2. * (i1 - time * i0) - p1 - n1 + ptime * p0 + ntime * n0);
+}
+
 struct extruder_stepper {
     struct stepper_kinematics sk;
     double pressure_advance, half_smooth_time, inv_half_smooth_time2;
+    struct pa_curve curve;
+    struct shaper_pulses sp;
+    struct pa_cache pc;
 };
 
 static double
-extruder_calc_position(struct stepper_kinematics *sk, struct move *m
-                       , double move_time)
+extruder_pa_position(struct extruder_stepper *es, struct move *m
+                     , double move_time)
 {
-    struct extruder_stepper *es = container_of(sk, struct extruder_stepper, sk);
     double hst = es->half_smooth_time;
     if (!hst)
         // Pressure advance not enabled
         return m->start_pos.x + move_get_distance(m, move_time);
     // Apply pressure advance and average over smooth_time
-    double area = pa_range_integrate(m, move_time, es->pressure_advance, hst);
+    double area = pa_range_integrate(m, move_time, &es->curve, hst);
     return m->start_pos.x + area * es->inv_half_smooth_time2;
 }
 
+static double
+extruder_calc_position(struct stepper_kinematics *sk, struct move *m
+                       , double move_time)
+{
+    struct extruder_stepper *es = container_of(sk, struct extruder_stepper, sk);
+    double hst = es->half_smooth_time;
+    int num_pulses = es->sp.num_pulses, i;
+    if (hst && move_time >= 0. && move_time <= m->move_t
+        && pa_cache_check(&es->pc, m, move_time, &es->curve
+                          , es->sk.gen_steps_post_active
+                          , es->sk.gen_steps_pre_active)) {
+        // Use the cached pressure advance integrals
+        if (num_pulses <= 1)
+            return (m->start_pos.x + pa_cache_area(&es->pc, move_time, hst)
+                    * es->inv_half_smooth_time2);
+        double area = 0.;
+        for (i = 0; i < num_pulses; ++i) {
+            double time = move_time + es->sp.pulses[i].t;
+            area += es->sp.pulses[i].a * pa_cache_area(&es->pc, time, hst);
+        }
+        return m->start_pos.x + area * es->inv_half_smooth_time2;
+    }
+    if (num_pulses <= 1)
+        // Input shaper not enabled
+        return extruder_pa_position(es, m, move_time);
+    // Calculate the convolution of the shaper with the extruder position
+    double res = 0.;
+    for (i = 0; i < num_pulses; ++i) {
+        double time = move_time + es->sp.pulses[i].t;
+        struct move *pm = m;
+        while (unlikely(time < 0.)) {
+            pm = list_prev_entry(pm, node);
+            time += pm->move_t;
+        }
+        while (unlikely(time > pm->move_t)) {
+            time -= pm->move_t;
+            pm = list_next_entry(pm, node);
+        }
+        res += es->sp.pulses[i].a * extruder_pa_position(es, pm, time);
+    }
+    return res;
+}
+
+// The trapq may change between step generation ranges - reset the cache
+static void
+extruder_post_fixup(struct stepper_kinematics *sk)
+{
+    struct extruder_stepper *es = container_of(sk, struct extruder_stepper, sk);
+    es->pc.m = NULL;
+}
+
+// Update the step generation window from the pressure advance
+// smoothing and input shaper settings
+static void
+extruder_note_generation_time(struct extruder_stepper *es)
+{
+    double pre_active = es->half_smooth_time;
+    double post_active = es->half_smooth_time;
+    int num_pulses = es->sp.num_pulses;
+    if (num_pulses) {
+        pre_active += es->sp.pulses[num_pulses-1].t;
+        post_active -= es->sp.pulses[0].t;
+    }
+    es->sk.gen_steps_pre_active = pre_active;
+    es->sk.gen_steps_post_active = post_active;
+    es->pc.m = NULL;
+}
+
 void __visible
 extruder_set_pressure_advance(struct stepper_kinematics *sk
                               , double pressure_advance, double smooth_time)
@@ -127,11 +495,54 @@ extruder_set_pressure_advance(struct stepper_kinematics *sk
     struct extruder_stepper *es = container_of(sk, struct extruder_stepper, sk);
     double hst = smooth_time * .5;
     es->half_smooth_time = hst;
-    es->sk.gen_steps_pre_active = es->sk.gen_steps_post_active = hst;
+    extruder_note_generation_time(es);
     if (! hst)
         return;
     es->inv_half_smooth_time2 = 1. / (hst * hst);
     es->pressure_advance = pressure_advance;
+    pa_curve_update(&es->curve, pressure_advance);
+}
+
+// Use a different pressure advance (as a factor of the configured
+// pressure advance) above each of the given nominal velocities
+int __visible
+extruder_set_pressure_advance_taper(struct stepper_kinematics *sk, int n
+                                    , double velocities[], double factors[])
+{
+    struct extruder_stepper *es = container_of(sk, struct extruder_stepper, sk);
+    struct pa_curve *pc = &es->curve;
+    if (n < 0 || n >= ARRAY_SIZE(pc->bands))
+        return -1;
+    int i;
+    for (i = 0; i < n; i++)
+        if (velocities[i] <= (i ? velocities[i-1] : 0.) || factors[i] < 0.)
+            return -1;
+    for (i = 0; i < n; i++) {
+        pc->bands[i+1].velocity = velocities[i];
+        pc->bands[i+1].factor = factors[i];
+    }
+    pc->num_bands = n + 1;
+    pa_curve_update(pc, es->pressure_advance);
+    es->pc.m = NULL;
+    return 0;
+}
+
+int __visible
+extruder_set_shaper_params(struct stepper_kinematics *sk
+                           , int n, double a[], double t[])
+{
+    struct extruder_stepper *es = container_of(sk, struct extruder_stepper, sk);
+    int status = init_shaper(n, a, t, &es->sp);
+    extruder_note_generation_time(es);
+    return status;
+}
+
+double __visible
+extruder_get_step_generation_window(struct stepper_kinematics *sk)
+{
+    struct extruder_stepper *es = container_of(sk, struct extruder_stepper, sk);
+    return es->sk.gen_steps_pre_active > es->sk.gen_steps_post_active
+         ? es->sk.gen_steps_pre_active : es->sk.gen_steps_post_active;
 }
 
 struct stepper_kinematics * __visible
@@ -140,6 +551,8 @@ extruder_stepper_alloc(void)
     struct extruder_stepper *es = malloc(sizeof(*es));
     memset(es, 0, sizeof(*es));
     es->sk.calc_position_cb = extruder_calc_position;
+    es->sk.post_cb = extruder_post_fixup;
     es->sk.active_flags = AF_X;
+    es->curve.num_bands = 1;
     return &es->sk;
 }
@@ -1,4 +1,4 @@
-// Kinematic input shapers to minimize motion vibrations in XY plane
+// Kinematic input shapers to minimize motion vibrations
 //
 // Copyright (C) 2019-2020  Kevin O'Connor <kevin@koconnor.net>
 // Copyright (C) 2020  Dmitry Butyugin <dmbutyugin@google.com>
@@ -11,6 +11,7 @@
 #include <string.h> // memset
 #include "compiler.h" // __visible
 #include "itersolve.h" // struct stepper_kinematics
+#include "kin_shaper.h" // struct shaper_pulses
 #include "trapq.h" // struct move
 
 
@@ -18,13 +19,6 @@
  * Shaper initialization
  ****************************************************************/
 
-struct shaper_pulses {
-    int num_pulses;
-    struct {
-        double t, a;
-    } pulses[5];
-};
-
 // Shift pulses around 'mid-point' t=0 so that the input shaper is an identity
 // transformation for constant-speed motion (i.e. input_shaper(v * T) = v * T)
 static void
@@ -38,7 +32,7 @@ shift_pulses(struct shaper_pulses *sp)
         sp->pulses[i].t -= ts;
 }
 
-static int
+int
 init_shaper(int n, double a[], double t[], struct shaper_pulses *sp)
 {
     if (n < 0 || n > ARRAY_SIZE(sp->pulses)) {
@@ -102,6 +96,217 @@ calc_position(struct move *m, int axis, double move_time
     return res;
 }
 
+// Calculate the shaper convolution for a list of increasing move times
+static void
+calc_position_batch(struct move *m, int axis, double *move_times
+                    , double *positions, int count, struct shaper_pulses *sp)
+{
+    int num_pulses = sp->num_pulses, i, j;
+    for (j = 0; j < count; ++j)
+        positions[j] = 0.;
+    for (i = 0; i < num_pulses; ++i) {
+        double t = sp->pulses[i].t, a = sp->pulses[i].a;
+        // Track the move (and its start time relative to 'm') that
+        // contains the last sample so the move list is only walked once
+        struct move *pm = m;
+        double pm_start = 0.;
+        for (j = 0; j < count; ++j) {
+            double time = move_times[j] + t - pm_start;
+            while (likely(time < 0.)) {
+                pm = list_prev_entry(pm, node);
+                pm_start -= pm->move_t;
+                time += pm->move_t;
+            }
+            while (likely(time > pm->move_t)) {
+                pm_start += pm->move_t;
+                time -= pm->move_t;
+                pm = list_next_entry(pm, node);
+            }
+            positions[j] += a * get_axis_position(pm, axis, time);
+        }
+    }
+}
+
+
+/****************************************************************
+ * Per-move cache of the shaper convolution
+ ****************************************************************/
+
+// Over the duration of a move the shaped position of an axis is a
+// piecewise cubic function of the move time (the pieces change
+// wherever a shaper pulse crosses a move boundary).  These pieces are
+// computed once for a move so that the position may then be found
+// with a single polynomial evaluation during the step time search.
+// The trapq is only guaranteed to contain the moves needed for the
+// current step generation range, so the pieces are computed starting
+// at the first requested time and the cache is reset after each range.
+
+#define SHAPER_CACHE_SEGMENTS 128
+
+struct shaper_cache {
+    struct move *m;
+    double start_time;
+    int num_segments, last_segment;
+    struct {
+        double end_time, c0, c1, c2, c3;
+    } segments[SHAPER_CACHE_SEGMENTS];
+};
+
+// Add the polynomial (in the move time of the cached move) of a pulse
+// that is 'd' seconds ahead of move 'pm' to the given coefficients
+static inline void
+add_pulse_coefs(double *c, struct move *pm, int axis, double a, double d)
+{
+    double axis_r = a * pm->axes_r.axis[axis - 'x'];
+    double v = pm->start_v, ha = pm->half_accel, sj = pm->sixth_jerk;
+    c[0] += (a * pm->start_pos.axis[axis - 'x']
+             + axis_r * (v + (ha + sj * d) * d) * d);
+    c[1] += axis_r * (v + (2. * ha + 3. * sj * d) * d);
+    c[2] += axis_r * (ha + 3. * sj * d);
+    c[3] += axis_r * sj;
+}
+
+// Restore the heap property (ordered by next move boundary crossing)
+// for the heap entry at the given position
+static void
+pulse_heap_sift(int *heap, double *ends, int count, int pos)
+{
+    int i = heap[pos];
+    for (;;) {
+        int child = 2 * pos + 1;
+        if (child >= count)
+            break;
+        if (child + 1 < count && ends[heap[child + 1]] < ends[heap[child]])
+            child++;
+        if (ends[heap[child]] >= ends[i])
+            break;
+        heap[pos] = heap[child];
+        pos = child;
+    }
+    heap[pos] = i;
+}
+
+// Build the list of polynomial segments for a move from 'start_time'
+static void
+shaper_cache_fill(struct shaper_cache *sc, struct move *m, int axis
+                  , double start_time, struct shaper_pulses *sp)
+{
+    sc->m = m;
+    sc->start_time = start_time;
+    sc->num_segments = sc->last_segment = 0;
+    if (!m->node.next)
+        // Not a move on a trapq (eg, from calc_position_from_coord)
+        return;
+    // Find the move (and its start relative to 'm') under each pulse
+    struct move *pms[MAX_SHAPER_PULSES];
+    double pm_starts[MAX_SHAPER_PULSES], ends[MAX_SHAPER_PULSES];
+    double c[4] = { 0., 0., 0., 0. };
+    int heap[MAX_SHAPER_PULSES];
+    int num_pulses = sp->num_pulses, i;
+    for (i = 0; i < num_pulses; ++i) {
+        double t = start_time + sp->pulses[i].t, pm_start = 0.;
+        struct move *pm = m;
+        while (t < pm_start) {
+            pm = list_prev_entry(pm, node);
+            pm_start -= pm->move_t;
+        }
+        while (t > pm_start + pm->move_t) {
+            pm_start += pm->move_t;
+            pm = list_next_entry(pm, node);
+        }
+        pms[i] = pm;
+        pm_starts[i] = pm_start;
+        ends[i] = pm_start + pm->move_t - sp->pulses[i].t;
+        add_pulse_coefs(c, pm, axis, sp->pulses[i].a
+                        , sp->pulses[i].t - pm_start);
+        heap[i] = i;
+    }
+    for (i = num_pulses / 2 - 1; i >= 0; --i)
+        pulse_heap_sift(heap, ends, num_pulses, i);
+    for (;;) {
+        if (sc->num_segments >= SHAPER_CACHE_SEGMENTS) {
+            // Too many short moves - don't use the cache for this move
+            sc->num_segments = 0;
+            return;
+        }
+        // Add a segment ending at the next move boundary crossing
+        double end_time = ends[heap[0]];
+        if (end_time > m->move_t)
+            end_time = m->move_t;
+        int n = sc->num_segments++;
+        sc->segments[n].end_time = end_time;
+        sc->segments[n].c0 = c[0];
+        sc->segments[n].c1 = c[1];
+        sc->segments[n].c2 = c[2];
+        sc->segments[n].c3 = c[3];
+        if (end_time >= m->move_t)
+            return;
+        // Move each pulse at the boundary to its next move
+        while (ends[heap[0]] <= end_time) {
+            i = heap[0];
+            double t = sp->pulses[i].t, a = sp->pulses[i].a;
+            add_pulse_coefs(c, pms[i], axis, -a, t - pm_starts[i]);
+            pm_starts[i] += pms[i]->move_t;
+            pms[i] = list_next_entry(pms[i], node);
+            add_pulse_coefs(c, pms[i], axis, a, t - pm_starts[i]);
+            ends[i] = pm_starts[i] + pms[i]->move_t - t;
+            pulse_heap_sift(heap, ends, num_pulses, 0);
+        }
+    }
+}
+
+// Make sure the cache describes the given move at the given time
+static inline int
+shaper_cache_check(struct shaper_cache *sc, struct move *m, int axis
+                   , double move_time, struct shaper_pulses *sp)
+{
+    if (unlikely(sc->m != m || move_time < sc->start_time))
+        shaper_cache_fill(sc, m, axis, move_time, sp);
+    return sc->num_segments;
+}
+
+// Evaluate the cached shaper convolution at the given move time
+static inline double
+shaper_cache_eval(struct shaper_cache *sc, double move_time)
+{
+    int i = sc->last_segment;
+    while (i > 0 && move_time <= sc->segments[i-1].end_time)
+        i--;
+    while (move_time > sc->segments[i].end_time && i < sc->num_segments - 1)
+        i++;
+    sc->last_segment = i;
+    return (sc->segments[i].c0
+            + (sc->segments[i].c1 + (sc->segments[i].c2 + sc->segments[i].c3
+                                     * move_time) * move_time) * move_time);
+}
+
+// Calculate the shaped position of an axis (using the cache if possible)
+static inline double
+shaper_calc_position(struct shaper_cache *sc, struct move *m, int axis
+                     , double move_time, struct shaper_pulses *sp)
+{
+    if (unlikely(move_time < 0. || move_time > m->move_t
+                 || !shaper_cache_check(sc, m, axis, move_time, sp)))
+        return calc_position(m, axis, move_time, sp);
+    return shaper_cache_eval(sc, move_time);
+}
+
+// Calculate the shaped position for a list of increasing move times
+static void
+shaper_calc_position_batch(struct shaper_cache *sc, struct move *m, int axis
+                           , double *move_times, double *positions, int count
+                           , struct shaper_pulses *sp)
+{
+    if (move_times[0] < 0.
+        || !shaper_cache_check(sc, m, axis, move_times[0], sp)) {
+        calc_position_batch(m, axis, move_times, positions, count, sp);
+        return;
+    }
+    int i;
+    for (i = 0; i < count; ++i)
+        positions[i] = shaper_calc_position(sc, m, axis, move_times[i], sp);
+}
+
 
 /****************************************************************
  * Kinematics-related shaper code
@@ -113,7 +318,8 @@ struct input_shaper {
     struct stepper_kinematics sk;
     struct stepper_kinematics *orig_sk;
     struct move m;
-    struct shaper_pulses sx, sy;
+    struct shaper_pulses sx, sy, sz;
+    struct shaper_cache cx, cy, cz;
 };
 
 // Optimized calc_position when only x axis is needed
@@ -124,7 +330,8 @@ shaper_x_calc_position(struct stepper_kinematics *sk, struct move *m
     struct input_shaper *is = container_of(sk, struct input_shaper, sk);
     if (!is->sx.num_pulses)
         return is->orig_sk->calc_position_cb(is->orig_sk, m, move_time);
-    is->m.start_pos.x = calc_position(m, 'x', move_time, &is->sx);
+    is->m.start_pos.x = shaper_calc_position(&is->cx, m, 'x', move_time
+                                             , &is->sx);
     return is->orig_sk->calc_position_cb(is->orig_sk, &is->m, DUMMY_T);
 }
 
@@ -136,78 +343,233 @@ shaper_y_calc_position(struct stepper_kinematics *sk, struct move *m
     struct input_shaper *is = container_of(sk, struct input_shaper, sk);
     if (!is->sy.num_pulses)
         return is->orig_sk->calc_position_cb(is->orig_sk, m, move_time);
-    is->m.start_pos.y = calc_position(m, 'y', move_time, &is->sy);
+    is->m.start_pos.y = shaper_calc_position(&is->cy, m, 'y', move_time
+                                             , &is->sy);
     return is->orig_sk->calc_position_cb(is->orig_sk, &is->m, DUMMY_T);
 }
 
-// General calc_position for both x and y axes
+// Optimized calc_position when only z axis is needed
 static double
-shaper_xy_calc_position(struct stepper_kinematics *sk, struct move *m
-                        , double move_time)
+shaper_z_calc_position(struct stepper_kinematics *sk, struct move *m
+                       , double move_time)
 {
     struct input_shaper *is = container_of(sk, struct input_shaper, sk);
-    if (!is->sx.num_pulses && !is->sy.num_pulses)
+    if (!is->sz.num_pulses)
+        return is->orig_sk->calc_position_cb(is->orig_sk, m, move_time);
+    is->m.start_pos.z = shaper_calc_position(&is->cz, m, 'z', move_time
+                                             , &is->sz);
+    return is->orig_sk->calc_position_cb(is->orig_sk, &is->m, DUMMY_T);
+}
+
+// General calc_position for multiple axes
+static double
+shaper_xyz_calc_position(struct stepper_kinematics *sk, struct move *m
+                         , double move_time)
+{
+    struct input_shaper *is = container_of(sk, struct input_shaper, sk);
+    if (!is->sx.num_pulses && !is->sy.num_pulses && !is->sz.num_pulses)
         return is->orig_sk->calc_position_cb(is->orig_sk, m, move_time);
     is->m.start_pos = move_get_coord(m, move_time);
     if (is->sx.num_pulses)
-        is->m.start_pos.x = calc_position(m, 'x', move_time, &is->sx);
+        is->m.start_pos.x = shaper_calc_position(&is->cx, m, 'x', move_time
+                                                 , &is->sx);
     if (is->sy.num_pulses)
-        is->m.start_pos.y = calc_position(m, 'y', move_time, &is->sy);
+        is->m.start_pos.y = shaper_calc_position(&is->cy, m, 'y', move_time
+                                                 , &is->sy);
+    if (is->sz.num_pulses)
+        is->m.start_pos.z = shaper_calc_position(&is->cz, m, 'z', move_time
+                                                 , &is->sz);
     return is->orig_sk->calc_position_cb(is->orig_sk, &is->m, DUMMY_T);
 }
 
+// Batch versions of the above (used by the pre-sampled step solver)
+static void
+shaper_x_calc_position_batch(struct stepper_kinematics *sk, struct move *m
+                             , double *move_times, double *positions, int count)
+{
+    struct input_shaper *is = container_of(sk, struct input_shaper, sk);
+    if (!is->sx.num_pulses) {
+        itersolve_calc_position_batch(is->orig_sk, m, move_times
+                                      , positions, count);
+        return;
+    }
+    shaper_calc_position_batch(&is->cx, m, 'x', move_times, positions, count
+                               , &is->sx);
+    int i;
+    for (i = 0; i < count; ++i) {
+        is->m.start_pos.x = positions[i];
+        positions[i] = is->orig_sk->calc_position_cb(is->orig_sk, &is->m
+                                                     , DUMMY_T);
+    }
+}
+
+static void
+shaper_y_calc_position_batch(struct stepper_kinematics *sk, struct move *m
+                             , double *move_times, double *positions, int count)
+{
+    struct input_shaper *is = container_of(sk, struct input_shaper, sk);
+    if (!is->sy.num_pulses) {
+        itersolve_calc_position_batch(is->orig_sk, m, move_times
+                                      , positions, count);
+        return;
+    }
+    shaper_calc_position_batch(&is->cy, m, 'y', move_times, positions, count
+                               , &is->sy);
+    int i;
+    for (i = 0; i < count; ++i) {
+        is->m.start_pos.y = positions[i];
+        positions[i] = is->orig_sk->calc_position_cb(is->orig_sk, &is->m
+                                                     , DUMMY_T);
+    }
+}
+
+static void
+shaper_z_calc_position_batch(struct stepper_kinematics *sk, struct move *m
+                             , double *move_times, double *positions, int count)
+{
+    struct input_shaper *is = container_of(sk, struct input_shaper, sk);
+    if (!is->sz.num_pulses) {
+        itersolve_calc_position_batch(is->orig_sk, m, move_times
+                                      , positions, count);
+        return;
+    }
+    shaper_calc_position_batch(&is->cz, m, 'z', move_times, positions, count
+                               , &is->sz);
+    int i;
+    for (i = 0; i < count; ++i) {
+        is->m.start_pos.z = positions[i];
+        positions[i] = is->orig_sk->calc_position_cb(is->orig_sk, &is->m
+                                                     , DUMMY_T);
+    }
+}
+
+#define BATCH_CHUNK 32
+
+static void
+shaper_xyz_calc_position_batch(struct stepper_kinematics *sk, struct move *m
+                               , double *move_times, double *positions
+                               , int count)
+{
+    struct input_shaper *is = container_of(sk, struct input_shaper, sk);
+    if (!is->sx.num_pulses && !is->sy.num_pulses && !is->sz.num_pulses) {
+        itersolve_calc_position_batch(is->orig_sk, m, move_times
+                                      , positions, count);
+        return;
+    }
+    double xs[BATCH_CHUNK], ys[BATCH_CHUNK], zs[BATCH_CHUNK];
+    while (count > 0) {
+        int num = count > BATCH_CHUNK ? BATCH_CHUNK : count, i;
+        if (is->sx.num_pulses)
+            shaper_calc_position_batch(&is->cx, m, 'x', move_times, xs, num
+                                       , &is->sx);
+        if (is->sy.num_pulses)
+            shaper_calc_position_batch(&is->cy, m, 'y', move_times, ys, num
+                                       , &is->sy);
+        if (is->sz.num_pulses)
+            shaper_calc_position_batch(&is->cz, m, 'z', move_times, zs, num
+                                       , &is->sz);
+        for (i = 0; i < num; ++i) {
+            is->m.start_pos = move_get_coord(m, move_times[i]);
+            if (is->sx.num_pulses)
+                is->m.start_pos.x = xs[i];
+            if (is->sy.num_pulses)
+                is->m.start_pos.y = ys[i];
+            if (is->sz.num_pulses)
+                is->m.start_pos.z = zs[i];
+            positions[i] = is->orig_sk->calc_position_cb(is->orig_sk, &is->m
+                                                         , DUMMY_T);
+        }
+        move_times += num;
+        positions += num;
+        count -= num;
+    }
+}
+
+// Use the closed-form solver of the original kinematics while none
+// of the stepper's axes are shaped
+static void
+shaper_calc_linear(struct stepper_kinematics *sk, struct move *m
+                   , double *base, double *scale)
+{
+    struct input_shaper *is = container_of(sk, struct input_shaper, sk);
+    is->orig_sk->calc_linear_cb(is->orig_sk, m, base, scale);
+}
+
+// The trapq may change between step generation ranges - reset the caches
+static void
+shaper_post_fixup(struct stepper_kinematics *sk)
+{
+    struct input_shaper *is = container_of(sk, struct input_shaper, sk);
+    is->cx.m = is->cy.m = is->cz.m = NULL;
+}
+
+static void
+shaper_note_generation_time(struct input_shaper *is)
+{
+    double pre_active = 0., post_active = 0.;
+    struct shaper_pulses *sps[3] = { &is->sx, &is->sy, &is->sz };
+    int i;
+    for (i = 0; i < 3; ++i) {
+        struct shaper_pulses *sp = sps[i];
+        if (!(is->sk.active_flags & (AF_X << i)) || !sp->num_pulses)
+            continue;
+        if (sp->pulses[sp->num_pulses-1].t > pre_active)
+            pre_active = sp->pulses[sp->num_pulses-1].t;
+        if (-sp->pulses[0].t > post_active)
+            post_active = -sp->pulses[0].t;
+    }
+    is->sk.gen_steps_pre_active = pre_active;
+    is->sk.gen_steps_post_active = post_active;
+    // An unshaped stepper only needs the original step generation
+    is->sk.calc_linear_cb = NULL;
+    if (!pre_active && !post_active && is->orig_sk->calc_linear_cb)
+        is->sk.calc_linear_cb = shaper_calc_linear;
+}
+
 int __visible
 input_shaper_set_sk(struct stepper_kinematics *sk
                     , struct stepper_kinematics *orig_sk)
 {
     struct input_shaper *is = container_of(sk, struct input_shaper, sk);
-    if (orig_sk->active_flags == AF_X)
+    if (orig_sk->active_flags == AF_X) {
         is->sk.calc_position_cb = shaper_x_calc_position;
-    else if (orig_sk->active_flags == AF_Y)
+        is->sk.calc_position_batch_cb = shaper_x_calc_position_batch;
+    } else if (orig_sk->active_flags == AF_Y) {
         is->sk.calc_position_cb = shaper_y_calc_position;
-    else if (orig_sk->active_flags & (AF_X | AF_Y))
-        is->sk.calc_position_cb = shaper_xy_calc_position;
-    else
+        is->sk.calc_position_batch_cb = shaper_y_calc_position_batch;
+    } else if (orig_sk->active_flags == AF_Z) {
+        is->sk.calc_position_cb = shaper_z_calc_position;
+        is->sk.calc_position_batch_cb = shaper_z_calc_position_batch;
+    } else if (orig_sk->active_flags & (AF_X | AF_Y | AF_Z)) {
+        is->sk.calc_position_cb = shaper_xyz_calc_position;
+        is->sk.calc_position_batch_cb = shaper_xyz_calc_position_batch;
+    } else
         return -1;
+    is->sk.post_cb = shaper_post_fixup;
     is->sk.active_flags = orig_sk->active_flags;
     is->orig_sk = orig_sk;
     is->sk.commanded_pos = orig_sk->commanded_pos;
     is->sk.last_flush_time = orig_sk->last_flush_time;
     is->sk.last_move_time = orig_sk->last_move_time;
+    shaper_note_generation_time(is);
     return 0;
 }
 
-static void
-shaper_note_generation_time(struct input_shaper *is)
-{
-    double pre_active = 0., post_active = 0.;
-    if ((is->sk.active_flags & AF_X) && is->sx.num_pulses) {
-        pre_active = is->sx.pulses[is->sx.num_pulses-1].t;
-        post_active = -is->sx.pulses[0].t;
-    }
-    if ((is->sk.active_flags & AF_Y) && is->sy.num_pulses) {
-        pre_active = is->sy.pulses[is->sy.num_pulses-1].t > pre_active
-            ? is->sy.pulses[is->sy.num_pulses-1].t : pre_active;
-        post_active = -is->sy.pulses[0].t > post_active
-            ? -is->sy.pulses[0].t : post_active;
-    }
-    is->sk.gen_steps_pre_active = pre_active;
-    is->sk.gen_steps_post_active = post_active;
-}
-
 int __visible
 input_shaper_set_shaper_params(struct stepper_kinematics *sk, char axis
                                , int n, double a[], double t[])
 {
-    if (axis != 'x' && axis != 'y')
+    if (axis != 'x' && axis != 'y' && axis != 'z')
         return -1;
     struct input_shaper *is = container_of(sk, struct input_shaper, sk);
-    struct shaper_pulses *sp = axis == 'x' ? &is->sx : &is->sy;
+    struct shaper_pulses *sps[3] = { &is->sx, &is->sy, &is->sz };
+    struct shaper_pulses *sp = sps[axis - 'x'];
     int status = 0;
     // Ignore input shaper update if the axis is not active
-    if (is->orig_sk->active_flags & (axis == 'x' ? AF_X : AF_Y)) {
+    if (is->orig_sk->active_flags & (AF_X << (axis - 'x'))) {
         status = init_shaper(n, a, t, sp);
         shaper_note_generation_time(is);
+        is->cx.m = is->cy.m = is->cz.m = NULL;
     }
     return status;
 }
@@ -0,0 +1,15 @@
+#ifndef KIN_SHAPER_H
+#define KIN_SHAPER_H
+
+#define MAX_SHAPER_PULSES 32
+
+struct shaper_pulses {
+    int num_pulses;
+    struct {
+        double t, a;
+    } pulses[MAX_SHAPER_PULSES];
+};
+
+int init_shaper(int n, double a[], double t[], struct shaper_pulses *sp);
+
+#endif // kin_shaper.h
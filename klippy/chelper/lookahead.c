@@ -0,0 +1,462 @@
+// Toolhead move queue "look-ahead" junction velocity planning
+//
+// Copyright (C) 2016-2021  Kevin O'Connor <kevin@koconnor.net>
+// Copyright (C) 2026  agent <agent@local>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// This code implements the toolhead.py MoveQueue look-ahead.  Each
+// move is checked by the python Move class (for kinematic limits)
+// and then added here.  The queue is scanned to determine the
+// maximum junction velocity between moves, and the resulting
+// trapezoids are added directly to the toolhead and extruder trapq.
+
+#include <math.h> // sqrt, pow
+#include <stdlib.h> // malloc
+#include <string.h> // memcpy
+#include "compiler.h" // __visible
+#include "lookahead.h" // struct lookahead
+#include "pyhelper.h" // errorf
+#include "trapq.h" // trapq_append_batch
+
+static inline double
+min2(double a, double b)
+{
+    return a < b ? a : b;
+}
+
+static inline double
+max2(double a, double b)
+{
+    return a > b ? a : b;
+}
+
+// Allocate a new look-ahead queue
+struct lookahead * __visible
+lookahead_alloc(double flush_time)
+{
+    struct lookahead *lh = malloc(sizeof(*lh));
+    memset(lh, 0, sizeof(*lh));
+    lh->default_flush_time = lh->junction_flush = flush_time;
+    return lh;
+}
+
+// Free memory associated with a look-ahead queue
+void __visible
+lookahead_free(struct lookahead *lh)
+{
+    if (!lh)
+        return;
+    free(lh->moves);
+    free(lh->records);
+    free(lh);
+}
+
+// Discard all queued moves
+void __visible
+lookahead_reset(struct lookahead *lh)
+{
+    lh->move_count = lh->flush_count = 0;
+    lh->junction_flush = lh->default_flush_time;
+}
+
+// Set the jerk of moves added to the trapq (or zero for constant
+// acceleration moves)
+void __visible
+lookahead_set_jerk(struct lookahead *lh, double jerk)
+{
+    lh->jerk = jerk;
+}
+
+// Set the amount of move time to queue before attempting a lazy flush
+void __visible
+lookahead_set_flush_time(struct lookahead *lh, double flush_time)
+{
+    lh->junction_flush = flush_time;
+}
+
+// Set the amount of move time to queue between lazy flushes
+void __visible
+lookahead_set_default_flush_time(struct lookahead *lh, double flush_time)
+{
+    lh->default_flush_time = flush_time;
+}
+
+
+/****************************************************************
+ * Jerk limited (S-curve) acceleration
+ ****************************************************************/
+
+// A jerk limited velocity change ramps the acceleration up at 'jerk'
+// to at most 'accel', holds it, and ramps it back down at 'jerk'.
+// Velocity changes smaller than accel^2/jerk never reach 'accel'.
+// The profile is symmetric, so its distance is its duration times
+// the average of its start and end velocities.
+
+// Return the time needed to change velocity by 'dv'
+static double
+scurve_time(double dv, double accel, double jerk)
+{
+    if (dv * jerk >= accel * accel)
+        return dv / accel + accel / jerk;
+    return 2. * sqrt(dv / jerk);
+}
+
+// Return the distance needed to change velocity from 'v' to 'end_v'
+static double
+scurve_dist(double v, double end_v, double accel, double jerk)
+{
+    return (v + end_v) * .5 * scurve_time(end_v - v, accel, jerk);
+}
+
+// Return the maximum velocity that can be reached from 'v' in 'dist'
+static double
+scurve_reachable_v(double v, double dist, double accel, double jerk)
+{
+    double accel_jerk = accel * accel / jerk;
+    if (dist >= (v + .5 * accel_jerk) * 2. * accel / jerk) {
+        // Solve dv^2 + b*dv + c = 0 for the velocity change 'dv'
+        double b = 2. * v + accel_jerk;
+        double c = 2. * (v * accel_jerk - accel * dist);
+        return v + .5 * (sqrt(b * b - 4. * c) - b);
+    }
+    // Solve s^3 + p*s = q for s = sqrt(dv) (using a form of Cardano's
+    // formula that is numerically stable when 'p' is large)
+    double p3 = 2. * v / 3., q = dist * sqrt(jerk);
+    double r = sqrt(.25 * q * q + p3 * p3 * p3);
+    double a2 = pow(.5 * q + r, 2. / 3.);
+    double s = a2 ? q / (a2 + p3 + p3 * p3 / a2) : 0.;
+    return v + s * s;
+}
+
+// Return the maximum squared velocity at the end of a move given the
+// squared velocity at its start (the same limit applies in reverse)
+static double
+calc_reachable_v2(struct lookahead_move *m, double v2)
+{
+    if (!m->jerk)
+        return v2 + m->delta_v2;
+    double v = scurve_reachable_v(sqrt(v2), m->move_d, m->accel, m->jerk);
+    return v * v;
+}
+
+// Return the "smoothed" (max_accel_to_decel) squared velocity
+// reachable over a move.  The smoothed velocity must never exceed the
+// velocity that the move can actually reach.
+static double
+calc_smoothed_reachable_v2(struct lookahead_move *m, double v2)
+{
+    double smoothed_v2 = v2 + m->smooth_delta_v2;
+    if (!m->jerk)
+        return smoothed_v2;
+    return min2(smoothed_v2, calc_reachable_v2(m, v2));
+}
+
+#define SCURVE_CRUISE_ITERATIONS 40
+
+// Determine the jerk limited accel, cruise, and decel portions of a
+// move.  The cruise velocity is reduced (if needed) so that the
+// acceleration and deceleration phases fit in the move.
+static void
+set_scurve_junction(struct lookahead_move *m, double start_v
+                    , double cruise_v, double end_v)
+{
+    double accel = m->accel, jerk = m->jerk, move_d = m->move_d;
+    if (scurve_dist(start_v, cruise_v, accel, jerk)
+        + scurve_dist(end_v, cruise_v, accel, jerk) > move_d) {
+        // Find the highest cruise velocity that fits by bisection (the
+        // planner ensures the larger of start_v and end_v fits)
+        double low = max2(start_v, end_v), high = cruise_v;
+        int i;
+        for (i=0; i<SCURVE_CRUISE_ITERATIONS; i++) {
+            double v = .5 * (low + high);
+            if (scurve_dist(start_v, v, accel, jerk)
+                + scurve_dist(end_v, v, accel, jerk) > move_d)
+                high = v;
+            else
+                low = v;
+        }
+        cruise_v = low;
+    }
+    m->start_v = start_v;
+    m->cruise_v = cruise_v;
+    m->end_v = end_v;
+    m->accel_t = scurve_time(cruise_v - start_v, accel, jerk);
+    m->decel_t = scurve_time(cruise_v - end_v, accel, jerk);
+    double cruise_d = (move_d - (start_v + cruise_v) * .5 * m->accel_t
+                       - (end_v + cruise_v) * .5 * m->decel_t);
+    m->cruise_t = cruise_d > 0. ? cruise_d / cruise_v : 0.;
+}
+
+
+/****************************************************************
+ * Junction velocity planning
+ ****************************************************************/
+
+// Find the maximum velocity at the junction between two moves
+static void
+calc_junction(struct lookahead_move *m, struct lookahead_move *prev_m
+              , double extruder_v2)
+{
+    if (!m->is_kinematic_move || !prev_m->is_kinematic_move)
+        return;
+    // Find max velocity using "approximated centripetal velocity"
+    double junction_cos_theta = -(m->axes_r[0] * prev_m->axes_r[0]
+                                  + m->axes_r[1] * prev_m->axes_r[1]
+                                  + m->axes_r[2] * prev_m->axes_r[2]);
+    if (junction_cos_theta > 0.999999)
+        return;
+    if (junction_cos_theta < -0.999999)
+        junction_cos_theta = -0.999999;
+    double sin_theta_d2 = sqrt(0.5*(1.0-junction_cos_theta));
+    double R_jd = sin_theta_d2 / (1. - sin_theta_d2);
+    // Approximated circle must contact moves no further away than mid-move
+    double tan_theta_d2 = sin_theta_d2 / sqrt(0.5*(1.0+junction_cos_theta));
+    double move_centripetal_v2 = .5 * m->move_d * tan_theta_d2 * m->accel;
+    double prev_move_centripetal_v2 = (.5 * prev_m->move_d * tan_theta_d2
+                                       * prev_m->accel);
+    // Apply limits
+    double v2 = R_jd * m->junction_deviation * m->accel;
+    v2 = min2(v2, R_jd * prev_m->junction_deviation * prev_m->accel);
+    v2 = min2(v2, move_centripetal_v2);
+    v2 = min2(v2, prev_move_centripetal_v2);
+    v2 = min2(v2, extruder_v2);
+    v2 = min2(v2, m->max_cruise_v2);
+    v2 = min2(v2, prev_m->max_cruise_v2);
+    v2 = min2(v2, calc_reachable_v2(prev_m, prev_m->max_start_v2));
+    m->max_start_v2 = v2;
+    m->max_smoothed_v2 = min2(
+        v2, calc_smoothed_reachable_v2(prev_m, prev_m->max_smoothed_v2));
+}
+
+// Add a move to the queue.  Returns 1 if enough moves are queued
+// that the caller should perform a lazy flush (or -1 on error).
+int __visible
+lookahead_add_move(struct lookahead *lh, double start_x, double start_y
+                   , double start_z, double start_e, double axes_r_x
+                   , double axes_r_y, double axes_r_z, double axes_r_e
+                   , double move_d
+                   , double accel, double junction_deviation
+                   , double min_move_t, double max_cruise_v2
+                   , double delta_v2, double smooth_delta_v2
+                   , int is_kinematic_move, double extruder_v2)
+{
+    if (lh->move_count >= lh->move_alloc) {
+        int new_alloc = lh->move_alloc ? lh->move_alloc * 2 : 64;
+        struct lookahead_move *moves = realloc(
+            lh->moves, new_alloc * sizeof(*moves));
+        if (!moves) {
+            errorf("lookahead: out of memory");
+            return -1;
+        }
+        lh->moves = moves;
+        lh->move_alloc = new_alloc;
+    }
+    struct lookahead_move *m = &lh->moves[lh->move_count++];
+    memset(m, 0, sizeof(*m));
+    m->start_pos[0] = start_x;
+    m->start_pos[1] = start_y;
+    m->start_pos[2] = start_z;
+    m->start_pos[3] = start_e;
+    m->axes_r[0] = axes_r_x;
+    m->axes_r[1] = axes_r_y;
+    m->axes_r[2] = axes_r_z;
+    m->axes_r[3] = axes_r_e;
+    m->move_d = move_d;
+    m->accel = accel;
+    m->junction_deviation = junction_deviation;
+    m->min_move_t = min_move_t;
+    m->is_kinematic_move = is_kinematic_move;
+    m->jerk = is_kinematic_move ? lh->jerk : 0.;
+    m->max_cruise_v2 = max_cruise_v2;
+    m->delta_v2 = delta_v2;
+    m->smooth_delta_v2 = smooth_delta_v2;
+    if (lh->move_count == 1)
+        return 0;
+    calc_junction(m, m - 1, extruder_v2);
+    lh->junction_flush -= min_move_t;
+    // Enough moves have been queued to reach the target flush time?
+    return lh->junction_flush <= 0.;
+}
+
+// Determine the accel, cruise, and decel portions of a move
+static void
+set_junction(struct lookahead_move *m, double start_v2, double cruise_v2
+             , double end_v2)
+{
+    if (m->jerk) {
+        // The junction velocities are already within the move's limits
+        // - don't lower them to a (smoothed) cruise velocity limit
+        cruise_v2 = max2(cruise_v2, max2(start_v2, end_v2));
+        set_scurve_junction(m, sqrt(start_v2), sqrt(cruise_v2), sqrt(end_v2));
+        return;
+    }
+    start_v2 = min2(start_v2, cruise_v2);
+    end_v2 = min2(end_v2, cruise_v2);
+    double half_inv_accel = .5 / m->accel;
+    double accel_d = (cruise_v2 - start_v2) * half_inv_accel;
+    double decel_d = (cruise_v2 - end_v2) * half_inv_accel;
+    double cruise_d = m->move_d - accel_d - decel_d;
+    // Determine move velocities
+    double start_v = m->start_v = sqrt(start_v2);
+    double cruise_v = m->cruise_v = sqrt(cruise_v2);
+    double end_v = m->end_v = sqrt(end_v2);
+    // Determine time spent in each portion of move (time is the
+    // distance divided by average velocity)
+    m->accel_t = accel_d / ((start_v + cruise_v) * 0.5);
+    m->cruise_t = cruise_d / cruise_v;
+    m->decel_t = decel_d / ((end_v + cruise_v) * 0.5);
+}
+
+// Scan the queue and determine the trapezoid of each move that can
+// be flushed.  Returns the number of moves ready to be queued (via
+// lookahead_queue_moves()).
+int __visible
+lookahead_flush(struct lookahead *lh, int lazy)
+{
+    lh->junction_flush = lh->default_flush_time;
+    int update_flush_count = lazy;
+    int flush_count = lh->move_count;
+    // Traverse queue from last to first move and determine maximum
+    // junction speed assuming the robot comes to a complete stop
+    // after the last move.  Moves that can not accelerate are placed
+    // on a "delayed" list (moves delayed_start to delayed_end-1)
+    // until peak_cruise_v2 is known.
+    int delayed_start = 0, delayed_end = 0;
+    double next_end_v2 = 0., next_smoothed_v2 = 0., peak_cruise_v2 = 0.;
+    int i;
+    for (i=flush_count-1; i>=0; i--) {
+        struct lookahead_move *m = &lh->moves[i];
+        double reachable_start_v2 = calc_reachable_v2(m, next_end_v2);
+        double start_v2 = min2(m->max_start_v2, reachable_start_v2);
+        double reachable_smoothed_v2 = calc_smoothed_reachable_v2(
+            m, next_smoothed_v2);
+        double smoothed_v2 = min2(m->max_smoothed_v2, reachable_smoothed_v2);
+        if (smoothed_v2 < reachable_smoothed_v2) {
+            // It's possible for this move to accelerate
+            int have_delayed = delayed_end > delayed_start;
+            if (calc_smoothed_reachable_v2(m, smoothed_v2) > next_smoothed_v2
+                || have_delayed) {
+                // This move can decelerate or this is a full accel
+                // move after a full decel move
+                if (update_flush_count && peak_cruise_v2) {
+                    flush_count = i;
+                    update_flush_count = 0;
+                }
+                peak_cruise_v2 = min2(m->max_cruise_v2, (
+                    smoothed_v2 + reachable_smoothed_v2) * .5);
+                if (have_delayed) {
+                    // Propagate peak_cruise_v2 to any delayed moves
+                    if (!update_flush_count && i < flush_count) {
+                        double mc_v2 = peak_cruise_v2;
+                        int j;
+                        for (j=delayed_start; j<delayed_end; j++) {
+                            struct lookahead_move *dm = &lh->moves[j];
+                            double ms_v2 = dm->delayed_start_v2;
+                            double me_v2 = dm->delayed_end_v2;
+                            mc_v2 = min2(mc_v2, ms_v2);
+                            set_junction(dm, ms_v2, mc_v2, me_v2);
+                        }
+                    }
+                    delayed_start = delayed_end = 0;
+                }
+            }
+            if (!update_flush_count && i < flush_count) {
+                double cruise_v2 = min2(m->max_cruise_v2, peak_cruise_v2);
+                if (!m->jerk)
+                    // Jerk limited moves find their peak in set_junction()
+                    cruise_v2 = min2((start_v2 + reachable_start_v2) * .5
+                                     , cruise_v2);
+                set_junction(m, start_v2, cruise_v2, next_end_v2);
+            }
+        } else {
+            // Delay calculating this move until peak_cruise_v2 is known
+            m->delayed_start_v2 = start_v2;
+            m->delayed_end_v2 = next_end_v2;
+            if (delayed_end <= delayed_start)
+                delayed_end = i + 1;
+            delayed_start = i;
+        }
+        next_end_v2 = start_v2;
+        next_smoothed_v2 = smoothed_v2;
+    }
+    if (update_flush_count)
+        flush_count = 0;
+    lh->flush_count = flush_count;
+    return flush_count;
+}
+
+// Fill a trapq record with the trapezoid of a move
+static void
+fill_record(struct trapq_record *r, struct trapq *tq, double print_time
+            , struct lookahead_move *m, double jerk)
+{
+    r->tq = tq;
+    r->jerk = jerk;
+    r->print_time = print_time;
+    r->accel_t = m->accel_t;
+    r->cruise_t = m->cruise_t;
+    r->decel_t = m->decel_t;
+}
+
+// Add the moves found by lookahead_flush() to the toolhead trapq (and
+// extruder trapq) starting at the given print_time, and remove them
+// from the queue.  The end time of each move is stored in
+// 'end_times'.  Returns the end time of the last move (or a negative
+// number on error).
+double __visible
+lookahead_queue_moves(struct lookahead *lh, struct trapq *tq
+                      , struct trapq *etq, double print_time
+                      , double *end_times)
+{
+    int i, flush_count = lh->flush_count;
+    if (flush_count * 2 > lh->record_alloc) {
+        int new_alloc = flush_count * 2;
+        struct trapq_record *records = realloc(
+            lh->records, new_alloc * sizeof(*records));
+        if (!records) {
+            errorf("lookahead: out of memory");
+            return -1.;
+        }
+        lh->records = records;
+        lh->record_alloc = new_alloc;
+    }
+    // Generate the trapq records for each move
+    struct trapq_record *r = lh->records;
+    for (i=0; i<flush_count; i++) {
+        struct lookahead_move *m = &lh->moves[i];
+        if (m->is_kinematic_move) {
+            fill_record(r, tq, print_time, m, m->jerk);
+            memcpy(r->start_pos, m->start_pos, sizeof(r->start_pos));
+            memcpy(r->axes_r, m->axes_r, sizeof(r->axes_r));
+            r->start_v = m->start_v;
+            r->cruise_v = m->cruise_v;
+            r->accel = m->accel;
+            r++;
+        }
+        double axis_r = m->axes_r[3];
+        if (axis_r && etq) {
+            // Extruder movement is stored in x and the pressure
+            // advance flag is stored in y
+            fill_record(r, etq, print_time, m, m->jerk * axis_r);
+            r->start_pos[0] = m->start_pos[3];
+            r->start_pos[1] = r->start_pos[2] = 0.;
+            r->axes_r[0] = 1.;
+            r->axes_r[1] = axis_r > 0. && (m->axes_r[0] || m->axes_r[1]);
+            r->axes_r[2] = 0.;
+            r->start_v = m->start_v * axis_r;
+            r->cruise_v = m->cruise_v * axis_r;
+            r->accel = m->accel * axis_r;
+            r++;
+        }
+        print_time = print_time + m->accel_t + m->cruise_t + m->decel_t;
+        end_times[i] = print_time;
+    }
+    trapq_append_batch(lh->records, r - lh->records);
+    // Remove processed moves from the queue
+    lh->move_count -= flush_count;
+    memmove(lh->moves, &lh->moves[flush_count]
+            , lh->move_count * sizeof(lh->moves[0]));
+    lh->flush_count = 0;
+    return print_time;
+}
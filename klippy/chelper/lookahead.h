@@ -0,0 +1,55 @@
+#ifndef LOOKAHEAD_H
+#define LOOKAHEAD_H
+
+struct lookahead_move {
+    // Move parameters (from toolhead.py Move class)
+    double start_pos[4], axes_r[4];
+    double move_d, accel, junction_deviation, min_move_t;
+    int is_kinematic_move;
+    // Jerk of acceleration phases (zero for trapezoidal moves)
+    double jerk;
+    // Junction speeds (tracked in velocity squared)
+    double max_start_v2, max_cruise_v2, delta_v2;
+    double max_smoothed_v2, smooth_delta_v2;
+    // Temporary storage while move is on the "delayed" list
+    double delayed_start_v2, delayed_end_v2;
+    // Calculated trapezoid
+    double start_v, cruise_v, end_v;
+    double accel_t, cruise_t, decel_t;
+};
+
+struct lookahead {
+    struct lookahead_move *moves;
+    int move_count, move_alloc;
+    double junction_flush, default_flush_time;
+    // Jerk of acceleration phases (zero for trapezoidal moves)
+    double jerk;
+    int flush_count;
+    // Buffer of trapq records generated by lookahead_queue_moves()
+    struct trapq_record *records;
+    int record_alloc;
+};
+
+struct trapq;
+struct trapq_record;
+struct lookahead *lookahead_alloc(double flush_time);
+void lookahead_free(struct lookahead *lh);
+void lookahead_reset(struct lookahead *lh);
+void lookahead_set_jerk(struct lookahead *lh, double jerk);
+void lookahead_set_flush_time(struct lookahead *lh, double flush_time);
+void lookahead_set_default_flush_time(struct lookahead *lh
+                                      , double flush_time);
+int lookahead_add_move(struct lookahead *lh, double start_x, double start_y
+                       , double start_z, double start_e, double axes_r_x
+                       , double axes_r_y, double axes_r_z, double axes_r_e
+                       , double move_d
+                       , double accel, double junction_deviation
+                       , double min_move_t, double max_cruise_v2
+                       , double delta_v2, double smooth_delta_v2
+                       , int is_kinematic_move, double extruder_v2);
+int lookahead_flush(struct lookahead *lh, int lazy);
+double lookahead_queue_moves(struct lookahead *lh, struct trapq *tq
+                             , struct trapq *etq, double print_time
+                             , double *end_times);
+
+#endif // lookahead.h
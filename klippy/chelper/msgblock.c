@@ -142,11 +142,10 @@ message_fill(uint8_t *data, int len)
     return qm;
 }
 
-// Allocate a queue_message and fill it with a series of encoded vlq integers
-struct queue_message *
-message_alloc_and_encode(uint32_t *data, int len)
+// Fill a queue_message with a series of encoded vlq integers
+static void
+message_encode(struct queue_message *qm, uint32_t *data, int len)
 {
-    struct queue_message *qm = message_alloc();
     int i;
     uint8_t *p = qm->msg;
     for (i=0; i<len; i++) {
@@ -155,11 +154,19 @@ message_alloc_and_encode(uint32_t *data, int len)
             goto fail;
     }
     qm->len = p - qm->msg;
-    return qm;
+    return;
 
 fail:
     errorf("Encode error");
     qm->len = 0;
+}
+
+// Allocate a queue_message and fill it with a series of encoded vlq integers
+struct queue_message *
+message_alloc_and_encode(uint32_t *data, int len)
+{
+    struct queue_message *qm = message_alloc();
+    message_encode(qm, data, len);
     return qm;
 }
 
@@ -167,6 +174,11 @@ fail:
 void
 message_free(struct queue_message *qm)
 {
+    if (qm->arena) {
+        // Return message to its arena (possibly from another thread)
+        __atomic_store_n(&qm->arena, NULL, __ATOMIC_RELEASE);
+        return;
+    }
     free(qm);
 }
 
@@ -183,6 +195,90 @@ message_queue_free(struct list_head *root)
 }
 
 
+/****************************************************************
+ * Message arenas
+ ****************************************************************/
+
+// A message arena is a ring buffer of queue_message objects.  A
+// single thread allocates messages from the arena, while any thread
+// may free them (which just clears the message's 'arena' field).
+// Messages are reclaimed in allocation order - if the arena is full
+// (or the oldest message is still in use) then new messages are
+// allocated with malloc() instead.  This avoids a malloc() and a
+// cross-thread free() for each message in the common case.
+
+struct message_arena {
+    uint32_t head, tail, mask;
+    struct queue_message *slots;
+};
+
+// Allocate a message arena with storage for at least 'count' messages
+struct message_arena *
+message_arena_alloc(int count)
+{
+    struct message_arena *ma = malloc(sizeof(*ma));
+    memset(ma, 0, sizeof(*ma));
+    int size = 1;
+    while (size < count)
+        size <<= 1;
+    ma->mask = size - 1;
+    ma->slots = malloc(sizeof(*ma->slots) * size);
+    memset(ma->slots, 0, sizeof(*ma->slots) * size);
+    return ma;
+}
+
+// Free a message arena
+void
+message_arena_free(struct message_arena *ma)
+{
+    if (!ma)
+        return;
+    uint32_t pos;
+    for (pos = ma->tail; pos != ma->head; pos++) {
+        struct queue_message *qm = &ma->slots[pos & ma->mask];
+        if (__atomic_load_n(&qm->arena, __ATOMIC_ACQUIRE)) {
+            errorf("Memory leak! Can't free arena with pending messages");
+            return;
+        }
+    }
+    free(ma->slots);
+    free(ma);
+}
+
+// Allocate a zero'd 'struct queue_message' from an arena
+struct queue_message *
+message_arena_get(struct message_arena *ma)
+{
+    // Reclaim messages that have been freed
+    while (ma->tail != ma->head) {
+        struct queue_message *qm = &ma->slots[ma->tail & ma->mask];
+        if (__atomic_load_n(&qm->arena, __ATOMIC_ACQUIRE))
+            break;
+        ma->tail++;
+    }
+    if (ma->head - ma->tail > ma->mask)
+        // Arena full
+        return message_alloc();
+    struct queue_message *qm = &ma->slots[ma->head++ & ma->mask];
+    qm->len = 0;
+    qm->min_clock = qm->req_clock = 0;
+    qm->extra_moves = 0;
+    qm->notify_id = 0;
+    qm->arena = ma;
+    return qm;
+}
+
+// Allocate a message from an arena and encode the given vlq integers
+// directly into it
+struct queue_message *
+message_arena_encode(struct message_arena *ma, uint32_t *data, int len)
+{
+    struct queue_message *qm = message_arena_get(ma);
+    message_encode(qm, data, len);
+    return qm;
+}
+
+
 /****************************************************************
  * Clock estimation
  ****************************************************************/
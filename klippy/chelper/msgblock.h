@@ -17,6 +17,8 @@
 #define MESSAGE_DEST 0x10
 #define MESSAGE_SYNC 0x7E
 
+struct message_arena;
+
 struct queue_message {
     int len;
     uint8_t msg[MESSAGE_MAX];
@@ -24,6 +26,8 @@ struct queue_message {
         // Filled when on a command queue
         struct {
             uint64_t min_clock, req_clock;
+            // Number of extra mcu 'move queue' items the command uses
+            int extra_moves;
         };
         // Filled when in sent/receive queues
         struct {
@@ -31,6 +35,7 @@ struct queue_message {
         };
     };
     uint64_t notify_id;
+    struct message_arena *arena; // Set while held in a message_arena
     struct list_node node;
 };
 
@@ -47,6 +52,11 @@ struct queue_message *message_fill(uint8_t *data, int len);
 struct queue_message *message_alloc_and_encode(uint32_t *data, int len);
 void message_free(struct queue_message *qm);
 void message_queue_free(struct list_head *root);
+struct message_arena *message_arena_alloc(int count);
+void message_arena_free(struct message_arena *ma);
+struct queue_message *message_arena_get(struct message_arena *ma);
+struct queue_message *message_arena_encode(struct message_arena *ma
+                                           , uint32_t *data, int len);
 uint64_t clock_from_clock32(struct clock_estimate *ce, uint32_t clock32);
 double clock_to_time(struct clock_estimate *ce, uint64_t clock);
 uint64_t clock_from_time(struct clock_estimate *ce, double time);
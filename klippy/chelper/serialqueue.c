@@ -12,15 +12,16 @@
 // clock times, prioritizes commands, and handles retransmissions.  A
 // background thread is launched to do this work and minimize latency.
 
-#include <linux/can.h> // // struct can_frame
 #include <math.h> // fabs
 #include <pthread.h> // pthread_mutex_lock
+#include <sched.h> // sched_yield
+#include <errno.h> // EINTR
 #include <stddef.h> // offsetof
 #include <stdint.h> // uint64_t
 #include <stdio.h> // snprintf
 #include <stdlib.h> // malloc
 #include <string.h> // memset
-#include <termios.h> // tcflush
+#include <sys/eventfd.h> // eventfd
 #include <unistd.h> // pipe
 #include "compiler.h" // __visible
 #include "list.h" // list_add_tail
@@ -28,16 +29,35 @@
 #include "pollreactor.h" // pollreactor_alloc
 #include "pyhelper.h" // get_monotonic
 #include "serialqueue.h" // struct queue_message
+#include "sqtransport.h" // sqtransport_alloc
 
 struct command_queue {
     struct list_head upcoming_queue, ready_queue;
     struct list_node node;
+    int priority;
+};
+
+// Single producer (background thread) single consumer (serialqueue_pull)
+// ring of received messages
+#define RECEIVE_RING_SIZE 1024
+
+struct receive_ring {
+    uint32_t head; // updated by the background thread
+    uint8_t pad[60];
+    uint32_t tail; // updated by serialqueue_pull()
+    struct pull_queue_message msgs[RECEIVE_RING_SIZE];
+};
+
+// Immutable list of fastreaders (replaced on each add/remove)
+struct fastreader_set {
+    int count;
+    struct fastreader *frs[];
 };
 
 struct serialqueue {
     // Input reading
     struct pollreactor *pr;
-    int serial_fd, serial_fd_type, client_id;
+    struct sqtransport *transport;
     int pipe_fds[2];
     uint8_t input_buf[4096];
     uint8_t need_sync;
@@ -45,8 +65,6 @@ struct serialqueue {
     // Threading
     pthread_t tid;
     pthread_mutex_t lock; // protects variables below
-    pthread_cond_t cond;
-    int receive_waiting;
     // Baud / clock tracking
     int receive_window;
     double bittime_adjust, idle_time;
@@ -56,22 +74,31 @@ struct serialqueue {
     uint64_t send_seq, receive_seq;
     uint64_t ignore_nak_seq, last_ack_seq, retransmit_seq, rtt_sample_seq;
     struct list_head sent_queue;
+    struct message_arena *sent_arena;
     double srtt, rttvar, rto;
+    // Selective retransmit support
+    int sack_enabled, sack_msgtag;
+    uint64_t sack_seq;
+    uint32_t sack_mask;
     // Pending transmission message queues
     struct list_head pending_queues;
     int ready_bytes, upcoming_bytes, need_ack_bytes, last_ack_bytes;
     uint64_t need_kick_clock;
     struct list_head notify_queue;
-    double last_write_fail_time;
-    // Received messages
-    struct list_head receive_queue;
+    // Received messages (messages that do not fit in the ring are
+    // placed on receive_overflow until the consumer takes them)
+    struct receive_ring *receive_ring;
+    struct list_head receive_overflow, receive_taken;
+    int receive_overflow_pending, receive_waiting, receive_efd;
     // Fastreader support
-    pthread_mutex_t fast_reader_dispatch_lock;
-    struct list_head fast_readers;
+    struct fastreader_set *fast_readers;
+    uint32_t fast_reader_seq;
     // Debugging
     struct list_head old_sent, old_receive;
     // Stats
     uint32_t bytes_write, bytes_read, bytes_retransmit, bytes_invalid;
+    uint32_t frames_write;
+    uint32_t bytes_priority[SQ_PRIO_NUM];
 };
 
 #define SQPF_SERIAL 0
@@ -82,19 +109,20 @@ struct serialqueue {
 #define SQPT_COMMAND    1
 #define SQPT_NUM        2
 
-#define SQT_UART 'u'
-#define SQT_CAN 'c'
-#define SQT_DEBUGFILE 'f'
-
 #define MIN_RTO 0.025
 #define MAX_RTO 5.000
+// The mcu's selective acknowledgment window (SACK_BLOCKS in
+// src/command.c) relies on MAX_PENDING_BLOCKS + SACK_BLOCKS - 1 being
+// less than 16 (the range of the message sequence number)
 #define MAX_PENDING_BLOCKS 12
 #define MIN_REQTIME_DELTA 0.250
 #define MIN_BACKGROUND_DELTA 0.005
+#define MAX_COALESCE_TIME 0.005
 #define IDLE_QUERY_TIME 1.0
 
 #define DEBUG_QUEUE_SENT 100
 #define DEBUG_QUEUE_RECEIVE 100
+#define SENT_ARENA_SIZE (DEBUG_QUEUE_SENT + MAX_PENDING_BLOCKS + 16)
 
 // Create a series of empty messages and add them to a list
 static void
@@ -118,14 +146,90 @@ debug_queue_add(struct list_head *root, struct queue_message *qm)
     message_free(old);
 }
 
+// Wake up the receiver thread
+static void
+wake_receive(struct serialqueue *sq)
+{
+    uint64_t val = 1;
+    int ret = write(sq->receive_efd, &val, sizeof(val));
+    if (ret < 0)
+        report_errno("eventfd write", ret);
+}
+
 // Wake up the receiver thread if it is waiting
 static void
 check_wake_receive(struct serialqueue *sq)
 {
-    if (sq->receive_waiting) {
-        sq->receive_waiting = 0;
-        pthread_cond_signal(&sq->cond);
+    if (__atomic_exchange_n(&sq->receive_waiting, 0, __ATOMIC_SEQ_CST))
+        wake_receive(sq);
+}
+
+// Pass a received message to the receiver thread (takes ownership of
+// the message; the caller must hold sq->lock)
+static void
+receive_push(struct serialqueue *sq, struct queue_message *qm)
+{
+    struct receive_ring *rr = sq->receive_ring;
+    uint32_t head = rr->head;
+    uint32_t tail = __atomic_load_n(&rr->tail, __ATOMIC_ACQUIRE);
+    if (!list_empty(&sq->receive_overflow)
+        || head - tail >= RECEIVE_RING_SIZE) {
+        // Ring is full - messages must remain in order
+        struct queue_message *oqm = message_alloc();
+        memcpy(oqm->msg, qm->msg, qm->len);
+        oqm->len = qm->len;
+        oqm->sent_time = qm->sent_time;
+        oqm->receive_time = qm->receive_time;
+        oqm->notify_id = qm->notify_id;
+        list_add_tail(&oqm->node, &sq->receive_overflow);
+        __atomic_store_n(&sq->receive_overflow_pending, 1, __ATOMIC_RELEASE);
+    } else {
+        struct pull_queue_message *pqm = &rr->msgs[head % RECEIVE_RING_SIZE];
+        memcpy(pqm->msg, qm->msg, qm->len);
+        pqm->len = qm->len;
+        pqm->sent_time = qm->sent_time;
+        pqm->receive_time = qm->receive_time;
+        pqm->notify_id = qm->notify_id;
+        __atomic_store_n(&rr->head, head + 1, __ATOMIC_RELEASE);
     }
+    if (qm->len)
+        debug_queue_add(&sq->old_receive, qm);
+    else
+        message_free(qm);
+}
+
+// Remove the next received message (returns 0 if none available)
+static int
+receive_pop(struct serialqueue *sq, struct pull_queue_message *pqm)
+{
+    if (list_empty(&sq->receive_taken)) {
+        struct receive_ring *rr = sq->receive_ring;
+        uint32_t tail = rr->tail;
+        uint32_t head = __atomic_load_n(&rr->head, __ATOMIC_ACQUIRE);
+        if (head != tail) {
+            memcpy(pqm, &rr->msgs[tail % RECEIVE_RING_SIZE], sizeof(*pqm));
+            __atomic_store_n(&rr->tail, tail + 1, __ATOMIC_RELEASE);
+            return 1;
+        }
+        if (!__atomic_load_n(&sq->receive_overflow_pending, __ATOMIC_ACQUIRE))
+            return 0;
+        // Take the messages that did not fit in the ring
+        pthread_mutex_lock(&sq->lock);
+        list_join_tail(&sq->receive_overflow, &sq->receive_taken);
+        list_init(&sq->receive_overflow);
+        sq->receive_overflow_pending = 0;
+        pthread_mutex_unlock(&sq->lock);
+    }
+    struct queue_message *qm = list_first_entry(
+        &sq->receive_taken, struct queue_message, node);
+    list_del(&qm->node);
+    memcpy(pqm->msg, qm->msg, qm->len);
+    pqm->len = qm->len;
+    pqm->sent_time = qm->sent_time;
+    pqm->receive_time = qm->receive_time;
+    pqm->notify_id = qm->notify_id;
+    message_free(qm);
+    return 1;
 }
 
 // Write to the internal pipe to wake the background thread if in poll
@@ -137,21 +241,12 @@ kick_bg_thread(struct serialqueue *sq)
         report_errno("pipe write", ret);
 }
 
-// Minimum number of bits in a canbus message
-#define CANBUS_PACKET_BITS ((1 + 11 + 3 + 4) + (16 + 2 + 7 + 3))
-#define CANBUS_IFS_BITS 4
-
 // Determine minimum time needed to transmit a given number of bytes
 static double
 calculate_bittime(struct serialqueue *sq, uint32_t bytes)
 {
-    if (sq->serial_fd_type == SQT_CAN) {
-        uint32_t pkts = DIV_ROUND_UP(bytes, 8);
-        uint32_t bits = bytes * 8 + pkts * CANBUS_PACKET_BITS - CANBUS_IFS_BITS;
-        return sq->bittime_adjust * bits;
-    } else {
-        return sq->bittime_adjust * bytes;
-    }
+    struct sqtransport *st = sq->transport;
+    return sq->bittime_adjust * st->ops->wire_bits(st, bytes);
 }
 
 // Update internal state when the receive sequence increases
@@ -215,6 +310,20 @@ update_receive_seq(struct serialqueue *sq, double eventtime, uint64_t rseq)
     }
 }
 
+// Check if a message block contains a "sack" response from the mcu
+static int
+check_sack(struct serialqueue *sq, int len, uint32_t *mask)
+{
+    if (!sq->sack_enabled)
+        return 0;
+    uint32_t data[2];
+    int ret = msgblock_decode(data, ARRAY_SIZE(data), sq->input_buf, len);
+    if (ret || (int32_t)data[0] != sq->sack_msgtag)
+        return 0;
+    *mask = data[1];
+    return 1;
+}
+
 // Process a well formed input message
 static void
 handle_message(struct serialqueue *sq, double eventtime, int len)
@@ -250,7 +359,7 @@ handle_message(struct serialqueue *sq, double eventtime, int len)
         qm->len = 0;
         qm->sent_time = sq->last_receive_sent_time;
         qm->receive_time = eventtime;
-        list_add_tail(&qm->node, &sq->receive_queue);
+        receive_push(sq, qm);
         must_wake = 1;
     }
 
@@ -262,6 +371,13 @@ handle_message(struct serialqueue *sq, double eventtime, int len)
         else if (rseq > sq->ignore_nak_seq && !list_empty(&sq->sent_queue))
             // Duplicate Ack is a Nak - do fast retransmit
             pollreactor_update_timer(sq->pr, SQPT_RETRANSMIT, PR_NOW);
+    } else if (check_sack(sq, len, &sq->sack_mask)) {
+        // Nak listing the blocks the mcu has stored - do fast retransmit
+        sq->sack_seq = rseq;
+        if (sq->last_ack_seq < rseq)
+            sq->last_ack_seq = rseq;
+        if (rseq > sq->ignore_nak_seq && !list_empty(&sq->sent_queue))
+            pollreactor_update_timer(sq->pr, SQPT_RETRANSMIT, PR_NOW);
     } else {
         // Data message - add to receive queue
         struct queue_message *qm = message_fill(sq->input_buf, len);
@@ -269,61 +385,44 @@ handle_message(struct serialqueue *sq, double eventtime, int len)
                          ? sq->last_receive_sent_time : 0.);
         qm->receive_time = get_monotonic(); // must be time post read()
         qm->receive_time -= calculate_bittime(sq, len);
-        list_add_tail(&qm->node, &sq->receive_queue);
+        receive_push(sq, qm);
         must_wake = 1;
     }
+    pthread_mutex_unlock(&sq->lock);
 
-    // Check fast readers
-    struct fastreader *fr;
-    list_for_each_entry(fr, &sq->fast_readers, node) {
+    if (must_wake)
+        check_wake_receive(sq);
+
+    // Check fast readers (the fast_reader_seq is odd while the
+    // fast_readers list may be in use)
+    __atomic_fetch_add(&sq->fast_reader_seq, 1, __ATOMIC_SEQ_CST);
+    struct fastreader_set *fs = __atomic_load_n(&sq->fast_readers
+                                                , __ATOMIC_SEQ_CST);
+    int i;
+    for (i=0; fs && i<fs->count; i++) {
+        struct fastreader *fr = fs->frs[i];
         if (len < fr->prefix_len + MESSAGE_MIN
             || memcmp(&sq->input_buf[MESSAGE_HEADER_SIZE]
                       , fr->prefix, fr->prefix_len) != 0)
             continue;
-        // Release main lock and invoke callback
-        pthread_mutex_lock(&sq->fast_reader_dispatch_lock);
-        if (must_wake)
-            check_wake_receive(sq);
-        pthread_mutex_unlock(&sq->lock);
         fr->func(fr, sq->input_buf, len);
-        pthread_mutex_unlock(&sq->fast_reader_dispatch_lock);
-        return;
+        break;
     }
-
-    if (must_wake)
-        check_wake_receive(sq);
-    pthread_mutex_unlock(&sq->lock);
+    __atomic_fetch_add(&sq->fast_reader_seq, 1, __ATOMIC_RELEASE);
 }
 
 // Callback for input activity on the serial fd
 static void
 input_event(struct serialqueue *sq, double eventtime)
 {
-    if (sq->serial_fd_type == SQT_CAN) {
-        struct can_frame cf;
-        int ret = read(sq->serial_fd, &cf, sizeof(cf));
-        if (ret <= 0) {
-            report_errno("can read", ret);
-            pollreactor_do_exit(sq->pr);
-            return;
-        }
-        if (cf.can_id != sq->client_id + 1)
-            return;
-        memcpy(&sq->input_buf[sq->input_pos], cf.data, cf.can_dlc);
-        sq->input_pos += cf.can_dlc;
-    } else {
-        int ret = read(sq->serial_fd, &sq->input_buf[sq->input_pos]
-                       , sizeof(sq->input_buf) - sq->input_pos);
-        if (ret <= 0) {
-            if(ret < 0)
-                report_errno("read", ret);
-            else
-                errorf("Got EOF when reading from device");
-            pollreactor_do_exit(sq->pr);
-            return;
-        }
-        sq->input_pos += ret;
+    struct sqtransport *st = sq->transport;
+    int ret = st->ops->read(st, &sq->input_buf[sq->input_pos]
+                            , sizeof(sq->input_buf) - sq->input_pos);
+    if (ret < 0) {
+        pollreactor_do_exit(sq->pr);
+        return;
     }
+    sq->input_pos += ret;
     for (;;) {
         int len = msgblock_check(&sq->need_sync, sq->input_buf, sq->input_pos);
         if (!len)
@@ -356,59 +455,47 @@ kick_event(struct serialqueue *sq, double eventtime)
     pollreactor_update_timer(sq->pr, SQPT_COMMAND, PR_NOW);
 }
 
-// OS write of data to be sent to the mcu
+// Write data to be sent to the mcu
 static void
 do_write(struct serialqueue *sq, void *buf, int buflen)
 {
-    if (sq->serial_fd_type != SQT_CAN) {
-        int ret = write(sq->serial_fd, buf, buflen);
-        if (ret < 0)
-            report_errno("write", ret);
-        return;
-    }
-    // Write to CAN fd
-    struct can_frame cf;
-    while (buflen) {
-        int size = buflen > 8 ? 8 : buflen;
-        cf.can_id = sq->client_id;
-        cf.can_dlc = size;
-        memcpy(cf.data, buf, size);
-        int ret = write(sq->serial_fd, &cf, sizeof(cf));
-        if (ret < 0) {
-            report_errno("can write", ret);
-            double curtime = get_monotonic();
-            if (!sq->last_write_fail_time) {
-                sq->last_write_fail_time = curtime;
-            } else if (curtime > sq->last_write_fail_time + 10.0) {
-                errorf("Halting reads due to CAN write errors.");
-                pollreactor_do_exit(sq->pr);
-            }
-            return;
-        }
-        sq->last_write_fail_time = 0.0;
-        buf += size;
-        buflen -= size;
-    }
+    struct sqtransport *st = sq->transport;
+    int ret = st->ops->write(st, buf, buflen);
+    if (ret < 0)
+        pollreactor_do_exit(sq->pr);
 }
 
 // Callback timer for when a retransmit should be done
 static double
 retransmit_event(struct serialqueue *sq, double eventtime)
 {
-    if (sq->serial_fd_type == SQT_UART) {
-        int ret = tcflush(sq->serial_fd, TCOFLUSH);
-        if (ret < 0)
-            report_errno("tcflush", ret);
-    }
+    struct sqtransport *st = sq->transport;
+    if (st->ops->flush)
+        st->ops->flush(st);
 
     pthread_mutex_lock(&sq->lock);
 
-    // Retransmit all pending messages
+    // On a nak with a selective ack, only retransmit the blocks prior to
+    // the last stored block that the mcu has not received
+    int is_nak = pollreactor_get_timer(sq->pr, SQPT_RETRANSMIT) == PR_NOW;
+    uint32_t sack_mask = 0;
+    if (is_nak && sq->sack_seq == sq->receive_seq)
+        sack_mask = sq->sack_mask;
+
+    // Retransmit pending messages
     uint8_t buf[MESSAGE_MAX * MAX_PENDING_BLOCKS + 1];
     int buflen = 0, first_buflen = 0;
     buf[buflen++] = MESSAGE_SYNC;
     struct queue_message *qm;
     list_for_each_entry(qm, &sq->sent_queue, node) {
+        if (sack_mask) {
+            int skip = sack_mask & 1;
+            sack_mask >>= 1;
+            if (!sack_mask)
+                break;
+            if (skip)
+                continue;
+        }
         memcpy(&buf[buflen], qm->msg, qm->len);
         buflen += qm->len;
         if (!first_buflen)
@@ -418,7 +505,7 @@ retransmit_event(struct serialqueue *sq, double eventtime)
     sq->bytes_retransmit += buflen;
 
     // Update rto
-    if (pollreactor_get_timer(sq->pr, SQPT_RETRANSMIT) == PR_NOW) {
+    if (is_nak) {
         // Retransmit due to nak
         sq->ignore_nak_seq = sq->receive_seq;
         if (sq->receive_seq < sq->retransmit_seq)
@@ -447,15 +534,20 @@ build_and_send_command(struct serialqueue *sq, uint8_t *buf, int pending
 {
     int len = MESSAGE_HEADER_SIZE;
     while (sq->ready_bytes) {
-        // Find highest priority message (message with lowest req_clock)
+        // Find highest priority message (message in the highest priority
+        // class and then with the lowest req_clock)
         uint64_t min_clock = MAX_CLOCK;
+        int min_priority = SQ_PRIO_NUM;
         struct command_queue *q, *cq = NULL;
         struct queue_message *qm = NULL;
         list_for_each_entry(q, &sq->pending_queues, node) {
             if (!list_empty(&q->ready_queue)) {
                 struct queue_message *m = list_first_entry(
                     &q->ready_queue, struct queue_message, node);
-                if (m->req_clock < min_clock) {
+                if (q->priority < min_priority
+                    || (q->priority == min_priority
+                        && m->req_clock < min_clock)) {
+                    min_priority = q->priority;
                     min_clock = m->req_clock;
                     cq = q;
                     qm = m;
@@ -471,6 +563,7 @@ build_and_send_command(struct serialqueue *sq, uint8_t *buf, int pending
         memcpy(&buf[len], qm->msg, qm->len);
         len += qm->len;
         sq->ready_bytes -= qm->len;
+        sq->bytes_priority[cq->priority] += qm->len;
         if (qm->notify_id) {
             // Message requires notification - add to notify list
             qm->req_clock = sq->send_seq;
@@ -492,7 +585,7 @@ build_and_send_command(struct serialqueue *sq, uint8_t *buf, int pending
     // Store message block
     double idletime = eventtime > sq->idle_time ? eventtime : sq->idle_time;
     idletime += calculate_bittime(sq, pending + len);
-    struct queue_message *out = message_alloc();
+    struct queue_message *out = message_arena_get(sq->sent_arena);
     memcpy(out->msg, buf, len);
     out->len = len;
     out->sent_time = eventtime;
@@ -569,8 +662,18 @@ check_send_command(struct serialqueue *sq, int pending, double eventtime)
         return PR_NEVER;
     }
     uint64_t reqclock_delta = MIN_REQTIME_DELTA * sq->ce.est_freq;
-    if (min_ready_clock <= ack_clock + reqclock_delta)
-        return PR_NOW;
+    if (min_ready_clock <= ack_clock + reqclock_delta) {
+        // If the block would end in a partially filled transport frame
+        // then hold it briefly (if deadlines permit) so that messages
+        // arriving soon can fill the remainder of that frame
+        int frame_size = sq->transport->frame_size;
+        uint64_t coalesce_delta = MAX_COALESCE_TIME * sq->ce.est_freq;
+        if (frame_size <= 1
+            || !((pending + MESSAGE_MIN + sq->ready_bytes) % frame_size)
+            || min_ready_clock <= ack_clock + reqclock_delta - coalesce_delta)
+            return PR_NOW;
+        reqclock_delta -= coalesce_delta;
+    }
     uint64_t wantclock = min_ready_clock - reqclock_delta;
     if (min_stalled_clock < wantclock)
         wantclock = min_stalled_clock;
@@ -593,6 +696,9 @@ command_event(struct serialqueue *sq, double eventtime)
                 // Write message blocks
                 do_write(sq, buf, buflen);
                 sq->bytes_write += buflen;
+                int frame_size = sq->transport->frame_size;
+                sq->frames_write += (frame_size > 1
+                                     ? DIV_ROUND_UP(buflen, frame_size) : 1);
                 double idletime = (eventtime > sq->idle_time
                                    ? eventtime : sq->idle_time);
                 sq->idle_time = idletime + calculate_bittime(sq, buflen);
@@ -614,9 +720,7 @@ background_thread(void *data)
     struct serialqueue *sq = data;
     pollreactor_run(sq->pr);
 
-    pthread_mutex_lock(&sq->lock);
-    check_wake_receive(sq);
-    pthread_mutex_unlock(&sq->lock);
+    wake_receive(sq);
 
     return NULL;
 }
@@ -625,11 +729,13 @@ background_thread(void *data)
 struct serialqueue * __visible
 serialqueue_alloc(int serial_fd, char serial_fd_type, int client_id)
 {
+    struct sqtransport *st = sqtransport_alloc(serial_fd, serial_fd_type
+                                               , client_id);
+    if (!st)
+        return NULL;
     struct serialqueue *sq = malloc(sizeof(*sq));
     memset(sq, 0, sizeof(*sq));
-    sq->serial_fd = serial_fd;
-    sq->serial_fd_type = serial_fd_type;
-    sq->client_id = client_id;
+    sq->transport = st;
 
     int ret = pipe(sq->pipe_fds);
     if (ret)
@@ -637,18 +743,18 @@ serialqueue_alloc(int serial_fd, char serial_fd_type, int client_id)
 
     // Reactor setup
     sq->pr = pollreactor_alloc(SQPF_NUM, SQPT_NUM, sq);
-    pollreactor_add_fd(sq->pr, SQPF_SERIAL, serial_fd, input_event
-                       , serial_fd_type==SQT_DEBUGFILE);
+    pollreactor_add_fd(sq->pr, SQPF_SERIAL, st->poll_fd, input_event
+                       , st->write_only);
     pollreactor_add_fd(sq->pr, SQPF_PIPE, sq->pipe_fds[0], kick_event, 0);
     pollreactor_add_timer(sq->pr, SQPT_RETRANSMIT, retransmit_event);
     pollreactor_add_timer(sq->pr, SQPT_COMMAND, command_event);
-    fd_set_non_blocking(serial_fd);
+    fd_set_non_blocking(st->poll_fd);
     fd_set_non_blocking(sq->pipe_fds[0]);
     fd_set_non_blocking(sq->pipe_fds[1]);
 
     // Retransmit setup
     sq->send_seq = 1;
-    if (serial_fd_type == SQT_DEBUGFILE) {
+    if (st->write_only) {
         // Debug file output
         sq->receive_seq = -1;
         sq->rto = PR_NEVER;
@@ -661,9 +767,12 @@ serialqueue_alloc(int serial_fd, char serial_fd_type, int client_id)
     sq->need_kick_clock = MAX_CLOCK;
     list_init(&sq->pending_queues);
     list_init(&sq->sent_queue);
-    list_init(&sq->receive_queue);
+    sq->sent_arena = message_arena_alloc(SENT_ARENA_SIZE);
+    sq->receive_ring = malloc(sizeof(*sq->receive_ring));
+    memset(sq->receive_ring, 0, sizeof(*sq->receive_ring));
+    list_init(&sq->receive_overflow);
+    list_init(&sq->receive_taken);
     list_init(&sq->notify_queue);
-    list_init(&sq->fast_readers);
 
     // Debugging
     list_init(&sq->old_sent);
@@ -675,12 +784,11 @@ serialqueue_alloc(int serial_fd, char serial_fd_type, int client_id)
     ret = pthread_mutex_init(&sq->lock, NULL);
     if (ret)
         goto fail;
-    ret = pthread_cond_init(&sq->cond, NULL);
-    if (ret)
-        goto fail;
-    ret = pthread_mutex_init(&sq->fast_reader_dispatch_lock, NULL);
-    if (ret)
+    sq->receive_efd = eventfd(0, EFD_CLOEXEC);
+    if (sq->receive_efd < 0) {
+        ret = sq->receive_efd;
         goto fail;
+    }
     ret = pthread_create(&sq->tid, NULL, background_thread, sq);
     if (ret)
         goto fail;
@@ -713,7 +821,9 @@ serialqueue_free(struct serialqueue *sq)
         serialqueue_exit(sq);
     pthread_mutex_lock(&sq->lock);
     message_queue_free(&sq->sent_queue);
-    message_queue_free(&sq->receive_queue);
+    free(sq->receive_ring);
+    message_queue_free(&sq->receive_overflow);
+    message_queue_free(&sq->receive_taken);
     message_queue_free(&sq->notify_queue);
     message_queue_free(&sq->old_sent);
     message_queue_free(&sq->old_receive);
@@ -724,8 +834,12 @@ serialqueue_free(struct serialqueue *sq)
         message_queue_free(&cq->ready_queue);
         message_queue_free(&cq->upcoming_queue);
     }
+    message_arena_free(sq->sent_arena);
     pthread_mutex_unlock(&sq->lock);
     pollreactor_free(sq->pr);
+    close(sq->receive_efd);
+    free(sq->fast_readers);
+    sqtransport_free(sq->transport);
     free(sq);
 }
 
@@ -753,25 +867,57 @@ serialqueue_free_commandqueue(struct command_queue *cq)
     free(cq);
 }
 
+// Replace the list of low-latency message handlers
+static void
+update_fastreaders(struct serialqueue *sq, struct fastreader *add
+                   , struct fastreader *remove)
+{
+    pthread_mutex_lock(&sq->lock);
+    struct fastreader_set *old = sq->fast_readers;
+    int count = old ? old->count : 0, i;
+    struct fastreader_set *fs = malloc(sizeof(*fs)
+                                       + (count + 1) * sizeof(fs->frs[0]));
+    fs->count = 0;
+    for (i=0; i<count; i++)
+        if (old->frs[i] != remove)
+            fs->frs[fs->count++] = old->frs[i];
+    if (add)
+        fs->frs[fs->count++] = add;
+    __atomic_store_n(&sq->fast_readers, fs, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&sq->lock);
+
+    // Wait for the background thread to stop using the old list
+    uint32_t seq = __atomic_load_n(&sq->fast_reader_seq, __ATOMIC_SEQ_CST);
+    if (seq & 1)
+        while (__atomic_load_n(&sq->fast_reader_seq, __ATOMIC_ACQUIRE) == seq)
+            sched_yield();
+    free(old);
+}
+
 // Add a low-latency message handler
 void
 serialqueue_add_fastreader(struct serialqueue *sq, struct fastreader *fr)
 {
-    pthread_mutex_lock(&sq->lock);
-    list_add_tail(&fr->node, &sq->fast_readers);
-    pthread_mutex_unlock(&sq->lock);
+    update_fastreaders(sq, fr, NULL);
 }
 
 // Remove a previously registered low-latency message handler
 void
 serialqueue_rm_fastreader(struct serialqueue *sq, struct fastreader *fr)
 {
-    pthread_mutex_lock(&sq->lock);
-    list_del(&fr->node);
-    pthread_mutex_unlock(&sq->lock);
+    update_fastreaders(sq, NULL, fr);
+}
 
-    pthread_mutex_lock(&sq->fast_reader_dispatch_lock); // XXX - goofy locking
-    pthread_mutex_unlock(&sq->fast_reader_dispatch_lock);
+// Set the priority class of a command_queue (must be called prior to
+// sending any messages on the queue)
+void __visible
+serialqueue_set_commandqueue_priority(struct command_queue *cq, int priority)
+{
+    if (priority < 0 || priority >= SQ_PRIO_NUM) {
+        errorf("Invalid command queue priority %d", priority);
+        return;
+    }
+    cq->priority = priority;
 }
 
 // Add a batch of messages to the given command_queue
@@ -840,51 +986,30 @@ serialqueue_send(struct serialqueue *sq, struct command_queue *cq, uint8_t *msg
 void __visible
 serialqueue_pull(struct serialqueue *sq, struct pull_queue_message *pqm)
 {
-    pthread_mutex_lock(&sq->lock);
-    // Wait for message to be available
-    while (list_empty(&sq->receive_queue)) {
+    for (;;) {
+        if (receive_pop(sq, pqm))
+            return;
         if (pollreactor_is_exit(sq->pr))
-            goto exit;
-        sq->receive_waiting = 1;
-        int ret = pthread_cond_wait(&sq->cond, &sq->lock);
-        if (ret)
-            report_errno("pthread_cond_wait", ret);
+            break;
+        // Wait for the background thread to add a message
+        __atomic_exchange_n(&sq->receive_waiting, 1, __ATOMIC_SEQ_CST);
+        if (receive_pop(sq, pqm)) {
+            __atomic_store_n(&sq->receive_waiting, 0, __ATOMIC_RELAXED);
+            return;
+        }
+        uint64_t val;
+        int ret = read(sq->receive_efd, &val, sizeof(val));
+        if (ret < 0 && errno != EINTR)
+            report_errno("eventfd read", ret);
     }
-
-    // Remove message from queue
-    struct queue_message *qm = list_first_entry(
-        &sq->receive_queue, struct queue_message, node);
-    list_del(&qm->node);
-
-    // Copy message
-    memcpy(pqm->msg, qm->msg, qm->len);
-    pqm->len = qm->len;
-    pqm->sent_time = qm->sent_time;
-    pqm->receive_time = qm->receive_time;
-    pqm->notify_id = qm->notify_id;
-    if (qm->len)
-        debug_queue_add(&sq->old_receive, qm);
-    else
-        message_free(qm);
-
-    pthread_mutex_unlock(&sq->lock);
-    return;
-
-exit:
     pqm->len = -1;
-    pthread_mutex_unlock(&sq->lock);
 }
 
 void __visible
 serialqueue_set_wire_frequency(struct serialqueue *sq, double frequency)
 {
     pthread_mutex_lock(&sq->lock);
-    if (sq->serial_fd_type == SQT_CAN) {
-        sq->bittime_adjust = 1. / frequency;
-    } else {
-        // An 8N1 serial line is 10 bits per byte (1 start, 8 data, 1 stop)
-        sq->bittime_adjust = 10. / frequency;
-    }
+    sq->bittime_adjust = 1. / frequency;
     pthread_mutex_unlock(&sq->lock);
 }
 
@@ -896,6 +1021,17 @@ serialqueue_set_receive_window(struct serialqueue *sq, int receive_window)
     pthread_mutex_unlock(&sq->lock);
 }
 
+// Enable selective retransmit using the msgtag of the mcu's "sack"
+// response
+void __visible
+serialqueue_set_sack(struct serialqueue *sq, int msgtag)
+{
+    pthread_mutex_lock(&sq->lock);
+    sq->sack_enabled = 1;
+    sq->sack_msgtag = msgtag;
+    pthread_mutex_unlock(&sq->lock);
+}
+
 // Set the estimated clock rate of the mcu on the other end of the
 // serial port
 void __visible
@@ -933,13 +1069,20 @@ serialqueue_get_stats(struct serialqueue *sq, char *buf, int len)
              " bytes_retransmit=%u bytes_invalid=%u"
              " send_seq=%u receive_seq=%u retransmit_seq=%u"
              " srtt=%.3f rttvar=%.3f rto=%.3f"
-             " ready_bytes=%u upcoming_bytes=%u"
+             " ready_bytes=%u upcoming_bytes=%u frames_write=%u"
+             " bytes_motion=%u bytes_trsync=%u bytes_sensor=%u"
+             " bytes_cosmetic=%u"
              , stats.bytes_write, stats.bytes_read
              , stats.bytes_retransmit, stats.bytes_invalid
              , (int)stats.send_seq, (int)stats.receive_seq
              , (int)stats.retransmit_seq
              , stats.srtt, stats.rttvar, stats.rto
-             , stats.ready_bytes, stats.upcoming_bytes);
+             , stats.ready_bytes, stats.upcoming_bytes
+             , stats.frames_write
+             , stats.bytes_priority[SQ_PRIO_MOTION]
+             , stats.bytes_priority[SQ_PRIO_TRSYNC]
+             , stats.bytes_priority[SQ_PRIO_SENSOR]
+             , stats.bytes_priority[SQ_PRIO_COSMETIC]);
 }
 
 // Extract old messages stored in the debug queues
@@ -12,7 +12,6 @@ struct fastreader;
 typedef void (*fastreader_cb)(struct fastreader *fr, uint8_t *data, int len);
 
 struct fastreader {
-    struct list_node node;
     fastreader_cb func;
     int prefix_len;
     uint8_t prefix[MESSAGE_MAX];
@@ -25,6 +24,12 @@ struct pull_queue_message {
     uint64_t notify_id;
 };
 
+// Command queue priority classes (lower values are sent first)
+enum {
+    SQ_PRIO_MOTION, SQ_PRIO_TRSYNC, SQ_PRIO_SENSOR, SQ_PRIO_COSMETIC,
+    SQ_PRIO_NUM
+};
+
 struct serialqueue;
 struct serialqueue *serialqueue_alloc(int serial_fd, char serial_fd_type
                                       , int client_id);
@@ -32,6 +37,8 @@ void serialqueue_exit(struct serialqueue *sq);
 void serialqueue_free(struct serialqueue *sq);
 struct command_queue *serialqueue_alloc_commandqueue(void);
 void serialqueue_free_commandqueue(struct command_queue *cq);
+void serialqueue_set_commandqueue_priority(struct command_queue *cq
+                                           , int priority);
 void serialqueue_add_fastreader(struct serialqueue *sq, struct fastreader *fr);
 void serialqueue_rm_fastreader(struct serialqueue *sq, struct fastreader *fr);
 void serialqueue_send_batch(struct serialqueue *sq, struct command_queue *cq
@@ -44,6 +51,7 @@ void serialqueue_send(struct serialqueue *sq, struct command_queue *cq
 void serialqueue_pull(struct serialqueue *sq, struct pull_queue_message *pqm);
 void serialqueue_set_wire_frequency(struct serialqueue *sq, double frequency);
 void serialqueue_set_receive_window(struct serialqueue *sq, int receive_window);
+void serialqueue_set_sack(struct serialqueue *sq, int msgtag);
 void serialqueue_set_clock_est(struct serialqueue *sq, double est_freq
                                , double conv_time, uint64_t conv_clock
                                , uint64_t last_clock);
@@ -0,0 +1,428 @@
+// Low-level transports used by the serialqueue code
+//
+// Copyright (C) 2016-2021  Kevin O'Connor <kevin@koconnor.net>
+// Copyright (C) 2026  agent <agent@local>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// Each transport moves raw message block bytes to and from an mcu.
+// The serialqueue code handles message framing, sequencing, and
+// retransmits and is not aware of the transport in use.  To add a
+// new transport, implement a 'struct sqtransport_ops' and add it to
+// sqtransport_alloc().
+
+#include <errno.h> // EAGAIN
+#include <linux/can.h> // struct can_frame
+#include <poll.h> // poll
+#include <stddef.h> // offsetof
+#include <stdlib.h> // malloc
+#include <string.h> // memset
+#include <sys/epoll.h> // epoll_create1
+#include <sys/mman.h> // mmap
+#include <sys/socket.h> // recvmsg
+#include <termios.h> // tcflush
+#include <unistd.h> // read
+#include "compiler.h" // container_of
+#include "pyhelper.h" // errorf
+#include "sqtransport.h" // sqtransport_alloc
+
+
+/****************************************************************
+ * File descriptor based transports (serial ports, pipes, files)
+ ****************************************************************/
+
+static int
+fd_read(struct sqtransport *st, uint8_t *buf, int len)
+{
+    int ret = read(st->poll_fd, buf, len);
+    if (ret <= 0) {
+        if (ret < 0)
+            report_errno("read", ret);
+        else
+            errorf("Got EOF when reading from device");
+        return -1;
+    }
+    return ret;
+}
+
+static int
+fd_write(struct sqtransport *st, uint8_t *buf, int len)
+{
+    int ret = write(st->poll_fd, buf, len);
+    if (ret < 0)
+        report_errno("write", ret);
+    return 0;
+}
+
+static void
+uart_flush(struct sqtransport *st)
+{
+    int ret = tcflush(st->poll_fd, TCOFLUSH);
+    if (ret < 0)
+        report_errno("tcflush", ret);
+}
+
+// An 8N1 serial line is 10 bits per byte (1 start, 8 data, 1 stop)
+static uint32_t
+uart_wire_bits(struct sqtransport *st, uint32_t bytes)
+{
+    return bytes * 10;
+}
+
+static void
+fd_free(struct sqtransport *st)
+{
+    free(st);
+}
+
+static const struct sqtransport_ops uart_ops = {
+    .read = fd_read, .write = fd_write, .flush = uart_flush,
+    .wire_bits = uart_wire_bits, .free = fd_free,
+};
+
+static const struct sqtransport_ops debugfile_ops = {
+    .read = fd_read, .write = fd_write,
+    .wire_bits = uart_wire_bits, .free = fd_free,
+};
+
+static struct sqtransport *
+fd_transport_alloc(int fd, const struct sqtransport_ops *ops)
+{
+    struct sqtransport *st = malloc(sizeof(*st));
+    memset(st, 0, sizeof(*st));
+    st->ops = ops;
+    st->poll_fd = fd;
+    return st;
+}
+
+
+/****************************************************************
+ * CAN bus transport
+ ****************************************************************/
+
+struct can_transport {
+    struct sqtransport st;
+    int client_id;
+    double last_write_fail_time;
+};
+
+static int
+can_read(struct sqtransport *st, uint8_t *buf, int len)
+{
+    struct can_transport *ct = container_of(st, struct can_transport, st);
+    struct can_frame cf;
+    int ret = read(st->poll_fd, &cf, sizeof(cf));
+    if (ret <= 0) {
+        report_errno("can read", ret);
+        return -1;
+    }
+    if (cf.can_id != ct->client_id + 1 || cf.can_dlc > len)
+        return 0;
+    memcpy(buf, cf.data, cf.can_dlc);
+    return cf.can_dlc;
+}
+
+static int
+can_write(struct sqtransport *st, uint8_t *buf, int len)
+{
+    struct can_transport *ct = container_of(st, struct can_transport, st);
+    struct can_frame cf;
+    while (len) {
+        int size = len > 8 ? 8 : len;
+        cf.can_id = ct->client_id;
+        cf.can_dlc = size;
+        memcpy(cf.data, buf, size);
+        int ret = write(st->poll_fd, &cf, sizeof(cf));
+        if (ret < 0) {
+            report_errno("can write", ret);
+            double curtime = get_monotonic();
+            if (!ct->last_write_fail_time) {
+                ct->last_write_fail_time = curtime;
+            } else if (curtime > ct->last_write_fail_time + 10.0) {
+                errorf("Halting reads due to CAN write errors.");
+                return -1;
+            }
+            return 0;
+        }
+        ct->last_write_fail_time = 0.0;
+        buf += size;
+        len -= size;
+    }
+    return 0;
+}
+
+// Minimum number of bits in a canbus message
+#define CANBUS_PACKET_BITS ((1 + 11 + 3 + 4) + (16 + 2 + 7 + 3))
+#define CANBUS_IFS_BITS 4
+
+static uint32_t
+can_wire_bits(struct sqtransport *st, uint32_t bytes)
+{
+    uint32_t pkts = DIV_ROUND_UP(bytes, 8);
+    return bytes * 8 + pkts * CANBUS_PACKET_BITS - CANBUS_IFS_BITS;
+}
+
+static void
+can_free(struct sqtransport *st)
+{
+    free(container_of(st, struct can_transport, st));
+}
+
+static const struct sqtransport_ops can_ops = {
+    .read = can_read, .write = can_write,
+    .wire_bits = can_wire_bits, .free = can_free,
+};
+
+static struct sqtransport *
+can_transport_alloc(int fd, int client_id)
+{
+    struct can_transport *ct = malloc(sizeof(*ct));
+    memset(ct, 0, sizeof(*ct));
+    ct->st.ops = &can_ops;
+    ct->st.poll_fd = fd;
+    ct->st.frame_size = 8;
+    ct->client_id = client_id;
+    return &ct->st;
+}
+
+
+/****************************************************************
+ * Shared memory transport
+ ****************************************************************/
+
+// A linux "host mcu" process started with "-S" listens on a unix
+// domain socket.  On connect it replies with a shared memory region
+// (containing a ring buffer in each direction) and two eventfds that
+// are used to wake the receiver after data is added to a ring.  This
+// layout must match the one in src/linux/console.c.  The mcu keeps
+// the socket open, so the host polls it (along with its eventfd) to
+// detect that the mcu process has exited.
+
+#define SHM_CONSOLE_MAGIC 0x4d48534b // "KSHM"
+#define SHM_RING_SIZE 16384
+#define SHM_CONNECT_TIMEOUT_MS 5000
+
+struct shm_ring {
+    uint32_t head; // updated by the producer
+    uint8_t pad1[60];
+    uint32_t tail; // updated by the consumer
+    uint8_t pad2[60];
+    uint8_t data[SHM_RING_SIZE];
+};
+
+struct shm_console {
+    uint32_t magic, size;
+    uint8_t pad[56];
+    struct shm_ring to_mcu, to_host;
+};
+
+struct shm_transport {
+    struct sqtransport st;
+    struct shm_console *shm;
+    int sock_fd, wake_mcu_fd, wake_host_fd;
+    int ring_full;
+};
+
+// Copy available data out of a ring buffer
+static int
+shm_ring_read(struct shm_ring *r, uint8_t *buf, int len)
+{
+    uint32_t tail = r->tail, head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    uint32_t avail = head - tail;
+    if (avail > len)
+        avail = len;
+    uint32_t pos = tail % SHM_RING_SIZE, first = SHM_RING_SIZE - pos;
+    if (first > avail)
+        first = avail;
+    memcpy(buf, &r->data[pos], first);
+    memcpy(&buf[first], r->data, avail - first);
+    __atomic_store_n(&r->tail, tail + avail, __ATOMIC_RELEASE);
+    return avail;
+}
+
+// Add data to a ring buffer (if there is space for all of it)
+static int
+shm_ring_write(struct shm_ring *r, uint8_t *buf, int len)
+{
+    uint32_t head = r->head, tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (SHM_RING_SIZE - (head - tail) < len)
+        return -1;
+    uint32_t pos = head % SHM_RING_SIZE, first = SHM_RING_SIZE - pos;
+    if (first > len)
+        first = len;
+    memcpy(&r->data[pos], buf, first);
+    memcpy(r->data, &buf[first], len - first);
+    __atomic_store_n(&r->head, head + len, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static int
+shm_read(struct sqtransport *st, uint8_t *buf, int len)
+{
+    struct shm_transport *mt = container_of(st, struct shm_transport, st);
+    int ret = shm_ring_read(&mt->shm->to_host, buf, len);
+    if (ret)
+        return ret;
+    // Ring is empty - clear the wakeup and then check again
+    uint64_t val;
+    ret = read(mt->wake_host_fd, &val, sizeof(val));
+    if (ret < 0) {
+        if (errno != EAGAIN) {
+            report_errno("shm eventfd read", ret);
+            return -1;
+        }
+        // Woken by the socket - check if the mcu has closed it
+        uint8_t dummy;
+        ret = recv(mt->sock_fd, &dummy, sizeof(dummy), MSG_DONTWAIT);
+        if (!ret || (ret < 0 && errno != EAGAIN)) {
+            errorf("Lost connection to shm transport mcu");
+            return -1;
+        }
+    }
+    return shm_ring_read(&mt->shm->to_host, buf, len);
+}
+
+static int
+shm_write(struct sqtransport *st, uint8_t *buf, int len)
+{
+    struct shm_transport *mt = container_of(st, struct shm_transport, st);
+    if (shm_ring_write(&mt->shm->to_mcu, buf, len)) {
+        // Not an error - the retransmit code will resend the data
+        if (!mt->ring_full)
+            errorf("shm transport ring full");
+        mt->ring_full = 1;
+        return 0;
+    }
+    mt->ring_full = 0;
+    uint64_t val = 1;
+    int ret = write(mt->wake_mcu_fd, &val, sizeof(val));
+    if (ret < 0)
+        report_errno("shm eventfd write", ret);
+    return 0;
+}
+
+static uint32_t
+shm_wire_bits(struct sqtransport *st, uint32_t bytes)
+{
+    return bytes * 8;
+}
+
+static void
+shm_free(struct sqtransport *st)
+{
+    struct shm_transport *mt = container_of(st, struct shm_transport, st);
+    munmap(mt->shm, sizeof(*mt->shm));
+    close(mt->wake_mcu_fd);
+    close(mt->wake_host_fd);
+    close(st->poll_fd);
+    free(mt);
+}
+
+static const struct sqtransport_ops shm_ops = {
+    .read = shm_read, .write = shm_write,
+    .wire_bits = shm_wire_bits, .free = shm_free,
+};
+
+// Obtain the shared memory region and wakeup fds from the mcu
+static struct sqtransport *
+shm_transport_alloc(int fd)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    int ret = poll(&pfd, 1, SHM_CONNECT_TIMEOUT_MS);
+    if (ret <= 0) {
+        errorf("Timeout waiting for shm transport setup");
+        return NULL;
+    }
+    int fds[3];
+    uint8_t dummy;
+    struct iovec iov = { .iov_base = &dummy, .iov_len = sizeof(dummy) };
+    union {
+        struct cmsghdr align;
+        uint8_t buf[CMSG_SPACE(sizeof(fds))];
+    } cbuf;
+    struct msghdr mh = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = cbuf.buf, .msg_controllen = sizeof(cbuf.buf),
+    };
+    ret = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC);
+    if (ret < 0) {
+        report_errno("shm recvmsg", ret);
+        return NULL;
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET
+        || cmsg->cmsg_type != SCM_RIGHTS
+        || cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        errorf("Invalid shm transport setup message");
+        return NULL;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    struct shm_console *shm = mmap(NULL, sizeof(*shm), PROT_READ|PROT_WRITE
+                                   , MAP_SHARED, fds[0], 0);
+    close(fds[0]);
+    if (shm == MAP_FAILED || shm->magic != SHM_CONSOLE_MAGIC
+        || shm->size != sizeof(*shm)) {
+        errorf("Invalid shm transport memory region");
+        if (shm != MAP_FAILED)
+            munmap(shm, sizeof(*shm));
+        close(fds[1]);
+        close(fds[2]);
+        return NULL;
+    }
+    // Wait on both the mcu's eventfd and the socket
+    int efd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = { .events = EPOLLIN };
+    if (efd < 0 || epoll_ctl(efd, EPOLL_CTL_ADD, fds[2], &ev)
+        || epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev)) {
+        report_errno("shm epoll", -1);
+        if (efd >= 0)
+            close(efd);
+        munmap(shm, sizeof(*shm));
+        close(fds[1]);
+        close(fds[2]);
+        return NULL;
+    }
+    struct shm_transport *mt = malloc(sizeof(*mt));
+    memset(mt, 0, sizeof(*mt));
+    mt->st.ops = &shm_ops;
+    mt->st.poll_fd = efd;
+    mt->shm = shm;
+    mt->sock_fd = fd;
+    mt->wake_mcu_fd = fds[1];
+    mt->wake_host_fd = fds[2];
+    return &mt->st;
+}
+
+
+/****************************************************************
+ * Transport interface
+ ****************************************************************/
+
+// Create a transport for the given file descriptor type
+struct sqtransport *
+sqtransport_alloc(int fd, char fd_type, int client_id)
+{
+    struct sqtransport *st;
+    switch (fd_type) {
+    case SQT_UART:
+        return fd_transport_alloc(fd, &uart_ops);
+    case SQT_CAN:
+        return can_transport_alloc(fd, client_id);
+    case SQT_DEBUGFILE:
+        st = fd_transport_alloc(fd, &debugfile_ops);
+        st->write_only = 1;
+        return st;
+    case SQT_SHM:
+        return shm_transport_alloc(fd);
+    }
+    errorf("Unknown serialqueue transport type '%c'", fd_type);
+    return NULL;
+}
+
+// Free a transport (the original file descriptor is not closed)
+void
+sqtransport_free(struct sqtransport *st)
+{
+    if (st)
+        st->ops->free(st);
+}
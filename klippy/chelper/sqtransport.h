@@ -0,0 +1,35 @@
+#ifndef SQTRANSPORT_H
+#define SQTRANSPORT_H
+
+#include <stdint.h> // uint8_t
+
+#define SQT_UART 'u'
+#define SQT_CAN 'c'
+#define SQT_DEBUGFILE 'f'
+#define SQT_SHM 'm'
+
+struct sqtransport;
+
+struct sqtransport_ops {
+    // Read available data (return 0 if none and -1 if connection lost)
+    int (*read)(struct sqtransport *st, uint8_t *buf, int len);
+    // Write data (return -1 if the connection should be halted)
+    int (*write)(struct sqtransport *st, uint8_t *buf, int len);
+    // Discard any unsent data prior to a retransmit (optional)
+    void (*flush)(struct sqtransport *st);
+    // Number of bits on the wire needed to transmit the given bytes
+    uint32_t (*wire_bits)(struct sqtransport *st, uint32_t bytes);
+    void (*free)(struct sqtransport *st);
+};
+
+struct sqtransport {
+    const struct sqtransport_ops *ops;
+    int poll_fd, write_only;
+    // Bytes per transport frame (or 0 if the transport is a byte stream)
+    int frame_size;
+};
+
+struct sqtransport *sqtransport_alloc(int fd, char fd_type, int client_id);
+void sqtransport_free(struct sqtransport *st);
+
+#endif // sqtransport.h
@@ -27,6 +27,7 @@
 
 #define CHECK_LINES 1
 #define QUEUE_START_SIZE 1024
+#define MSG_ARENA_SIZE 1024
 
 struct stepcompress {
     // Buffer management
@@ -37,8 +38,10 @@ struct stepcompress {
     // Message generation
     uint64_t last_step_clock;
     struct list_head msg_queue;
+    struct message_arena *msg_arena;
     uint32_t oid;
     int32_t queue_step_msgtag, set_next_step_dir_msgtag;
+    int32_t queue_step_add2_msgtag;
     int sdir, invert_sdir;
     // Step+dir+step filter
     uint64_t next_step_clock;
@@ -46,19 +49,25 @@ struct stepcompress {
     // History tracking
     int64_t last_position;
     struct list_head history_list;
+    // Storage for min/max points during compression
+    struct points *points;
+    int points_size;
 };
 
 struct step_move {
     uint32_t interval;
     uint16_t count;
-    int16_t add;
+    int32_t add;
+    // A non-zero add2 indicates a queue_step_add2 sequence (where
+    // interval, add, and add2 are in units of 1/65536th of a tick)
+    int32_t add2;
 };
 
 struct history_steps {
     struct list_node node;
     uint64_t first_clock, last_clock;
     int64_t start_position;
-    int step_count, interval, add;
+    int step_count, interval, add, add2;
 };
 
 
@@ -101,6 +110,20 @@ minmax_point(struct stepcompress *sc, uint32_t *pos)
 // using 11 works well in practice.
 #define QUADRATIC_DEV 11
 
+// Make sure the points storage can hold 'count' entries
+static struct points *
+alloc_points(struct stepcompress *sc, int count)
+{
+    if (count > sc->points_size) {
+        int alloc = sc->points_size ? sc->points_size : QUEUE_START_SIZE;
+        while (count > alloc)
+            alloc *= 2;
+        sc->points = realloc(sc->points, alloc * sizeof(*sc->points));
+        sc->points_size = alloc;
+    }
+    return sc->points;
+}
+
 // Find a 'step_move' that covers a series of step times
 static struct step_move
 compress_bisect_add(struct stepcompress *sc)
@@ -108,7 +131,11 @@ compress_bisect_add(struct stepcompress *sc)
     uint32_t *qlast = sc->queue_next;
     if (qlast > sc->queue_pos + 65535)
         qlast = sc->queue_pos + 65535;
-    struct points point = minmax_point(sc, sc->queue_pos);
+    // The min/max range of each point is calculated once (as needed)
+    // and then reused for each 'add' tested below
+    struct points *points = alloc_points(sc, qlast - sc->queue_pos);
+    struct points point = points[0] = minmax_point(sc, sc->queue_pos);
+    int32_t valid_points = 1;
     int32_t outer_mininterval = point.minp, outer_maxinterval = point.maxp;
     int32_t add = 0, minadd = -0x8000, maxadd = 0x7fff;
     int32_t bestinterval = 0, bestcount = 1, bestadd = 1, bestreach = INT32_MIN;
@@ -126,7 +153,10 @@ compress_bisect_add(struct stepcompress *sc)
                 int32_t count = nextcount - 1;
                 return (struct step_move){ interval, count, add };
             }
-            nextpoint = minmax_point(sc, sc->queue_pos + nextcount - 1);
+            if (nextcount > valid_points)
+                points[valid_points++] = minmax_point(
+                    sc, sc->queue_pos + nextcount - 1);
+            nextpoint = points[nextcount - 1];
             int32_t nextaddfactor = nextcount*(nextcount-1)/2;
             int32_t c = add*nextaddfactor;
             if (nextmininterval*nextcount < nextpoint.minp - c)
@@ -197,6 +227,151 @@ compress_bisect_add(struct stepcompress *sc)
 }
 
 
+/****************************************************************
+ * Second order step compression
+ ****************************************************************/
+
+// The optional queue_step_add2 mcu command also adjusts 'add' after
+// each step (add += add2).  It uses fixed point values so that it
+// can follow the slowly changing step rate of long acceleration
+// ramps.  Step 'n' of such a sequence occurs at:
+//  (n*interval + add*n*(n-1)/2 + add2*n*(n-1)*(n-2)/6) >> ADD2_SHIFT
+// clock ticks after the last step.
+
+#define ADD2_SHIFT 16
+#define ADD2_MAX_INTERVAL 0x7fff0000
+#define ADD2_MIN_FIT 8
+
+// Return the number of leading queued step times (up to 'max_count')
+// that match a queue_step_add2 sequence
+static int
+check_add2(struct stepcompress *sc, struct step_move *move, int max_count)
+{
+    int64_t pos = 0, interval = move->interval, add = move->add;
+    int count;
+    for (count=0; count<max_count; count++) {
+        if (interval < 0 || interval >= ADD2_MAX_INTERVAL)
+            break;
+        pos += interval;
+        struct points point = minmax_point(sc, sc->queue_pos + count);
+        int64_t p = pos >> ADD2_SHIFT;
+        if (p < point.minp || p > point.maxp)
+            break;
+        interval += add;
+        add += move->add2;
+        if (add < INT32_MIN || add > INT32_MAX) {
+            count++;
+            break;
+        }
+    }
+    return count;
+}
+
+// Return the clock offset of the last step of a queue_step_add2 sequence
+static uint32_t
+add2_ticks(struct step_move *move, int count)
+{
+    int64_t pos = 0, interval = move->interval, add = move->add;
+    int i;
+    for (i=0; i<count; i++) {
+        pos += interval;
+        interval += add;
+        add += move->add2;
+    }
+    return pos >> ADD2_SHIFT;
+}
+
+// Return the number of steps of a queue_step_add2 sequence that occur
+// at or before the given clock offset
+static int
+add2_count(struct step_move *move, int64_t ticks)
+{
+    int64_t pos = 0, interval = move->interval, add = move->add;
+    int count = 0;
+    for (;;) {
+        pos += interval;
+        if (pos >> ADD2_SHIFT > ticks)
+            return count;
+        count++;
+        interval += add;
+        add += move->add2;
+    }
+}
+
+// Fit a queue_step_add2 sequence through the center of the valid
+// range of three step times in the first 'count' queued steps
+static int
+fit_add2(struct stepcompress *sc, int count, struct step_move *move)
+{
+    // Solve "n*i + a*n*(n-1)/2 + b*n*(n-1)*(n-2)/6 = y" for i, a, b
+    double m[3][4];
+    int r, c, k;
+    for (r=0; r<3; r++) {
+        int n = count * (r + 1) / 3;
+        struct points point = minmax_point(sc, sc->queue_pos + n - 1);
+        m[r][0] = n;
+        m[r][1] = .5 * n * (n - 1);
+        m[r][2] = m[r][1] * (n - 2) / 3.;
+        m[r][3] = .5 * (point.minp + point.maxp + 1);
+    }
+    for (c=0; c<3; c++) {
+        if (!m[c][c])
+            return -1;
+        for (r=0; r<3; r++) {
+            if (r == c)
+                continue;
+            double f = m[r][c] / m[c][c];
+            for (k=c; k<4; k++)
+                m[r][k] -= f * m[c][k];
+        }
+    }
+    double interval = m[0][3] / m[0][0] * (1 << ADD2_SHIFT);
+    double add = m[1][3] / m[1][1] * (1 << ADD2_SHIFT);
+    double add2 = m[2][3] / m[2][2] * (1 << ADD2_SHIFT);
+    if (!(interval >= 0. && interval < ADD2_MAX_INTERVAL
+          && fabs(add) < INT32_MAX && fabs(add2) < INT32_MAX))
+        return -1;
+    *move = (struct step_move){ llround(interval), count, llround(add)
+                                , llround(add2) };
+    return move->add2 ? 0 : -1;
+}
+
+// Look for a queue_step_add2 sequence that covers notably more steps
+// than the given queue_step sequence
+static struct step_move
+compress_add2(struct stepcompress *sc, struct step_move move)
+{
+    int avail = sc->queue_next - sc->queue_pos;
+    if (avail > 65535)
+        avail = 65535;
+    if (!sc->queue_step_add2_msgtag || move.count >= avail)
+        return move;
+    // Fit sequences to successively larger windows of the queue
+    struct step_move best = move;
+    int fit_count = 2 * move.count;
+    if (fit_count < ADD2_MIN_FIT)
+        fit_count = ADD2_MIN_FIT;
+    while (fit_count <= avail) {
+        struct step_move fit;
+        if (fit_add2(sc, fit_count, &fit))
+            break;
+        fit.count = check_add2(sc, &fit, avail);
+        if (fit.count > best.count)
+            best = fit;
+        if (fit.count < fit_count / 2 || fit_count >= avail)
+            break;
+        fit_count *= 2;
+        if (fit_count > avail)
+            fit_count = avail;
+    }
+    // The queue_step_add2 command is larger - only use it if it
+    // covers substantially more steps
+    if (best.add2 && best.count >= move.count + move.count / 2)
+        return best;
+    return move;
+}
+
+
 /****************************************************************
  * Step compress checking
  ****************************************************************/
@@ -207,6 +382,16 @@ check_line(struct stepcompress *sc, struct step_move move)
 {
     if (!CHECK_LINES)
         return 0;
+    if (move.add2) {
+        int count = check_add2(sc, &move, move.count);
+        if (count != move.count) {
+            errorf("stepcompress o=%d i=%d c=%d a=%d a2=%d: Point %d: invalid"
+                   , sc->oid, move.interval, move.count, move.add, move.add2
+                   , count + 1);
+            return ERROR_RET;
+        }
+        return 0;
+    }
     if (!move.count || (!move.interval && !move.add && move.count > 1)
         || move.interval >= 0x80000000) {
         errorf("stepcompress o=%d i=%d c=%d a=%d: Invalid sequence"
@@ -249,6 +434,7 @@ stepcompress_alloc(uint32_t oid)
     memset(sc, 0, sizeof(*sc));
     list_init(&sc->msg_queue);
     list_init(&sc->history_list);
+    sc->msg_arena = message_arena_alloc(MSG_ARENA_SIZE);
     sc->oid = oid;
     sc->sdir = -1;
     return sc;
@@ -264,6 +450,13 @@ stepcompress_fill(struct stepcompress *sc, uint32_t max_error
     sc->set_next_step_dir_msgtag = set_next_step_dir_msgtag;
 }
 
+// Enable use of the queue_step_add2 command
+void __visible
+stepcompress_set_add2_msgtag(struct stepcompress *sc, int32_t msgtag)
+{
+    sc->queue_step_add2_msgtag = msgtag;
+}
+
 // Set the inverted stepper direction flag
 void __visible
 stepcompress_set_invert_sdir(struct stepcompress *sc, uint32_t invert_sdir)
@@ -304,7 +497,9 @@ stepcompress_free(struct stepcompress *sc)
     if (!sc)
         return;
     free(sc->queue);
+    free(sc->points);
     message_queue_free(&sc->msg_queue);
+    message_arena_free(sc->msg_arena);
     free_history(sc, UINT64_MAX);
     free(sc);
 }
@@ -348,14 +543,27 @@ add_move(struct stepcompress *sc, uint64_t first_clock, struct step_move *move)
 {
     int32_t addfactor = move->count*(move->count-1)/2;
     uint32_t ticks = move->add*addfactor + move->interval*(move->count-1);
+    if (move->add2)
+        ticks = (add2_ticks(move, move->count)
+                 - (move->interval >> ADD2_SHIFT));
     uint64_t last_clock = first_clock + ticks;
 
     // Create and queue a queue_step command
-    uint32_t msg[5] = {
+    uint32_t msg[6] = {
         sc->queue_step_msgtag, sc->oid, move->interval, move->count, move->add
     };
-    struct queue_message *qm = message_alloc_and_encode(msg, 5);
+    int msg_len = 5;
+    if (move->add2) {
+        msg[0] = sc->queue_step_add2_msgtag;
+        msg[5] = move->add2;
+        msg_len = 6;
+    }
+    struct queue_message *qm = message_arena_encode(sc->msg_arena
+                                                    , msg, msg_len);
     qm->min_clock = qm->req_clock = sc->last_step_clock;
+    if (move->add2)
+        // The mcu stores the add2 parameters in a second move queue item
+        qm->extra_moves = 1;
     if (move->count == 1 && first_clock >= sc->last_step_clock + CLOCK_DIFF_MAX)
         qm->req_clock = first_clock;
     list_add_tail(&qm->node, &sc->msg_queue);
@@ -368,6 +576,7 @@ add_move(struct stepcompress *sc, uint64_t first_clock, struct step_move *move)
     hs->start_position = sc->last_position;
     hs->interval = move->interval;
     hs->add = move->add;
+    hs->add2 = move->add2;
     hs->step_count = sc->sdir ? move->count : -move->count;
     sc->last_position += hs->step_count;
     list_add_head(&hs->node, &sc->history_list);
@@ -380,12 +589,15 @@ queue_flush(struct stepcompress *sc, uint64_t move_clock)
     if (sc->queue_pos >= sc->queue_next)
         return 0;
     while (sc->last_step_clock < move_clock) {
-        struct step_move move = compress_bisect_add(sc);
+        struct step_move move = compress_add2(sc, compress_bisect_add(sc));
         int ret = check_line(sc, move);
         if (ret)
             return ret;
 
-        add_move(sc, sc->last_step_clock + move.interval, &move);
+        uint32_t first_ticks = move.interval;
+        if (move.add2)
+            first_ticks = move.interval >> ADD2_SHIFT;
+        add_move(sc, sc->last_step_clock + first_ticks, &move);
 
         if (sc->queue_pos + move.count >= sc->queue_next) {
             sc->queue_pos = sc->queue_next = sc->queue;
@@ -420,7 +632,7 @@ set_next_step_dir(struct stepcompress *sc, int sdir)
     uint32_t msg[3] = {
         sc->set_next_step_dir_msgtag, sc->oid, sdir ^ sc->invert_sdir
     };
-    struct queue_message *qm = message_alloc_and_encode(msg, 3);
+    struct queue_message *qm = message_arena_encode(sc->msg_arena, msg, 3);
     qm->req_clock = sc->last_step_clock;
     list_add_tail(&qm->node, &sc->msg_queue);
     return 0;
@@ -499,15 +711,10 @@ queue_append(struct stepcompress *sc)
 
 #define SDS_FILTER_TIME .000750
 
-// Add next step time
-int
-stepcompress_append(struct stepcompress *sc, int sdir
-                    , double print_time, double step_time)
+// Add next step clock
+static int
+append_clock(struct stepcompress *sc, int sdir, uint64_t step_clock)
 {
-    // Calculate step clock
-    double offset = print_time - sc->last_step_print_time;
-    double rel_sc = (step_time + offset) * sc->mcu_freq;
-    uint64_t step_clock = sc->last_step_clock + (uint64_t)rel_sc;
     // Flush previous pending step (if any)
     if (sc->next_step_clock) {
         if (unlikely(sdir != sc->next_step_dir)) {
@@ -529,6 +736,32 @@ stepcompress_append(struct stepcompress *sc, int sdir
     return 0;
 }
 
+// Add next step time
+int
+stepcompress_append(struct stepcompress *sc, int sdir
+                    , double print_time, double step_time)
+{
+    // Calculate step clock
+    double offset = print_time - sc->last_step_print_time;
+    double rel_sc = (step_time + offset) * sc->mcu_freq;
+    uint64_t step_clock = sc->last_step_clock + (uint64_t)rel_sc;
+    return append_clock(sc, sdir, step_clock);
+}
+
+// Add a series of step clocks (used to benchmark step compression)
+int __visible
+stepcompress_append_clocks(struct stepcompress *sc, int sdir
+                           , uint64_t *clocks, int count)
+{
+    int i;
+    for (i=0; i<count; i++) {
+        int ret = append_clock(sc, sdir, clocks[i]);
+        if (ret)
+            return ret;
+    }
+    return stepcompress_commit(sc);
+}
+
 // Commit next pending step (ie, do not allow a rollback)
 int
 stepcompress_commit(struct stepcompress *sc)
@@ -597,7 +830,11 @@ stepcompress_find_past_position(struct stepcompress *sc, uint64_t clock)
             return hs->start_position + hs->step_count;
         int32_t interval = hs->interval, add = hs->add;
         int32_t ticks = (int32_t)(clock - hs->first_clock) + interval, offset;
-        if (!add) {
+        if (hs->add2) {
+            struct step_move move = { interval, 0, add, hs->add2 };
+            offset = add2_count(&move, (int32_t)(clock - hs->first_clock)
+                                + (interval >> ADD2_SHIFT));
+        } else if (!add) {
             offset = ticks / interval;
         } else {
             // Solve for "count" using quadratic formula
@@ -619,7 +856,8 @@ stepcompress_queue_msg(struct stepcompress *sc, uint32_t *data, int len)
     if (ret)
         return ret;
 
-    struct queue_message *qm = message_alloc_and_encode(data, len);
+    struct queue_message *qm = message_arena_encode(sc->msg_arena
+                                                    , data, len);
     qm->req_clock = sc->last_step_clock;
     list_add_tail(&qm->node, &sc->msg_queue);
     return 0;
@@ -634,7 +872,8 @@ stepcompress_queue_mq_msg(struct stepcompress *sc, uint64_t req_clock
     if (ret)
         return ret;
 
-    struct queue_message *qm = message_alloc_and_encode(data, len);
+    struct queue_message *qm = message_arena_encode(sc->msg_arena
+                                                    , data, len);
     qm->min_clock = qm->req_clock = req_clock;
     list_add_tail(&qm->node, &sc->msg_queue);
     return 0;
@@ -658,6 +897,7 @@ stepcompress_extract_old(struct stepcompress *sc, struct pull_history_steps *p
         p->step_count = hs->step_count;
         p->interval = hs->interval;
         p->add = hs->add;
+        p->add2 = hs->add2;
         p++;
         res++;
     }
@@ -805,11 +1045,17 @@ steppersync_flush(struct steppersync *ss, uint64_t move_clock
             break;
 
         uint64_t next_avail = ss->move_clocks[0];
-        if (qm->min_clock)
+        if (qm->min_clock) {
             // The qm->min_clock field is overloaded to indicate that
             // the command uses the 'move queue' and to store the time
             // that move queue item becomes available.
             heap_replace(ss, qm->min_clock);
+            int j;
+            for (j=0; j<qm->extra_moves; j++) {
+                next_avail = ss->move_clocks[0];
+                heap_replace(ss, qm->min_clock);
+            }
+        }
         // Reset the min_clock to its normal meaning (minimum transmit time)
         qm->min_clock = next_avail;
 
@@ -0,0 +1,166 @@
+// Parallel step generation across multiple steppers
+//
+// Copyright (C) 2026  agent <agent@local>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// Each stepper's step generation (itersolve and stepcompress) only
+// reads from the shared trapq and only writes to its own
+// stepcompress object.  So, the steps for a flush window may be
+// generated for each stepper independently.  This code maintains a
+// pool of worker threads that are used to generate the steps for a
+// set of steppers in parallel.  The caller waits for all steppers to
+// complete prior to returning (and thus prior to any steppersync
+// flush).
+
+#include <pthread.h> // pthread_mutex_lock
+#include <stddef.h> // offsetof
+#include <stdlib.h> // malloc
+#include <string.h> // memset
+#include "compiler.h" // __visible
+#include "itersolve.h" // itersolve_generate_steps
+#include "pyhelper.h" // report_errno
+#include "trapq.h" // trapq_check_sentinels
+
+struct stepgen_pool {
+    int num_threads;
+    pthread_t *tids;
+    pthread_mutex_t lock; // protects variables below
+    pthread_cond_t cond, done_cond;
+    int must_exit;
+    // Current work request
+    uint32_t work_seq;
+    struct stepper_kinematics **sk_list;
+    int sk_num, sk_next, active_threads;
+    double flush_time;
+    int32_t result;
+};
+
+// Generate steps for steppers in the current request until none remain
+static void
+run_steppers(struct stepgen_pool *sp)
+{
+    for (;;) {
+        int idx = __atomic_fetch_add(&sp->sk_next, 1, __ATOMIC_RELAXED);
+        if (idx >= sp->sk_num)
+            return;
+        int32_t ret = itersolve_generate_steps(sp->sk_list[idx]
+                                               , sp->flush_time);
+        if (ret) {
+            pthread_mutex_lock(&sp->lock);
+            if (!sp->result)
+                sp->result = ret;
+            pthread_mutex_unlock(&sp->lock);
+        }
+    }
+}
+
+// Main code for each worker thread
+static void *
+stepgen_thread(void *data)
+{
+    struct stepgen_pool *sp = data;
+    uint32_t last_seq = 0;
+    pthread_mutex_lock(&sp->lock);
+    for (;;) {
+        while (!sp->must_exit && sp->work_seq == last_seq)
+            pthread_cond_wait(&sp->cond, &sp->lock);
+        if (sp->must_exit)
+            break;
+        last_seq = sp->work_seq;
+        pthread_mutex_unlock(&sp->lock);
+
+        run_steppers(sp);
+
+        pthread_mutex_lock(&sp->lock);
+        if (!--sp->active_threads)
+            pthread_cond_signal(&sp->done_cond);
+    }
+    pthread_mutex_unlock(&sp->lock);
+    return NULL;
+}
+
+// Create a pool using up to 'num_threads' (including the caller's thread)
+struct stepgen_pool * __visible
+stepgen_pool_alloc(int num_threads)
+{
+    struct stepgen_pool *sp = malloc(sizeof(*sp));
+    memset(sp, 0, sizeof(*sp));
+    pthread_mutex_init(&sp->lock, NULL);
+    pthread_cond_init(&sp->cond, NULL);
+    pthread_cond_init(&sp->done_cond, NULL);
+    if (num_threads < 1)
+        num_threads = 1;
+    sp->tids = malloc(sizeof(*sp->tids) * num_threads);
+    int i;
+    for (i=0; i<num_threads-1; i++) {
+        int ret = pthread_create(&sp->tids[i], NULL, stepgen_thread, sp);
+        if (ret) {
+            report_errno("stepgen pthread_create", ret);
+            break;
+        }
+    }
+    sp->num_threads = i;
+    return sp;
+}
+
+// Stop all worker threads and free memory
+void __visible
+stepgen_pool_free(struct stepgen_pool *sp)
+{
+    if (!sp)
+        return;
+    pthread_mutex_lock(&sp->lock);
+    sp->must_exit = 1;
+    pthread_cond_broadcast(&sp->cond);
+    pthread_mutex_unlock(&sp->lock);
+    int i;
+    for (i=0; i<sp->num_threads; i++)
+        pthread_join(sp->tids[i], NULL);
+    pthread_mutex_destroy(&sp->lock);
+    pthread_cond_destroy(&sp->cond);
+    pthread_cond_destroy(&sp->done_cond);
+    free(sp->tids);
+    free(sp);
+}
+
+// Generate step times for a list of steppers up to the given flush_time
+int32_t __visible
+stepgen_pool_generate_steps(struct stepgen_pool *sp
+                            , struct stepper_kinematics **sk_list, int sk_num
+                            , double flush_time)
+{
+    // Update the trapq sentinels prior to starting any threads so
+    // that the workers only ever read from the trapq
+    int i;
+    for (i=0; i<sk_num; i++)
+        if (sk_list[i]->tq)
+            trapq_check_sentinels(sk_list[i]->tq);
+    sp->sk_list = sk_list;
+    sp->sk_num = sk_num;
+    sp->sk_next = 0;
+    sp->flush_time = flush_time;
+    sp->result = 0;
+    if (!sp->num_threads || sk_num <= 1) {
+        // No benefit in waking other threads
+        run_steppers(sp);
+        return sp->result;
+    }
+
+    // Wake the worker threads and then process steppers locally
+    pthread_mutex_lock(&sp->lock);
+    sp->active_threads = sp->num_threads;
+    sp->work_seq++;
+    pthread_cond_broadcast(&sp->cond);
+    pthread_mutex_unlock(&sp->lock);
+
+    run_steppers(sp);
+
+    // Wait for all workers to complete
+    pthread_mutex_lock(&sp->lock);
+    while (sp->active_threads)
+        pthread_cond_wait(&sp->done_cond, &sp->lock);
+    int32_t result = sp->result;
+    pthread_mutex_unlock(&sp->lock);
+    return result;
+}
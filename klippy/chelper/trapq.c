@@ -6,25 +6,19 @@
 
 #include <math.h> // sqrt
 #include <stddef.h> // offsetof
+#include <stdio.h> // snprintf
 #include <stdlib.h> // malloc
 #include <string.h> // memset
 #include "compiler.h" // unlikely
 #include "trapq.h" // move_get_coord
 
-// Allocate a new 'move' object
-struct move *
-move_alloc(void)
-{
-    struct move *m = malloc(sizeof(*m));
-    memset(m, 0, sizeof(*m));
-    return m;
-}
 
 // Return the distance moved given a time in a move
 inline double
 move_get_distance(struct move *m, double move_time)
 {
-    return (m->start_v + m->half_accel * move_time) * move_time;
+    return (m->start_v + (m->half_accel + m->sixth_jerk * move_time)
+            * move_time) * move_time;
 }
 
 // Return the XYZ coordinates given a time in a move
@@ -38,8 +32,130 @@ move_get_coord(struct move *m, double move_time)
         .z = m->start_pos.z + m->axes_r.z * move_dist };
 }
 
+// Return 'base + scale * distance' for each of the given move times
+void
+move_get_position_batch(struct move *m, double base, double scale
+                        , double *move_times, double *positions, int count)
+{
+    double start_v = m->start_v, half_accel = m->half_accel;
+    double sixth_jerk = m->sixth_jerk;
+    int i;
+    for (i=0; i<count; i++) {
+        double t = move_times[i];
+        positions[i] = base + scale * ((start_v + (half_accel + sixth_jerk * t)
+                                        * t) * t);
+    }
+}
+
 #define NEVER_TIME 9999999999999999.9
 
+
+/****************************************************************
+ * Move allocation
+ ****************************************************************/
+
+// Moves are allocated in blocks and recycled via a per-trapq free
+// list, so that queuing and expiring moves does not call malloc()
+#define MOVE_SLAB_COUNT 256
+
+struct move_slab {
+    struct list_node node;
+    struct move moves[MOVE_SLAB_COUNT];
+};
+
+// Allocate a new 'move' object
+struct move *
+trapq_move_alloc(struct trapq *tq)
+{
+    if (unlikely(list_empty(&tq->free_moves))) {
+        struct move_slab *ms = malloc(sizeof(*ms));
+        list_add_tail(&ms->node, &tq->slabs);
+        int i;
+        for (i=0; i<MOVE_SLAB_COUNT; i++)
+            list_add_tail(&ms->moves[i].node, &tq->free_moves);
+        tq->slab_count++;
+        tq->free_count += MOVE_SLAB_COUNT;
+    }
+    struct move *m = list_first_entry(&tq->free_moves, struct move, node);
+    list_del(&m->node);
+    memset(m, 0, sizeof(*m));
+    tq->free_count--;
+    tq->alloc_count++;
+    return m;
+}
+
+// Return a 'move' object (that is not on any list) to the free list
+void
+trapq_move_free(struct trapq *tq, struct move *m)
+{
+    list_add_head(&m->node, &tq->free_moves);
+    tq->free_count++;
+}
+
+// Report the trapq move allocator statistics
+void __visible
+trapq_get_stats(struct trapq *tq, char *buf, int len)
+{
+    snprintf(buf, len, "move_count=%u move_allocs=%llu move_slabs=%u"
+             , tq->slab_count * MOVE_SLAB_COUNT - tq->free_count
+             , (unsigned long long)tq->alloc_count, tq->slab_count);
+}
+
+/****************************************************************
+ * Move history
+ ****************************************************************/
+
+// Completed moves are stored (oldest first) in a ring buffer so that
+// the history can be searched by print_time
+
+// Return the move at the given index of the history (zero is oldest)
+static inline struct move *
+history_get(struct trapq *tq, uint32_t idx)
+{
+    return tq->history[(tq->history_start + idx) & (tq->history_size - 1)];
+}
+
+// Add a move to the end of the history
+static void
+history_push(struct trapq *tq, struct move *m)
+{
+    if (tq->history_count >= tq->history_size) {
+        // Expand the ring buffer (keeping the size a power of two)
+        uint32_t new_size = tq->history_size ? 2 * tq->history_size : 256;
+        struct move **h = malloc(sizeof(*h) * new_size);
+        uint32_t i;
+        for (i=0; i<tq->history_count; i++)
+            h[i] = history_get(tq, i);
+        free(tq->history);
+        tq->history = h;
+        tq->history_size = new_size;
+        tq->history_start = 0;
+    }
+    tq->history[(tq->history_start + tq->history_count++)
+                & (tq->history_size - 1)] = m;
+}
+
+// Return the index of the first move in the history with a
+// print_time at or after the given time
+static uint32_t
+history_find(struct trapq *tq, double print_time)
+{
+    uint32_t low = 0, high = tq->history_count;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (history_get(tq, mid)->print_time < print_time)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+
+/****************************************************************
+ * Trapezoid velocity queue
+ ****************************************************************/
+
 // Allocate a new 'trapq' object
 struct trapq * __visible
 trapq_alloc(void)
@@ -47,8 +163,10 @@ trapq_alloc(void)
     struct trapq *tq = malloc(sizeof(*tq));
     memset(tq, 0, sizeof(*tq));
     list_init(&tq->moves);
-    list_init(&tq->history);
-    struct move *head_sentinel = move_alloc(), *tail_sentinel = move_alloc();
+    list_init(&tq->free_moves);
+    list_init(&tq->slabs);
+    struct move *head_sentinel = trapq_move_alloc(tq);
+    struct move *tail_sentinel = trapq_move_alloc(tq);
     tail_sentinel->print_time = tail_sentinel->move_t = NEVER_TIME;
     list_add_head(&head_sentinel->node, &tq->moves);
     list_add_tail(&tail_sentinel->node, &tq->moves);
@@ -59,16 +177,13 @@ trapq_alloc(void)
 void __visible
 trapq_free(struct trapq *tq)
 {
-    while (!list_empty(&tq->moves)) {
-        struct move *m = list_first_entry(&tq->moves, struct move, node);
-        list_del(&m->node);
-        free(m);
-    }
-    while (!list_empty(&tq->history)) {
-        struct move *m = list_first_entry(&tq->history, struct move, node);
-        list_del(&m->node);
-        free(m);
+    while (!list_empty(&tq->slabs)) {
+        struct move_slab *ms = list_first_entry(&tq->slabs, struct move_slab
+                                                , node);
+        list_del(&ms->node);
+        free(ms);
     }
+    free(tq->history);
     free(tq);
 }
 
@@ -101,7 +216,7 @@ trapq_add_move(struct trapq *tq, struct move *m)
     struct move *prev = list_prev_entry(tail_sentinel, node);
     if (prev->print_time + prev->move_t < m->print_time) {
         // Add a null move to fill time gap
-        struct move *null_move = move_alloc();
+        struct move *null_move = trapq_move_alloc(tq);
         null_move->start_pos = m->start_pos;
         if (!prev->print_time && m->print_time > MAX_NULL_MOVE)
             // Limit the first null move to improve numerical stability
@@ -126,7 +241,7 @@ trapq_append(struct trapq *tq, double print_time
     struct coord start_pos = { .x=start_pos_x, .y=start_pos_y, .z=start_pos_z };
     struct coord axes_r = { .x=axes_r_x, .y=axes_r_y, .z=axes_r_z };
     if (accel_t) {
-        struct move *m = move_alloc();
+        struct move *m = trapq_move_alloc(tq);
         m->print_time = print_time;
         m->move_t = accel_t;
         m->start_v = start_v;
@@ -139,7 +254,7 @@ trapq_append(struct trapq *tq, double print_time
         start_pos = move_get_coord(m, accel_t);
     }
     if (cruise_t) {
-        struct move *m = move_alloc();
+        struct move *m = trapq_move_alloc(tq);
         m->print_time = print_time;
         m->move_t = cruise_t;
         m->start_v = cruise_v;
@@ -152,7 +267,7 @@ trapq_append(struct trapq *tq, double print_time
         start_pos = move_get_coord(m, cruise_t);
     }
     if (decel_t) {
-        struct move *m = move_alloc();
+        struct move *m = trapq_move_alloc(tq);
         m->print_time = print_time;
         m->move_t = decel_t;
         m->start_v = cruise_v;
@@ -163,6 +278,127 @@ trapq_append(struct trapq *tq, double print_time
     }
 }
 
+// Add a jerk limited acceleration (or deceleration) phase of a move.
+// The acceleration is ramped at 'jerk' up to at most 'accel', held
+// (if the phase is long enough), and ramped back down to zero.  The
+// phase_t must be planned for these limits (see lookahead.c) so that
+// the phase reaches the intended velocity.
+static struct move *
+add_scurve_phase(struct trapq *tq, double print_time, double phase_t
+                 , struct coord start_pos, struct coord axes_r
+                 , double start_v, double accel, double jerk)
+{
+    double ramp_t = accel / jerk;
+    if (ramp_t > .5 * phase_t)
+        ramp_t = .5 * phase_t;
+    double const_t = phase_t - 2. * ramp_t;
+    double peak_accel = jerk * ramp_t;
+    double sixth_jerk = jerk / 6.;
+    double end_time = print_time + phase_t;
+    // Jerk ramp up
+    struct move *m = trapq_move_alloc(tq);
+    m->print_time = print_time;
+    m->move_t = ramp_t;
+    m->start_v = start_v;
+    m->sixth_jerk = sixth_jerk;
+    m->start_pos = start_pos;
+    m->axes_r = axes_r;
+    trapq_add_move(tq, m);
+    print_time += ramp_t;
+    start_v += .5 * peak_accel * ramp_t;
+    // Constant acceleration
+    if (const_t > 0.) {
+        struct move *pm = m;
+        m = trapq_move_alloc(tq);
+        m->print_time = print_time;
+        m->move_t = const_t;
+        m->start_v = start_v;
+        m->half_accel = .5 * peak_accel;
+        m->start_pos = move_get_coord(pm, pm->move_t);
+        m->axes_r = axes_r;
+        trapq_add_move(tq, m);
+        print_time += const_t;
+        start_v += peak_accel * const_t;
+    }
+    // Jerk ramp down
+    struct move *pm = m;
+    m = trapq_move_alloc(tq);
+    m->print_time = print_time;
+    m->move_t = end_time - print_time; // Avoid gap from rounding errors
+    m->start_v = start_v;
+    m->half_accel = .5 * peak_accel;
+    m->sixth_jerk = -sixth_jerk;
+    m->start_pos = move_get_coord(pm, pm->move_t);
+    m->axes_r = axes_r;
+    trapq_add_move(tq, m);
+    return m;
+}
+
+// Fill and add a move with jerk limited (S-curve) acceleration to the
+// trapezoid velocity queue.  The accel_t and decel_t phase times must
+// account for the jerk (see lookahead.c).
+void __visible
+trapq_append_scurve(struct trapq *tq, double print_time
+                    , double accel_t, double cruise_t, double decel_t
+                    , double start_pos_x, double start_pos_y
+                    , double start_pos_z, double axes_r_x, double axes_r_y
+                    , double axes_r_z, double start_v, double cruise_v
+                    , double accel, double jerk)
+{
+    if (!jerk || !accel) {
+        trapq_append(tq, print_time, accel_t, cruise_t, decel_t
+                     , start_pos_x, start_pos_y, start_pos_z
+                     , axes_r_x, axes_r_y, axes_r_z, start_v, cruise_v, accel);
+        return;
+    }
+    struct coord start_pos = { .x=start_pos_x, .y=start_pos_y, .z=start_pos_z };
+    struct coord axes_r = { .x=axes_r_x, .y=axes_r_y, .z=axes_r_z };
+    if (accel_t) {
+        struct move *m = add_scurve_phase(tq, print_time, accel_t, start_pos
+                                          , axes_r, start_v, accel, jerk);
+        print_time += accel_t;
+        start_pos = move_get_coord(m, m->move_t);
+    }
+    if (cruise_t) {
+        struct move *m = trapq_move_alloc(tq);
+        m->print_time = print_time;
+        m->move_t = cruise_t;
+        m->start_v = cruise_v;
+        m->half_accel = 0.;
+        m->start_pos = start_pos;
+        m->axes_r = axes_r;
+        trapq_add_move(tq, m);
+
+        print_time += cruise_t;
+        start_pos = move_get_coord(m, cruise_t);
+    }
+    if (decel_t)
+        add_scurve_phase(tq, print_time, decel_t, start_pos, axes_r
+                         , cruise_v, -accel, -jerk);
+}
+
+// Add a series of moves (possibly to several trapq objects) in one call
+void __visible
+trapq_append_batch(struct trapq_record *records, int count)
+{
+    int i;
+    for (i=0; i<count; i++) {
+        struct trapq_record *r = &records[i];
+        if (r->jerk) {
+            trapq_append_scurve(r->tq, r->print_time, r->accel_t, r->cruise_t
+                                , r->decel_t, r->start_pos[0], r->start_pos[1]
+                                , r->start_pos[2], r->axes_r[0], r->axes_r[1]
+                                , r->axes_r[2], r->start_v, r->cruise_v
+                                , r->accel, r->jerk);
+            continue;
+        }
+        trapq_append(r->tq, r->print_time, r->accel_t, r->cruise_t, r->decel_t
+                     , r->start_pos[0], r->start_pos[1], r->start_pos[2]
+                     , r->axes_r[0], r->axes_r[1], r->axes_r[2]
+                     , r->start_v, r->cruise_v, r->accel);
+    }
+}
+
 // Expire any moves older than `print_time` from the trapezoid velocity queue
 void __visible
 trapq_finalize_moves(struct trapq *tq, double print_time
@@ -180,21 +416,19 @@ trapq_finalize_moves(struct trapq *tq, double print_time
         if (m->print_time + m->move_t > print_time)
             break;
         list_del(&m->node);
-        if (m->start_v || m->half_accel)
-            list_add_head(&m->node, &tq->history);
+        if (m->start_v || m->half_accel || m->sixth_jerk)
+            history_push(tq, m);
         else
-            free(m);
+            trapq_move_free(tq, m);
     }
-    // Free old moves from history list
-    if (list_empty(&tq->history))
-        return;
-    struct move *latest = list_first_entry(&tq->history, struct move, node);
-    for (;;) {
-        struct move *m = list_last_entry(&tq->history, struct move, node);
-        if (m == latest || m->print_time + m->move_t > clear_history_time)
+    // Free old moves from history (always retaining the latest move)
+    while (tq->history_count > 1) {
+        struct move *m = history_get(tq, 0);
+        if (m->print_time + m->move_t > clear_history_time)
             break;
-        list_del(&m->node);
-        free(m);
+        tq->history_start = (tq->history_start + 1) & (tq->history_size - 1);
+        tq->history_count--;
+        trapq_move_free(tq, m);
     }
 }
 
@@ -207,24 +441,24 @@ trapq_set_position(struct trapq *tq, double print_time
     trapq_finalize_moves(tq, NEVER_TIME, 0);
 
     // Prune any moves in the trapq history that were interrupted
-    while (!list_empty(&tq->history)) {
-        struct move *m = list_first_entry(&tq->history, struct move, node);
+    while (tq->history_count) {
+        struct move *m = history_get(tq, tq->history_count - 1);
         if (m->print_time < print_time) {
             if (m->print_time + m->move_t > print_time)
                 m->move_t = print_time - m->print_time;
             break;
         }
-        list_del(&m->node);
-        free(m);
+        tq->history_count--;
+        trapq_move_free(tq, m);
     }
 
     // Add a marker to the trapq history
-    struct move *m = move_alloc();
+    struct move *m = trapq_move_alloc(tq);
     m->print_time = print_time;
     m->start_pos.x = pos_x;
     m->start_pos.y = pos_y;
     m->start_pos.z = pos_z;
-    list_add_head(&m->node, &tq->history);
+    history_push(tq, m);
 }
 
 // Return history of movement queue
@@ -232,17 +466,19 @@ int __visible
 trapq_extract_old(struct trapq *tq, struct pull_move *p, int max
                   , double start_time, double end_time)
 {
+    // Report moves from newest to oldest, starting with the last move
+    // that begins prior to end_time
     int res = 0;
-    struct move *m;
-    list_for_each_entry(m, &tq->history, node) {
+    uint32_t idx = history_find(tq, end_time);
+    while (idx--) {
+        struct move *m = history_get(tq, idx);
         if (start_time >= m->print_time + m->move_t || res >= max)
             break;
-        if (end_time <= m->print_time)
-            continue;
         p->print_time = m->print_time;
         p->move_t = m->move_t;
         p->start_v = m->start_v;
         p->accel = 2. * m->half_accel;
+        p->jerk = 6. * m->sixth_jerk;
         p->start_x = m->start_pos.x;
         p->start_y = m->start_pos.y;
         p->start_z = m->start_pos.z;
@@ -1,6 +1,7 @@
 #ifndef TRAPQ_H
 #define TRAPQ_H
 
+#include <stdint.h> // uint64_t
 #include "list.h" // list_node
 
 struct coord {
@@ -14,26 +15,46 @@ struct coord {
 
 struct move {
     double print_time, move_t;
-    double start_v, half_accel;
+    double start_v, half_accel, sixth_jerk;
     struct coord start_pos, axes_r;
 
     struct list_node node;
 };
 
 struct trapq {
-    struct list_head moves, history;
+    struct list_head moves;
+    // Ring buffer of completed moves
+    struct move **history;
+    uint32_t history_size, history_start, history_count;
+    // Move allocator
+    struct list_head free_moves, slabs;
+    uint64_t alloc_count;
+    uint32_t slab_count, free_count;
+};
+
+// Packed move record used with trapq_append_batch()
+struct trapq_record {
+    struct trapq *tq;
+    double print_time, accel_t, cruise_t, decel_t;
+    double start_pos[3], axes_r[3];
+    double start_v, cruise_v, accel, jerk;
 };
 
 struct pull_move {
     double print_time, move_t;
-    double start_v, accel;
+    double start_v, accel, jerk;
     double start_x, start_y, start_z;
     double x_r, y_r, z_r;
 };
 
-struct move *move_alloc(void);
 double move_get_distance(struct move *m, double move_time);
 struct coord move_get_coord(struct move *m, double move_time);
+void move_get_position_batch(struct move *m, double base, double scale
+                             , double *move_times, double *positions
+                             , int count);
+struct move *trapq_move_alloc(struct trapq *tq);
+void trapq_move_free(struct trapq *tq, struct move *m);
+void trapq_get_stats(struct trapq *tq, char *buf, int len);
 struct trapq *trapq_alloc(void);
 void trapq_free(struct trapq *tq);
 void trapq_check_sentinels(struct trapq *tq);
@@ -43,6 +64,13 @@ void trapq_append(struct trapq *tq, double print_time
                   , double start_pos_x, double start_pos_y, double start_pos_z
                   , double axes_r_x, double axes_r_y, double axes_r_z
                   , double start_v, double cruise_v, double accel);
+void trapq_append_scurve(struct trapq *tq, double print_time
+                         , double accel_t, double cruise_t, double decel_t
+                         , double start_pos_x, double start_pos_y
+                         , double start_pos_z, double axes_r_x
+                         , double axes_r_y, double axes_r_z, double start_v
+                         , double cruise_v, double accel, double jerk);
+void trapq_append_batch(struct trapq_record *records, int count);
 void trapq_finalize_moves(struct trapq *tq, double print_time
                           , double clear_history_time);
 void trapq_set_position(struct trapq *tq, double print_time
@@ -187,7 +187,6 @@ def read_axes_map(config):
 MIN_MSG_TIME = 0.100
 
 BYTES_PER_SAMPLE = 5
-SAMPLES_PER_BLOCK = 10
 
 BATCH_UPDATES = 0.100
 
@@ -217,6 +216,7 @@ class ADXL345:
         self.clock_sync = bulk_sensor.ClockSyncRegression(mcu, chip_smooth)
         self.clock_updater = bulk_sensor.ChipClockUpdater(self.clock_sync,
                                                           BYTES_PER_SAMPLE)
+        self.decoder = bulk_sensor.AccelDecoder(self.axes_map, 'a')
         self.last_error_count = 0
         # Process messages in batches
         self.batch_bulk = bulk_sensor.BatchBulkHelper(
@@ -238,6 +238,13 @@ class ADXL345:
             "query_adxl345_status oid=%c",
             "adxl345_status oid=%c clock=%u query_ticks=%u next_sequence=%hu"
             " buffered=%c fifo=%c limit_count=%hu", oid=self.oid, cq=cmdqueue)
+        # Use compressed data reports if the mcu supports them
+        if self.mcu.try_lookup_command(
+                "config_adxl345_compress oid=%c") is not None:
+            self.mcu.add_config_cmd("config_adxl345_compress oid=%d"
+                                    % (self.oid,))
+            self.clock_updater.set_compressed()
+            self.decoder.set_compressed()
     def read_reg(self, reg):
         params = self.spi.spi_transfer([reg | REG_MOD_READ, 0x00])
         response = bytearray(params['response'])
@@ -257,38 +264,9 @@ class ADXL345:
         return aqh
     # Measurement decoding
     def _extract_samples(self, raw_samples):
-        # Load variables to optimize inner loop below
-        (x_pos, x_scale), (y_pos, y_scale), (z_pos, z_scale) = self.axes_map
-        last_sequence = self.clock_updater.get_last_sequence()
-        time_base, chip_base, inv_freq = self.clock_sync.get_time_translation()
-        # Process every message in raw_samples
-        count = seq = 0
-        samples = [None] * (len(raw_samples) * SAMPLES_PER_BLOCK)
-        for params in raw_samples:
-            seq_diff = (params['sequence'] - last_sequence) & 0xffff
-            seq_diff -= (seq_diff & 0x8000) << 1
-            seq = last_sequence + seq_diff
-            d = bytearray(params['data'])
-            msg_cdiff = seq * SAMPLES_PER_BLOCK - chip_base
-            for i in range(len(d) // BYTES_PER_SAMPLE):
-                d_xyz = d[i*BYTES_PER_SAMPLE:(i+1)*BYTES_PER_SAMPLE]
-                xlow, ylow, zlow, xzhigh, yzhigh = d_xyz
-                if yzhigh & 0x80:
-                    self.last_error_count += 1
-                    continue
-                rx = (xlow | ((xzhigh & 0x1f) << 8)) - ((xzhigh & 0x10) << 9)
-                ry = (ylow | ((yzhigh & 0x1f) << 8)) - ((yzhigh & 0x10) << 9)
-                rz = ((zlow | ((xzhigh & 0xe0) << 3) | ((yzhigh & 0xe0) << 6))
-                      - ((yzhigh & 0x40) << 7))
-                raw_xyz = (rx, ry, rz)
-                x = round(raw_xyz[x_pos] * x_scale, 6)
-                y = round(raw_xyz[y_pos] * y_scale, 6)
-                z = round(raw_xyz[z_pos] * z_scale, 6)
-                ptime = round(time_base + (msg_cdiff + i) * inv_freq, 6)
-                samples[count] = (ptime, x, y, z)
-                count += 1
-        self.clock_sync.set_last_chip_clock(seq * SAMPLES_PER_BLOCK + i)
-        del samples[count:]
+        samples, error_count = self.decoder.extract_samples(
+            raw_samples, self.clock_updater)
+        self.last_error_count += error_count
         return samples
     def _update_clock(self, minclock=0):
         # Query current state
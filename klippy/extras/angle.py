@@ -4,6 +4,7 @@
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import logging, math
+import chelper
 from . import bus, bulk_sensor
 
 MIN_MSG_TIME = 0.100
@@ -411,7 +412,6 @@ class HelperTLE5012B:
                        parser=lambda x: int(x, 0))
         self._write_reg(reg, val)
 
-BYTES_PER_SAMPLE = 3
 SAMPLES_PER_BLOCK = 16
 
 SAMPLE_PERIOD = 0.000400
@@ -425,7 +425,11 @@ class Angle:
         self.calibration = AngleCalibration(config)
         # Measurement conversion
         self.start_clock = self.time_shift = self.sample_ticks = 0
-        self.last_sequence = self.last_angle = 0
+        self.last_sequence = 0
+        ffi_main, ffi_lib = chelper.get_ffi()
+        self.ffi_main = ffi_main
+        self.angle_decode_block = ffi_lib.angle_decode_block
+        self.decode = ffi_main.new("struct angle_decode *")
         # Sensor type
         sensors = { "a1333": HelperA1333, "as5047d": HelperAS5047D,
                     "tle5012b": HelperTLE5012B }
@@ -471,60 +475,53 @@ class Angle:
         self.batch_bulk.add_client(client_cb)
     # Measurement decoding
     def _extract_samples(self, raw_samples):
-        # Load variables to optimize inner loop below
-        sample_ticks = self.sample_ticks
-        start_clock = self.start_clock
-        clock_to_print_time = self.mcu.clock_to_print_time
-        last_sequence = self.last_sequence
-        last_angle = self.last_angle
-        time_shift = 0
-        static_delay = 0.
-        last_chip_mcu_clock = last_chip_clock = chip_freq = inv_chip_freq = 0.
-        is_tcode_absolute = self.sensor_helper.is_tcode_absolute
-        if is_tcode_absolute:
+        # Setup parameters for the C helper code
+        decode = self.decode
+        sample_ticks = decode.sample_ticks = self.sample_ticks
+        decode.is_tcode_absolute = self.sensor_helper.is_tcode_absolute
+        if decode.is_tcode_absolute:
             tparams = self.sensor_helper.get_tcode_params()
-            last_chip_mcu_clock, last_chip_clock, chip_freq = tparams
-            inv_chip_freq = 1. / chip_freq
+            (decode.last_chip_mcu_clock, decode.last_chip_clock,
+             decode.chip_freq) = tparams
+            decode.time_shift = 0
+            decode.static_delay = 0.
         else:
-            time_shift = self.time_shift
-            static_delay = self.sensor_helper.get_static_delay()
+            decode.time_shift = self.time_shift
+            decode.static_delay = self.sensor_helper.get_static_delay()
+        decode.error_count = 0
+        # Translate mcu clocks to print time near the start of this batch
+        start_clock = self.start_clock
+        last_sequence = self.last_sequence
+        samp_count = last_sequence * SAMPLES_PER_BLOCK
+        clock_base = start_clock + samp_count * sample_ticks
+        clock_to_print_time = self.mcu.clock_to_print_time
+        freq = self.mcu.seconds_to_clock(1.)
+        decode.clock_base = clock_base
+        decode.time_base = time_base = clock_to_print_time(clock_base)
+        decode.inv_freq = (clock_to_print_time(clock_base + freq)
+                           - time_base) / freq
         # Process every message in raw_samples
-        count = error_count = 0
-        samples = [None] * (len(raw_samples) * SAMPLES_PER_BLOCK)
+        max_samples = len(raw_samples) * SAMPLES_PER_BLOCK
+        times = self.ffi_main.new("double[]", max_samples)
+        angles = self.ffi_main.new("int64_t[]", max_samples)
+        count = 0
         for params in raw_samples:
             seq_diff = (params['sequence'] - last_sequence) & 0xffff
             last_sequence += seq_diff
             samp_count = last_sequence * SAMPLES_PER_BLOCK
             msg_mclock = start_clock + samp_count*sample_ticks
-            d = bytearray(params['data'])
-            for i in range(len(d) // BYTES_PER_SAMPLE):
-                d_ta = d[i*BYTES_PER_SAMPLE:(i+1)*BYTES_PER_SAMPLE]
-                tcode = d_ta[0]
-                if tcode == TCODE_ERROR:
-                    error_count += 1
-                    continue
-                raw_angle = d_ta[1] | (d_ta[2] << 8)
-                angle_diff = (raw_angle - last_angle) & 0xffff
-                angle_diff -= (angle_diff & 0x8000) << 1
-                last_angle += angle_diff
-                mclock = msg_mclock + i*sample_ticks
-                if is_tcode_absolute:
-                    # tcode is tle5012b frame counter
-                    mdiff = mclock - last_chip_mcu_clock
-                    chip_mclock = last_chip_clock + int(mdiff * chip_freq + .5)
-                    cdiff = ((tcode << 10) - chip_mclock) & 0xffff
-                    cdiff -= (cdiff & 0x8000) << 1
-                    sclock = mclock + (cdiff - 0x800) * inv_chip_freq
-                else:
-                    # tcode is mcu clock offset shifted by time_shift
-                    sclock = mclock + (tcode<<time_shift)
-                ptime = round(clock_to_print_time(sclock) - static_delay, 6)
-                samples[count] = (ptime, last_angle)
-                count += 1
+            data = params['data']
+            ret = self.angle_decode_block(decode, msg_mclock, data, len(data),
+                                          times + count, angles + count,
+                                          max_samples - count)
+            if ret < 0:
+                raise self.printer.command_error(
+                    "Internal error decoding angle data")
+            count += ret
         self.last_sequence = last_sequence
-        self.last_angle = last_angle
-        del samples[count:]
-        return samples, error_count
+        samples = list(zip(self.ffi_main.unpack(times, count),
+                           self.ffi_main.unpack(angles, count)))
+        return samples, decode.error_count
     # Start, stop, and process message batches
     def _is_measuring(self):
         return self.start_clock != 0
@@ -4,6 +4,7 @@
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import logging, threading
+import chelper
 
 # This "bulk sensor" module facilitates the processing of sensor chip
 # measurements that do not require the host to respond with low
@@ -131,7 +132,6 @@ class BulkDataQueue:
     def clear_samples(self):
         self.pull_samples()
 
-
 ######################################################################
 # Clock synchronization
 ######################################################################
@@ -209,6 +209,12 @@ class ChipClockUpdater:
         self.mcu = clock_sync.mcu
         self.last_sequence = self.max_query_duration = 0
         self.last_limit_count = 0
+    def set_compressed(self):
+        # In compressed mode the mcu reports sequence and buffered
+        # as a count of samples
+        self.bytes_per_sample = self.samples_per_block = 1
+    def get_samples_per_block(self):
+        return self.samples_per_block
     def get_last_sequence(self):
         return self.last_sequence
     def get_last_limit_count(self):
@@ -245,3 +251,54 @@ class ChipClockUpdater:
         # of hardware processing time.
         chip_clock = msg_count + 1
         self.clock_sync.update(mcu_clock + duration // 2, chip_clock)
+
+
+######################################################################
+# Sample decoding
+######################################################################
+
+# Helper to convert accelerometer messages into (time, x, y, z)
+# samples.  The raw data is decoded by the C helper code (see
+# chelper/bulk_sensor.c).
+class AccelDecoder:
+    def __init__(self, axes_map, data_format):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        self.ffi_main = ffi_main
+        self.accel_decode_block = ffi_lib.accel_decode_block
+        self.decode = ffi_main.new("struct accel_decode *")
+        self.decode.format = ord(data_format)
+        for i, (pos, scale) in enumerate(axes_map):
+            self.decode.axes_pos[i] = pos
+            self.decode.axes_scale[i] = scale
+    def set_compressed(self):
+        # Messages use the mcu src/sensor_bulk.c compressed format
+        self.decode.format = ord('c')
+    def extract_samples(self, raw_samples, clock_updater):
+        clock_sync = clock_updater.clock_sync
+        last_sequence = clock_updater.get_last_sequence()
+        samples_per_block = clock_updater.get_samples_per_block()
+        decode = self.decode
+        tt = clock_sync.get_time_translation()
+        decode.time_base, decode.chip_base, decode.inv_freq = tt
+        decode.error_count = decode.last_index = 0
+        # Each sample uses at least one byte of message data
+        max_samples = sum([len(params['data']) for params in raw_samples])
+        out = self.ffi_main.new("double[]", max_samples * 4)
+        count = seq = 0
+        for params in raw_samples:
+            seq_diff = (params['sequence'] - last_sequence) & 0xffff
+            seq_diff -= (seq_diff & 0x8000) << 1
+            seq = last_sequence + seq_diff
+            data = params['data']
+            ret = self.accel_decode_block(decode, seq * samples_per_block,
+                                          data, len(data), out + count * 4,
+                                          max_samples - count)
+            if ret < 0:
+                raise clock_updater.mcu.get_printer().command_error(
+                    "Internal error decoding sensor data")
+            count += ret
+        clock_sync.set_last_chip_clock(seq * samples_per_block
+                                       + decode.last_index)
+        v = self.ffi_main.unpack(out, count * 4)
+        samples = list(zip(v[0::4], v[1::4], v[2::4], v[3::4]))
+        return samples, decode.error_count
@@ -42,7 +42,7 @@ class MCU_buttons:
             self.mcu.add_config_cmd(
                 "buttons_add oid=%d pos=%d pin=%s pull_up=%d" % (
                     self.oid, i, pin, pull_up), is_init=True)
-        cmd_queue = self.mcu.alloc_command_queue()
+        cmd_queue = self.mcu.alloc_command_queue('sensor')
         self.ack_cmd = self.mcu.lookup_command(
             "buttons_ack oid=%c count=%c", cq=cmd_queue)
         clock = self.mcu.get_query_slot(self.oid)
@@ -55,7 +55,7 @@ class HD44780:
                 self.oid, self.pins[0], self.pins[1],
                 self.pins[2], self.pins[3], self.pins[4], self.pins[5],
                 self.mcu.seconds_to_clock(HD44780_DELAY)))
-        cmd_queue = self.mcu.alloc_command_queue()
+        cmd_queue = self.mcu.alloc_command_queue('cosmetic')
         self.send_cmds_cmd = self.mcu.lookup_command(
             "hd44780_send_cmds oid=%c cmds=%*s", cq=cmd_queue)
         self.send_data_cmd = self.mcu.lookup_command(
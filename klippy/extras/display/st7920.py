@@ -166,7 +166,7 @@ class ST7920(DisplayBase):
                 self.oid, self.pins[0], self.pins[1], self.pins[2],
                 self.mcu.seconds_to_clock(ST7920_SYNC_DELAY),
                 self.mcu.seconds_to_clock(ST7920_CMD_DELAY)))
-        cmd_queue = self.mcu.alloc_command_queue()
+        cmd_queue = self.mcu.alloc_command_queue('cosmetic')
         self.send_cmds_cmd = self.mcu.lookup_command(
             "st7920_send_cmds oid=%c cmds=%*s", cq=cmd_queue)
         self.send_data_cmd = self.mcu.lookup_command(
@@ -5,6 +5,14 @@
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import logging
 
+# Position and bit of the X, Y, Z, E, and F values in 'struct gcode_params'
+def _param_index(letter):
+    index = ord(letter) - ord('A')
+    return index, 1 << index
+PARAM_AXES = [(pos,) + _param_index(axis) for pos, axis in enumerate('XYZ')]
+PARAM_E, PARAM_E_BIT = _param_index('E')
+PARAM_F, PARAM_F_BIT = _param_index('F')
+
 class GCodeMove:
     def __init__(self, config):
         self.printer = printer = config.get_printer()
@@ -33,6 +41,8 @@ class GCodeMove:
             desc = getattr(self, 'cmd_' + cmd + '_help', None)
             gcode.register_command(cmd, func, False, desc)
         gcode.register_command('G0', self.cmd_G1)
+        gcode.register_fast_command('G0', self.cmd_G1, self.fast_G1)
+        gcode.register_fast_command('G1', self.cmd_G1, self.fast_G1)
         gcode.register_command('M114', self.cmd_M114, True)
         gcode.register_command('GET_POSITION', self.cmd_GET_POSITION, True,
                                desc=self.cmd_GET_POSITION_help)
@@ -141,6 +151,29 @@ class GCodeMove:
             raise gcmd.error("Unable to parse move '%s'"
                              % (gcmd.get_commandline(),))
         self.move_with_transform(self.last_position, self.speed)
+    def fast_G1(self, params):
+        # Move using the parameters decoded by gcode_parse_line()
+        mask, values = params.mask, params.values
+        if mask & PARAM_F_BIT and values[PARAM_F] <= 0.:
+            # Report the error from cmd_G1()
+            return False
+        for pos, index, bit in PARAM_AXES:
+            if mask & bit:
+                if not self.absolute_coord:
+                    self.last_position[pos] += values[index]
+                else:
+                    self.last_position[pos] = (values[index]
+                                               + self.base_position[pos])
+        if mask & PARAM_E_BIT:
+            v = values[PARAM_E] * self.extrude_factor
+            if not self.absolute_coord or not self.absolute_extrude:
+                self.last_position[3] += v
+            else:
+                self.last_position[3] = v + self.base_position[3]
+        if mask & PARAM_F_BIT:
+            self.speed = values[PARAM_F] * self.speed_factor
+        self.move_with_transform(self.last_position, self.speed)
+        return True
     # G-Code coordinate manipulation
     def cmd_G20(self, gcmd):
         # Set units to inches
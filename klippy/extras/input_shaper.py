@@ -1,4 +1,4 @@
-# Kinematic input shaper to minimize motion vibrations in XY plane
+# Kinematic input shaper to minimize motion vibrations
 #
 # Copyright (C) 2019-2020  Kevin O'Connor <kevin@koconnor.net>
 # Copyright (C) 2020  Dmitry Butyugin <dmbutyugin@google.com>
@@ -6,17 +6,31 @@
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import collections
 import chelper
+from kinematics import extruder
 from . import shaper_defs
 
 class InputShaperParams:
     def __init__(self, axis, config):
         self.axis = axis
         self.shapers = {s.name : s.init_func for s in shaper_defs.INPUT_SHAPERS}
-        shaper_type = config.get('shaper_type', 'mzv')
+        # The common shaper_type only applies to the X and Y axes
+        self.use_common_type = axis in 'xy'
+        shaper_type = 'mzv'
+        if self.use_common_type:
+            shaper_type = config.get('shaper_type', shaper_type)
         self.shaper_type = config.get('shaper_type_' + axis, shaper_type)
-        if self.shaper_type not in self.shapers:
+        if (self.shaper_type not in self.shapers
+                and self.shaper_type != 'custom'):
             raise config.error(
                     'Unsupported shaper type: %s' % (self.shaper_type,))
+        self.shaper_a = config.getfloatlist('shaper_a_' + axis, None)
+        self.shaper_t = config.getfloatlist('shaper_t_' + axis, None)
+        if self.shaper_type == 'custom':
+            msg = shaper_defs.check_custom_shaper(self.shaper_a or [],
+                                                  self.shaper_t or [])
+            if msg is not None:
+                raise config.error("Invalid custom shaper for axis %s: %s"
+                                   % (axis, msg))
         self.damping_ratio = config.getfloat('damping_ratio_' + axis,
                                              shaper_defs.DEFAULT_DAMPING_RATIO,
                                              minval=0., maxval=1.)
@@ -28,20 +42,47 @@ class InputShaperParams:
                                             minval=0., maxval=1.)
         self.shaper_freq = gcmd.get_float('SHAPER_FREQ_' + axis,
                                           self.shaper_freq, minval=0.)
-        shaper_type = gcmd.get('SHAPER_TYPE', None)
+        shaper_type = None
+        if self.use_common_type:
+            shaper_type = gcmd.get('SHAPER_TYPE', None)
         if shaper_type is None:
             shaper_type = gcmd.get('SHAPER_TYPE_' + axis, self.shaper_type)
-        if shaper_type.lower() not in self.shapers:
+        shaper_type = shaper_type.lower()
+        if shaper_type not in self.shapers and shaper_type != 'custom':
             raise gcmd.error('Unsupported shaper type: %s' % (shaper_type,))
-        self.shaper_type = shaper_type.lower()
+        shaper_a = self._get_pulses(gcmd, 'SHAPER_A_' + axis, self.shaper_a)
+        shaper_t = self._get_pulses(gcmd, 'SHAPER_T_' + axis, self.shaper_t)
+        if shaper_type == 'custom':
+            msg = shaper_defs.check_custom_shaper(shaper_a or [],
+                                                  shaper_t or [])
+            if msg is not None:
+                raise gcmd.error("Invalid custom shaper for axis %s: %s"
+                                 % (axis, msg))
+        self.shaper_type = shaper_type
+        self.shaper_a, self.shaper_t = shaper_a, shaper_t
+    def _get_pulses(self, gcmd, name, default):
+        value = gcmd.get(name, None)
+        if value is None:
+            return default
+        try:
+            return [float(v.strip()) for v in value.split(',') if v.strip()]
+        except ValueError:
+            raise gcmd.error("Unable to parse '%s' in '%s'" % (name, value))
     def get_shaper(self):
-        if not self.shaper_freq:
+        if self.shaper_type == 'custom':
+            A, T = list(self.shaper_a), list(self.shaper_t)
+        elif not self.shaper_freq:
             A, T = shaper_defs.get_none_shaper()
         else:
             A, T = self.shapers[self.shaper_type](
                     self.shaper_freq, self.damping_ratio)
         return len(A), A, T
     def get_status(self):
+        if self.shaper_type == 'custom':
+            return collections.OrderedDict([
+                ('shaper_type', self.shaper_type),
+                ('shaper_a', ','.join(['%.6f' % (a,) for a in self.shaper_a])),
+                ('shaper_t', ','.join(['%.6f' % (t,) for t in self.shaper_t]))])
         return collections.OrderedDict([
             ('shaper_type', self.shaper_type),
             ('shaper_freq', '%.3f' % (self.shaper_freq,)),
@@ -70,6 +111,12 @@ class AxisInputShaper:
             ffi_lib.input_shaper_set_shaper_params(
                     sk, self.axis.encode(), self.n, self.A, self.T)
         return success
+    def set_extruder_shaper(self, extruder_stepper):
+        success = extruder_stepper.set_input_shaper(self.n, self.A, self.T)
+        if not success:
+            self.disable_shaping()
+            extruder_stepper.set_input_shaper(self.n, self.A, self.T)
+        return success
     def disable_shaping(self):
         if self.saved is None and self.n:
             self.saved = (self.n, self.A, self.T)
@@ -92,7 +139,9 @@ class InputShaper:
         self.printer.register_event_handler("klippy:connect", self.connect)
         self.toolhead = None
         self.shapers = [AxisInputShaper('x', config),
-                        AxisInputShaper('y', config)]
+                        AxisInputShaper('y', config),
+                        AxisInputShaper('z', config)]
+        self.extruder_shaper = AxisInputShaper('e', config)
         self.input_shaper_stepper_kinematics = []
         self.orig_stepper_kinematics = []
         # Register gcode commands
@@ -101,7 +150,7 @@ class InputShaper:
                                self.cmd_SET_INPUT_SHAPER,
                                desc=self.cmd_SET_INPUT_SHAPER_help)
     def get_shapers(self):
-        return self.shapers
+        return self.shapers + [self.extruder_shaper]
     def connect(self):
         self.toolhead = self.printer.lookup_object("toolhead")
         # Configure initial values
@@ -124,6 +173,13 @@ class InputShaper:
             return None
         self.input_shaper_stepper_kinematics.append(is_sk)
         return is_sk
+    def _get_extruder_steppers(self):
+        extruder_steppers = []
+        for name, obj in self.printer.lookup_objects():
+            es = getattr(obj, 'extruder_stepper', None)
+            if isinstance(es, extruder.ExtruderStepper):
+                extruder_steppers.append(es)
+        return extruder_steppers
     def _update_input_shaping(self, error=None):
         self.toolhead.flush_step_generation()
         ffi_main, ffi_lib = chelper.get_ffi()
@@ -145,25 +201,32 @@ class InputShaper:
             if old_delay != new_delay:
                 self.toolhead.note_step_generation_scan_time(new_delay,
                                                              old_delay)
+        # Extruder steppers track their own step generation window
+        # (which also covers the pressure advance smoothing)
+        for es in self._get_extruder_steppers():
+            if self.extruder_shaper in failed_shapers:
+                break
+            if not self.extruder_shaper.set_extruder_shaper(es):
+                failed_shapers.append(self.extruder_shaper)
         if failed_shapers:
             error = error or self.printer.command_error
             raise error("Failed to configure shaper(s) %s with given parameters"
                         % (', '.join([s.get_name() for s in failed_shapers])))
     def disable_shaping(self):
-        for shaper in self.shapers:
+        for shaper in self.get_shapers():
             shaper.disable_shaping()
         self._update_input_shaping()
     def enable_shaping(self):
-        for shaper in self.shapers:
+        for shaper in self.get_shapers():
             shaper.enable_shaping()
         self._update_input_shaping()
     cmd_SET_INPUT_SHAPER_help = "Set cartesian parameters for input shaper"
     def cmd_SET_INPUT_SHAPER(self, gcmd):
         if gcmd.get_command_parameters():
-            for shaper in self.shapers:
+            for shaper in self.get_shapers():
                 shaper.update(gcmd)
             self._update_input_shaping()
-        for shaper in self.shapers:
+        for shaper in self.get_shapers():
             shaper.report(gcmd)
 
 def load_config(config):
@@ -15,7 +15,7 @@ class DumpStepper:
         self.last_batch_clock = 0
         self.batch_bulk = bulk_sensor.BatchBulkHelper(printer,
                                                       self._process_batch)
-        api_resp = {'header': ('interval', 'count', 'add')}
+        api_resp = {'header': ('interval', 'count', 'add', 'add2')}
         self.batch_bulk.add_mux_endpoint("motion_report/dump_stepper", "name",
                                          mcu_stepper.get_name(), api_resp)
     def get_step_queue(self, start_clock, end_clock):
@@ -39,9 +39,9 @@ class DumpStepper:
                    % (self.mcu_stepper.get_name(),
                       self.mcu_stepper.get_mcu().get_name(), len(data)))
         for i, s in enumerate(data):
-            out.append("queue_step %d: t=%d p=%d i=%d c=%d a=%d"
+            out.append("queue_step %d: t=%d p=%d i=%d c=%d a=%d a2=%d"
                        % (i, s.first_clock, s.start_position, s.interval,
-                          s.step_count, s.add))
+                          s.step_count, s.add, s.add2))
         logging.info('\n'.join(out))
     def _process_batch(self, eventtime):
         data, cdata = self.get_step_queue(self.last_batch_clock, 1<<63)
@@ -58,7 +58,7 @@ class DumpStepper:
         step_dist = self.mcu_stepper.get_step_dist()
         if self.mcu_stepper.get_dir_inverted()[0]:
             step_dist = -step_dist
-        d = [(s.interval, s.step_count, s.add) for s in data]
+        d = [(s.interval, s.step_count, s.add, s.add2) for s in data]
         return {"data": d, "start_position": start_position,
                 "start_mcu_position": mcu_pos, "step_distance": step_dist,
                 "first_clock": first_clock, "first_step_time": first_time,
@@ -76,7 +76,8 @@ class DumpTrapQ:
         self.batch_bulk = bulk_sensor.BatchBulkHelper(printer,
                                                       self._process_batch)
         api_resp = {'header': ('time', 'duration', 'start_velocity',
-                               'acceleration', 'start_position', 'direction')}
+                               'acceleration', 'start_position', 'direction',
+                               'jerk')}
         self.batch_bulk.add_mux_endpoint("motion_report/dump_trapq",
                                          "name", name, api_resp)
     def extract_trapq(self, start_time, end_time):
@@ -99,10 +100,11 @@ class DumpTrapQ:
             return
         out = ["Dumping trapq '%s' %d moves:" % (self.name, len(data))]
         for i, m in enumerate(data):
-            out.append("move %d: pt=%.6f mt=%.6f sv=%.6f a=%.6f"
+            out.append("move %d: pt=%.6f mt=%.6f sv=%.6f a=%.6f j=%.6f"
                        " sp=(%.6f,%.6f,%.6f) ar=(%.6f,%.6f,%.6f)"
                        % (i, m.print_time, m.move_t, m.start_v, m.accel,
-                          m.start_x, m.start_y, m.start_z, m.x_r, m.y_r, m.z_r))
+                          m.jerk, m.start_x, m.start_y, m.start_z,
+                          m.x_r, m.y_r, m.z_r))
         logging.info('\n'.join(out))
     def get_trapq_position(self, print_time):
         ffi_main, ffi_lib = chelper.get_ffi()
@@ -112,16 +114,19 @@ class DumpTrapQ:
             return None, None
         move = data[0]
         move_time = max(0., min(move.move_t, print_time - move.print_time))
-        dist = (move.start_v + .5 * move.accel * move_time) * move_time;
+        dist = (move.start_v + (.5 * move.accel + move.jerk * move_time / 6.)
+                * move_time) * move_time
         pos = (move.start_x + move.x_r * dist, move.start_y + move.y_r * dist,
                move.start_z + move.z_r * dist)
-        velocity = move.start_v + move.accel * move_time
+        velocity = move.start_v + (move.accel + .5 * move.jerk * move_time
+                                   ) * move_time
         return pos, velocity
     def _process_batch(self, eventtime):
         qtime = self.last_batch_msg[0] + min(self.last_batch_msg[1], 0.100)
         data, cdata = self.extract_trapq(qtime, NEVER_TIME)
         d = [(m.print_time, m.move_t, m.start_v, m.accel,
-              (m.start_x, m.start_y, m.start_z), (m.x_r, m.y_r, m.z_r))
+              (m.start_x, m.start_y, m.start_z), (m.x_r, m.y_r, m.z_r),
+              m.jerk)
              for m in data]
         if d and d[0] == self.last_batch_msg:
             d.pop(0)
@@ -7,6 +7,8 @@ import collections, math
 
 SHAPER_VIBRATION_REDUCTION=20.
 DEFAULT_DAMPING_RATIO = 0.1
+# Must match MAX_SHAPER_PULSES in chelper/kin_shaper.c
+MAX_SHAPER_PULSES = 32
 
 InputShaperCfg = collections.namedtuple(
         'InputShaperCfg', ('name', 'init_func', 'min_freq'))
@@ -91,6 +93,19 @@ def get_3hump_ei_shaper(shaper_freq, damping_ratio):
     T = [0., .5*t_d, t_d, 1.5*t_d, 2.*t_d]
     return (A, T)
 
+# Check the pulses of a user defined shaper and return an error
+# message (or None if the pulses are valid)
+def check_custom_shaper(A, T):
+    if not A or len(A) != len(T):
+        return "shaper_a and shaper_t must have the same number of pulses"
+    if len(A) > MAX_SHAPER_PULSES:
+        return "at most %d shaper pulses are supported" % (MAX_SHAPER_PULSES,)
+    if sum(A) <= 0.:
+        return "the sum of shaper_a must be positive"
+    if T[0] < 0. or any(t1 > t2 for t1, t2 in zip(T[:-1], T[1:])):
+        return "shaper_t must be non-negative and in increasing order"
+    return None
+
 # min_freq for each shaper is chosen to have projected max_accel ~= 1500
 INPUT_SHAPERS = [
     InputShaperCfg('zv', get_zv_shaper, min_freq=21.),
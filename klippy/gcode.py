@@ -4,6 +4,7 @@
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import os, re, logging, collections, shlex
+import chelper
 
 class CommandError(Exception):
     pass
@@ -105,6 +106,11 @@ class GCodeDispatch:
         self.mux_commands = {}
         self.gcode_help = {}
         self.status_commands = {}
+        # Simple commands decoded in C code (see chelper/gcode_parse.c)
+        ffi_main, ffi_lib = chelper.get_ffi()
+        self.fast_params = ffi_main.new('struct gcode_params *')
+        self.gcode_parse_line = ffi_lib.gcode_parse_line
+        self.fast_commands = {}
         # Register commands needed before config file is loaded
         handlers = ['M110', 'M112', 'M115',
                     'RESTART', 'FIRMWARE_RESTART', 'ECHO', 'STATUS', 'HELP']
@@ -141,6 +147,13 @@ class GCodeDispatch:
         if desc is not None:
             self.gcode_help[cmd] = desc
         self._build_status_commands()
+    def register_fast_command(self, cmd, func, fast_func):
+        # While 'func' is the registered handler for the traditional
+        # command 'cmd', lines with only single letter numeric
+        # parameters are passed (as a decoded 'struct gcode_params') to
+        # fast_func() instead.  It may return False to use 'func'.
+        cmd_id = (ord(cmd[0]) << 16) | int(cmd[1:])
+        self.fast_commands[cmd_id] = (cmd, func, fast_func)
     def register_mux_command(self, cmd, key, value, func, desc=None):
         prev = self.mux_commands.get(cmd)
         if prev is None:
@@ -185,8 +198,42 @@ class GCodeDispatch:
         self._respond_state("Ready")
     # Parse input into commands
     args_r = re.compile('([A-Z_]+|[A-Z*/])')
+    def _process_fast_command(self, fast_command, need_ack):
+        cmd, func, fast_func = fast_command
+        if self.gcode_handlers.get(cmd) != func:
+            return False
+        try:
+            if not fast_func(self.fast_params):
+                return False
+        except self.error as e:
+            self._respond_error(str(e))
+            self.printer.send_event("gcode:command_error")
+            if not need_ack:
+                raise
+        except:
+            msg = 'Internal error on command:"%s"' % (cmd,)
+            logging.exception(msg)
+            self.printer.invoke_shutdown(msg)
+            self._respond_error(msg)
+            if not need_ack:
+                raise
+        if need_ack:
+            self.respond_raw("ok")
+        return True
     def _process_commands(self, commands, need_ack=True):
+        fast_commands, fast_params = self.fast_commands, self.fast_params
         for line in commands:
+            # Check for a simple command that was decoded in C code
+            try:
+                bline = line.encode('utf-8')
+            except UnicodeError:
+                # Python2 str with non-ascii characters - use full parser
+                bline = b''
+            cmd_id = self.gcode_parse_line(fast_params, bline, len(bline))
+            fast_command = fast_commands.get(cmd_id)
+            if (fast_command is not None
+                and self._process_fast_command(fast_command, need_ack)):
+                continue
             # Ignore comments and leading/trailing spaces
             line = origline = line.strip()
             cpos = line.find(';')
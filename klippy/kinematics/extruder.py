@@ -6,6 +6,8 @@
 import math, logging
 import stepper, chelper
 
+MAX_TAPER_BANDS = 7
+
 class ExtruderStepper:
     def __init__(self, config):
         self.printer = config.get_printer()
@@ -14,12 +16,18 @@ class ExtruderStepper:
         self.config_pa = config.getfloat('pressure_advance', 0., minval=0.)
         self.config_smooth_time = config.getfloat(
                 'pressure_advance_smooth_time', 0.040, above=0., maxval=.200)
+        self.pressure_advance_taper = ()
+        self.config_taper = config.getlists(
+            'pressure_advance_taper', (), seps=(':', ','), count=2,
+            parser=float)
+        self._check_taper(self.config_taper, config.error)
         # Setup stepper
         self.stepper = stepper.PrinterStepper(config)
         ffi_main, ffi_lib = chelper.get_ffi()
         self.sk_extruder = ffi_main.gc(ffi_lib.extruder_stepper_alloc(),
                                        ffi_lib.free)
         self.stepper.set_stepper_kinematics(self.sk_extruder)
+        self.step_generation_window = 0.
         self.motion_queue = None
         # Register commands
         self.printer.register_event_handler("klippy:connect",
@@ -46,11 +54,13 @@ class ExtruderStepper:
                                    desc=self.cmd_SYNC_STEPPER_TO_EXTRUDER_help)
     def _handle_connect(self):
         toolhead = self.printer.lookup_object('toolhead')
-        toolhead.register_step_generator(self.stepper.generate_steps)
-        self._set_pressure_advance(self.config_pa, self.config_smooth_time)
+        toolhead.register_stepper(self.stepper)
+        self._set_pressure_advance(self.config_pa, self.config_smooth_time,
+                                   self.config_taper)
     def get_status(self, eventtime):
         return {'pressure_advance': self.pressure_advance,
                 'smooth_time': self.pressure_advance_smooth_time,
+                'pressure_advance_taper': self.pressure_advance_taper,
                 'motion_queue': self.motion_queue}
     def find_past_position(self, print_time):
         mcu_pos = self.stepper.get_past_mcu_position(print_time)
@@ -69,21 +79,51 @@ class ExtruderStepper:
         self.stepper.set_position([extruder.last_position, 0., 0.])
         self.stepper.set_trapq(extruder.get_trapq())
         self.motion_queue = extruder_name
-    def _set_pressure_advance(self, pressure_advance, smooth_time):
-        old_smooth_time = self.pressure_advance_smooth_time
-        if not self.pressure_advance:
-            old_smooth_time = 0.
+    def _update_step_generation_window(self):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        old_delay = self.step_generation_window
+        new_delay = ffi_lib.extruder_get_step_generation_window(
+            self.sk_extruder)
+        if old_delay != new_delay:
+            toolhead = self.printer.lookup_object("toolhead")
+            toolhead.note_step_generation_scan_time(new_delay,
+                                                    old_delay=old_delay)
+            self.step_generation_window = new_delay
+    def _check_taper(self, taper, error):
+        if len(taper) > MAX_TAPER_BANDS:
+            raise error("Pressure advance taper may have at most %d entries"
+                        % (MAX_TAPER_BANDS,))
+        last_velocity = 0.
+        for velocity, factor in taper:
+            if velocity <= last_velocity or factor < 0.:
+                raise error("Pressure advance taper must have increasing"
+                            " positive velocities and non-negative factors")
+            last_velocity = velocity
+    def _set_pressure_advance(self, pressure_advance, smooth_time, taper):
         new_smooth_time = smooth_time
         if not pressure_advance:
             new_smooth_time = 0.
         toolhead = self.printer.lookup_object("toolhead")
-        toolhead.note_step_generation_scan_time(new_smooth_time * .5,
-                                                old_delay=old_smooth_time * .5)
+        toolhead.flush_step_generation()
         ffi_main, ffi_lib = chelper.get_ffi()
         espa = ffi_lib.extruder_set_pressure_advance
         espa(self.sk_extruder, pressure_advance, new_smooth_time)
+        velocities = [v for v, f in taper]
+        factors = [f for v, f in taper]
+        ffi_lib.extruder_set_pressure_advance_taper(
+            self.sk_extruder, len(taper), velocities, factors)
+        self._update_step_generation_window()
         self.pressure_advance = pressure_advance
         self.pressure_advance_smooth_time = smooth_time
+        self.pressure_advance_taper = tuple(taper)
+    def set_input_shaper(self, n, A, T):
+        toolhead = self.printer.lookup_object("toolhead")
+        toolhead.flush_step_generation()
+        ffi_main, ffi_lib = chelper.get_ffi()
+        success = ffi_lib.extruder_set_shaper_params(
+            self.sk_extruder, n, A, T) == 0
+        self._update_step_generation_window()
+        return success
     cmd_SET_PRESSURE_ADVANCE_help = "Set pressure advance parameters"
     def cmd_default_SET_PRESSURE_ADVANCE(self, gcmd):
         extruder = self.printer.lookup_object('toolhead').get_extruder()
@@ -99,10 +139,25 @@ class ExtruderStepper:
         smooth_time = gcmd.get_float('SMOOTH_TIME',
                                      self.pressure_advance_smooth_time,
                                      minval=0., maxval=.200)
-        self._set_pressure_advance(pressure_advance, smooth_time)
+        taper = self.pressure_advance_taper
+        taper_str = gcmd.get('TAPER', None)
+        if taper_str is not None:
+            try:
+                taper = tuple([tuple([float(p) for p in band.split(':')])
+                               for band in taper_str.split(',')
+                               if band.strip()])
+            except ValueError:
+                raise gcmd.error("Unable to parse TAPER '%s'" % (taper_str,))
+            if [band for band in taper if len(band) != 2]:
+                raise gcmd.error("TAPER must be a list of velocity:factor")
+            self._check_taper(taper, gcmd.error)
+        self._set_pressure_advance(pressure_advance, smooth_time, taper)
         msg = ("pressure_advance: %.6f\n"
                "pressure_advance_smooth_time: %.6f"
                % (pressure_advance, smooth_time))
+        if taper:
+            msg += "\npressure_advance_taper: %s" % (
+                ", ".join(["%.3f:%.3f" % band for band in taper]),)
         self.printer.set_rollover_info(self.name, "%s: %s" % (self.name, msg))
         gcmd.respond_info(msg, log=False)
     cmd_SET_E_ROTATION_DISTANCE_help = "Set extruder rotation distance"
@@ -259,20 +314,9 @@ class PrinterExtruder:
         if diff_r:
             return (self.instant_corner_v / abs(diff_r))**2
         return move.max_cruise_v2
-    def move(self, print_time, move):
-        axis_r = move.axes_r[3]
-        accel = move.accel * axis_r
-        start_v = move.start_v * axis_r
-        cruise_v = move.cruise_v * axis_r
-        can_pressure_advance = False
-        if axis_r > 0. and (move.axes_d[0] or move.axes_d[1]):
-            can_pressure_advance = True
-        # Queue movement (x is extruder movement, y is pressure advance flag)
-        self.trapq_append(self.trapq, print_time,
-                          move.accel_t, move.cruise_t, move.decel_t,
-                          move.start_pos[3], 0., 0.,
-                          1., can_pressure_advance, 0.,
-                          start_v, cruise_v, accel)
+    def note_move_queued(self, move):
+        # The toolhead look-ahead code adds extruder movement to the
+        # trapq (x is extruder movement, y is pressure advance flag)
         self.last_position = move.end_pos[3]
     def find_past_position(self, print_time):
         if self.extruder_stepper is None:
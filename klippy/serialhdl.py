@@ -3,7 +3,7 @@
 # Copyright (C) 2016-2021  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import logging, threading, os
+import logging, threading, os, socket, stat
 import serial
 
 import msgproto, chelper, util
@@ -11,6 +11,11 @@ import msgproto, chelper, util
 class error(Exception):
     pass
 
+# Command queue priority classes (must match serialqueue.h)
+COMMAND_QUEUE_PRIORITIES = {
+    'motion': 0, 'trsync': 1, 'sensor': 2, 'cosmetic': 3,
+}
+
 class SerialReader:
     def __init__(self, reactor, warn_prefix=""):
         self.reactor = reactor
@@ -78,10 +83,13 @@ class SerialReader:
                 identify_data += msgdata
     def _start_session(self, serial_dev, serial_fd_type=b'u', client_id=0):
         self.serial_dev = serial_dev
-        self.serialqueue = self.ffi_main.gc(
-            self.ffi_lib.serialqueue_alloc(serial_dev.fileno(),
-                                           serial_fd_type, client_id),
-            self.ffi_lib.serialqueue_free)
+        sq = self.ffi_lib.serialqueue_alloc(serial_dev.fileno(),
+                                            serial_fd_type, client_id)
+        if sq == self.ffi_main.NULL:
+            logging.info("%sUnable to setup transport", self.warn_prefix)
+            self.disconnect()
+            return False
+        self.serialqueue = self.ffi_main.gc(sq, self.ffi_lib.serialqueue_free)
         self.background_thread = threading.Thread(target=self._bg_thread)
         self.background_thread.start()
         # Obtain and load the data dictionary from the firmware
@@ -107,6 +115,15 @@ class SerialReader:
         if receive_window is not None:
             self.ffi_lib.serialqueue_set_receive_window(
                 self.serialqueue, receive_window)
+        # Enable selective retransmit (if supported by the mcu)
+        try:
+            sack_tag = msgparser.lookup_msgtag("sack mask=%c")
+            msgparser.lookup_command("enable_sack")
+        except msgproto.error as e:
+            sack_tag = None
+        if sack_tag is not None:
+            self.ffi_lib.serialqueue_set_sack(self.serialqueue, sack_tag)
+            self.send("enable_sack")
         return True
     def connect_canbus(self, canbus_uuid, canbus_nodeid, canbus_iface="can0"):
         import can # XXX
@@ -164,13 +181,25 @@ class SerialReader:
             if self.reactor.monotonic() > start_time + 90.:
                 self._error("Unable to connect")
             try:
-                fd = os.open(filename, os.O_RDWR | os.O_NOCTTY)
-            except OSError as e:
+                if stat.S_ISSOCK(os.stat(filename).st_mode):
+                    # Shared memory console (linux mcu started with "-S")
+                    serial_dev = socket.socket(socket.AF_UNIX,
+                                               socket.SOCK_STREAM)
+                    try:
+                        serial_dev.connect(filename)
+                    except:
+                        serial_dev.close()
+                        raise
+                    fd_type = b'm'
+                else:
+                    fd = os.open(filename, os.O_RDWR | os.O_NOCTTY)
+                    serial_dev = os.fdopen(fd, 'rb+', 0)
+                    fd_type = b'u'
+            except (OSError, socket.error) as e:
                 logging.warn("%sUnable to open port: %s", self.warn_prefix, e)
                 self.reactor.pause(self.reactor.monotonic() + 5.)
                 continue
-            serial_dev = os.fdopen(fd, 'rb+', 0)
-            ret = self._start_session(serial_dev)
+            ret = self._start_session(serial_dev, fd_type)
             if ret:
                 break
     def connect_uart(self, serialport, baud, rts=True):
@@ -259,9 +288,12 @@ class SerialReader:
         cmd = self.msgparser.create_command(msg)
         src = SerialRetryCommand(self, response)
         return src.get_response([cmd], self.default_cmd_queue)
-    def alloc_command_queue(self):
-        return self.ffi_main.gc(self.ffi_lib.serialqueue_alloc_commandqueue(),
-                                self.ffi_lib.serialqueue_free_commandqueue)
+    def alloc_command_queue(self, priority='motion'):
+        cq = self.ffi_main.gc(self.ffi_lib.serialqueue_alloc_commandqueue(),
+                              self.ffi_lib.serialqueue_free_commandqueue)
+        self.ffi_lib.serialqueue_set_commandqueue_priority(
+            cq, COMMAND_QUEUE_PRIORITIES[priority])
+        return cq
     # Dumping debug lists
     def dump_debug(self):
         out = []
@@ -103,6 +103,11 @@ class MCU_stepper:
         ffi_main, ffi_lib = chelper.get_ffi()
         ffi_lib.stepcompress_fill(self._stepqueue, max_error_ticks,
                                   step_cmd_tag, dir_cmd_tag)
+        step_add2_cmd = self._mcu.try_lookup_command(
+            "queue_step_add2 oid=%c interval=%u count=%hu add=%i add2=%i")
+        if step_add2_cmd is not None:
+            ffi_lib.stepcompress_set_add2_msgtag(
+                self._stepqueue, step_add2_cmd.get_command_tag())
     def get_oid(self):
         return self._oid
     def get_step_dist(self):
@@ -211,7 +216,7 @@ class MCU_stepper:
         return old_tq
     def add_active_callback(self, cb):
         self._active_callbacks.append(cb)
-    def generate_steps(self, flush_time):
+    def prep_generate_steps(self, flush_time):
         # Check for activity if necessary
         if self._active_callbacks:
             sk = self._stepper_kinematics
@@ -221,8 +226,10 @@ class MCU_stepper:
                 self._active_callbacks = []
                 for cb in cbs:
                     cb(ret)
+        return self._stepper_kinematics
+    def generate_steps(self, flush_time):
+        sk = self.prep_generate_steps(flush_time)
         # Generate steps
-        sk = self._stepper_kinematics
         ret = self._itersolve_generate_steps(sk, flush_time)
         if ret:
             raise error("Internal error in stepcompress")
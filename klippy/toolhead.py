@@ -3,7 +3,7 @@
 # Copyright (C) 2016-2021  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import math, logging, importlib
+import math, logging, importlib, multiprocessing
 import mcu, chelper, kinematics.extruder
 
 # Common suffixes: _d is distance (in mm), _v is velocity (in
@@ -42,10 +42,8 @@ class Move:
         # Junction speeds are tracked in velocity squared.  The
         # delta_v2 is the maximum amount of this squared-velocity that
         # can change in this move.
-        self.max_start_v2 = 0.
         self.max_cruise_v2 = velocity**2
         self.delta_v2 = 2.0 * move_d * self.accel
-        self.max_smoothed_v2 = 0.
         self.smooth_delta_v2 = 2.0 * move_d * toolhead.max_accel_to_decel
     def limit_speed(self, speed, accel):
         speed2 = speed**2
@@ -59,130 +57,84 @@ class Move:
         ep = self.end_pos
         m = "%s: %.3f %.3f %.3f [%.3f]" % (msg, ep[0], ep[1], ep[2], ep[3])
         return self.toolhead.printer.command_error(m)
-    def calc_junction(self, prev_move):
-        if not self.is_kinematic_move or not prev_move.is_kinematic_move:
-            return
-        # Allow extruder to calculate its maximum junction
-        extruder_v2 = self.toolhead.extruder.calc_junction(prev_move, self)
-        # Find max velocity using "approximated centripetal velocity"
-        axes_r = self.axes_r
-        prev_axes_r = prev_move.axes_r
-        junction_cos_theta = -(axes_r[0] * prev_axes_r[0]
-                               + axes_r[1] * prev_axes_r[1]
-                               + axes_r[2] * prev_axes_r[2])
-        if junction_cos_theta > 0.999999:
-            return
-        junction_cos_theta = max(junction_cos_theta, -0.999999)
-        sin_theta_d2 = math.sqrt(0.5*(1.0-junction_cos_theta))
-        R_jd = sin_theta_d2 / (1. - sin_theta_d2)
-        # Approximated circle must contact moves no further away than mid-move
-        tan_theta_d2 = sin_theta_d2 / math.sqrt(0.5*(1.0+junction_cos_theta))
-        move_centripetal_v2 = .5 * self.move_d * tan_theta_d2 * self.accel
-        prev_move_centripetal_v2 = (.5 * prev_move.move_d * tan_theta_d2
-                                    * prev_move.accel)
-        # Apply limits
-        self.max_start_v2 = min(
-            R_jd * self.junction_deviation * self.accel,
-            R_jd * prev_move.junction_deviation * prev_move.accel,
-            move_centripetal_v2, prev_move_centripetal_v2,
-            extruder_v2, self.max_cruise_v2, prev_move.max_cruise_v2,
-            prev_move.max_start_v2 + prev_move.delta_v2)
-        self.max_smoothed_v2 = min(
-            self.max_start_v2
-            , prev_move.max_smoothed_v2 + prev_move.smooth_delta_v2)
-    def set_junction(self, start_v2, cruise_v2, end_v2):
-        # Determine accel, cruise, and decel portions of the move distance
-        half_inv_accel = .5 / self.accel
-        accel_d = (cruise_v2 - start_v2) * half_inv_accel
-        decel_d = (cruise_v2 - end_v2) * half_inv_accel
-        cruise_d = self.move_d - accel_d - decel_d
-        # Determine move velocities
-        self.start_v = start_v = math.sqrt(start_v2)
-        self.cruise_v = cruise_v = math.sqrt(cruise_v2)
-        self.end_v = end_v = math.sqrt(end_v2)
-        # Determine time spent in each portion of move (time is the
-        # distance divided by average velocity)
-        self.accel_t = accel_d / ((start_v + cruise_v) * 0.5)
-        self.cruise_t = cruise_d / cruise_v
-        self.decel_t = decel_d / ((end_v + cruise_v) * 0.5)
 
 LOOKAHEAD_FLUSH_TIME = 0.250
 
 # Class to track a list of pending move requests and to facilitate
-# "look-ahead" across moves to reduce acceleration between moves.
+# "look-ahead" across moves to reduce acceleration between moves.  The
+# junction velocity planning is implemented in chelper/lookahead.c.
 class MoveQueue:
     def __init__(self, toolhead):
         self.toolhead = toolhead
         self.queue = []
-        self.junction_flush = LOOKAHEAD_FLUSH_TIME
+        ffi_main, ffi_lib = chelper.get_ffi()
+        self.lookahead = ffi_main.gc(
+            ffi_lib.lookahead_alloc(LOOKAHEAD_FLUSH_TIME),
+            ffi_lib.lookahead_free)
+        self.lookahead_add_move = ffi_lib.lookahead_add_move
+        self.lookahead_flush = ffi_lib.lookahead_flush
+        self.lookahead_queue_moves = ffi_lib.lookahead_queue_moves
+        self.lookahead_reset = ffi_lib.lookahead_reset
+        self.lookahead_set_flush_time = ffi_lib.lookahead_set_flush_time
+        self.lookahead_set_default_flush_time = (
+            ffi_lib.lookahead_set_default_flush_time)
+        self.lookahead_set_jerk = ffi_lib.lookahead_set_jerk
+        self.end_times = ffi_main.new("double[]", 1)
+        self.ffi_main = ffi_main
     def reset(self):
         del self.queue[:]
-        self.junction_flush = LOOKAHEAD_FLUSH_TIME
+        self.lookahead_reset(self.lookahead)
     def set_flush_time(self, flush_time):
-        self.junction_flush = flush_time
+        self.lookahead_set_flush_time(self.lookahead, flush_time)
+    def set_default_flush_time(self, flush_time):
+        self.lookahead_set_default_flush_time(self.lookahead, flush_time)
+    def set_jerk(self, jerk):
+        self.lookahead_set_jerk(self.lookahead, jerk)
     def get_last(self):
         if self.queue:
             return self.queue[-1]
         return None
     def flush(self, lazy=False):
-        self.junction_flush = LOOKAHEAD_FLUSH_TIME
-        update_flush_count = lazy
-        queue = self.queue
-        flush_count = len(queue)
-        # Traverse queue from last to first move and determine maximum
-        # junction speed assuming the robot comes to a complete stop
-        # after the last move.
-        delayed = []
-        next_end_v2 = next_smoothed_v2 = peak_cruise_v2 = 0.
-        for i in range(flush_count-1, -1, -1):
-            move = queue[i]
-            reachable_start_v2 = next_end_v2 + move.delta_v2
-            start_v2 = min(move.max_start_v2, reachable_start_v2)
-            reachable_smoothed_v2 = next_smoothed_v2 + move.smooth_delta_v2
-            smoothed_v2 = min(move.max_smoothed_v2, reachable_smoothed_v2)
-            if smoothed_v2 < reachable_smoothed_v2:
-                # It's possible for this move to accelerate
-                if (smoothed_v2 + move.smooth_delta_v2 > next_smoothed_v2
-                    or delayed):
-                    # This move can decelerate or this is a full accel
-                    # move after a full decel move
-                    if update_flush_count and peak_cruise_v2:
-                        flush_count = i
-                        update_flush_count = False
-                    peak_cruise_v2 = min(move.max_cruise_v2, (
-                        smoothed_v2 + reachable_smoothed_v2) * .5)
-                    if delayed:
-                        # Propagate peak_cruise_v2 to any delayed moves
-                        if not update_flush_count and i < flush_count:
-                            mc_v2 = peak_cruise_v2
-                            for m, ms_v2, me_v2 in reversed(delayed):
-                                mc_v2 = min(mc_v2, ms_v2)
-                                m.set_junction(min(ms_v2, mc_v2), mc_v2
-                                               , min(me_v2, mc_v2))
-                        del delayed[:]
-                if not update_flush_count and i < flush_count:
-                    cruise_v2 = min((start_v2 + reachable_start_v2) * .5
-                                    , move.max_cruise_v2, peak_cruise_v2)
-                    move.set_junction(min(start_v2, cruise_v2), cruise_v2
-                                      , min(next_end_v2, cruise_v2))
-            else:
-                # Delay calculating this move until peak_cruise_v2 is known
-                delayed.append((move, start_v2, next_end_v2))
-            next_end_v2 = start_v2
-            next_smoothed_v2 = smoothed_v2
-        if update_flush_count or not flush_count:
+        flush_count = self.lookahead_flush(self.lookahead, lazy)
+        if not flush_count:
             return
         # Generate step times for all moves ready to be flushed
+        queue = self.queue
         self.toolhead._process_moves(queue[:flush_count])
         # Remove processed moves from the queue
         del queue[:flush_count]
+    def queue_moves(self, count, print_time, extruder_trapq):
+        # Add flushed moves to the toolhead and extruder trapq (in a
+        # single call) and return the end time of each move
+        end_times = self.end_times
+        if len(end_times) < count:
+            end_times = self.end_times = self.ffi_main.new("double[]", count)
+        end_time = self.lookahead_queue_moves(
+            self.lookahead, self.toolhead.trapq, extruder_trapq, print_time,
+            end_times)
+        if end_time < 0.:
+            raise mcu.error("Internal error in lookahead")
+        return end_time, end_times
     def add_move(self, move):
-        self.queue.append(move)
-        if len(self.queue) == 1:
-            return
-        move.calc_junction(self.queue[-2])
-        self.junction_flush -= move.min_move_t
-        if self.junction_flush <= 0.:
+        queue = self.queue
+        queue.append(move)
+        # Allow extruder to calculate its maximum junction
+        extruder_v2 = move.max_cruise_v2
+        if (len(queue) > 1 and move.is_kinematic_move
+            and queue[-2].is_kinematic_move):
+            extruder_v2 = self.toolhead.extruder.calc_junction(queue[-2], move)
+        start_pos, axes_r = move.start_pos, move.axes_r
+        need_flush = self.lookahead_add_move(
+            self.lookahead, start_pos[0], start_pos[1], start_pos[2],
+            start_pos[3], axes_r[0], axes_r[1], axes_r[2], axes_r[3],
+            move.move_d, move.accel,
+            move.junction_deviation, move.min_move_t, move.max_cruise_v2,
+            move.delta_v2, move.smooth_delta_v2, move.is_kinematic_move,
+            extruder_v2)
+        if need_flush < 0:
+            queue.pop()
+            raise mcu.error("Internal error in lookahead")
+        if need_flush:
             # Enough moves have been queued to reach the target flush time.
             self.flush(lazy=True)
 
@@ -197,6 +149,62 @@ STEPCOMPRESS_FLUSH_TIME = 0.050
 SDS_CHECK_TIME = 0.001 # step+dir+step filter in stepcompress.c
 MOVE_HISTORY_EXPIRE = 30.
 
+TUNE_INTERVAL = 2.000
+TUNE_SMOOTH = 0.300
+TUNE_LOAD_LOW = 0.250
+TUNE_MAX_SCALE = 3.0
+TUNE_MIN_CHANGE = 0.100
+
+# Adjust the lookahead window, step generation batching, and buffer
+# times from the measured host time needed to plan (and generate
+# steps for) each second of print time.  A slow host then processes
+# moves in larger batches (to reduce per batch overhead) and keeps
+# more moves buffered in the mcu (to avoid an underrun).
+class FlushTuner:
+    def __init__(self, toolhead):
+        self.move_queue = toolhead.move_queue
+        # Host timing does not apply when writing to an output file
+        self.is_active = not toolhead.mcu.is_fileoutput()
+        self.host_time = self.move_time = 0.
+        self.load = 0.
+        self.scale = 1.
+        self._apply_scale()
+    def _apply_scale(self):
+        scale = self.scale
+        self.lookahead_time = LOOKAHEAD_FLUSH_TIME * scale
+        self.move_batch_time = MOVE_BATCH_TIME * scale
+        self.buffer_time_low = BUFFER_TIME_LOW * scale
+        self.buffer_time_high = BUFFER_TIME_HIGH * scale
+        self.move_queue.set_default_flush_time(self.lookahead_time)
+    def note_host_time(self, host_time):
+        self.host_time += host_time
+    def note_move_time(self, move_time):
+        self.move_time += move_time
+        if self.move_time < TUNE_INTERVAL:
+            return
+        load = self.host_time / self.move_time
+        self.host_time = self.move_time = 0.
+        if not self.is_active:
+            return
+        self.load += (load - self.load) * TUNE_SMOOTH
+        scale = min(max(1., self.load / TUNE_LOAD_LOW), TUNE_MAX_SCALE)
+        if scale == self.scale or (abs(scale - self.scale) < TUNE_MIN_CHANGE
+                                   and 1. < scale < TUNE_MAX_SCALE):
+            return
+        logging.info("Flush tuning: planner load %.3f, scale %.2f -> %.2f",
+                     self.load, self.scale, scale)
+        self.scale = scale
+        self._apply_scale()
+    def get_stats(self):
+        return "planner_load=%.3f lookahead_time=%.3f" % (
+            self.load, self.lookahead_time)
+    def get_status(self):
+        return {'planner_load': self.load,
+                'lookahead_time': self.lookahead_time,
+                'move_batch_time': self.move_batch_time,
+                'buffer_time_low': self.buffer_time_low,
+                'buffer_time_high': self.buffer_time_high}
+
 DRIP_SEGMENT_TIME = 0.050
 DRIP_TIME = 0.100
 class DripModeEndSignal(Exception):
@@ -211,7 +219,8 @@ class ToolHead:
             m for n, m in self.printer.lookup_objects(module='mcu')]
         self.mcu = self.all_mcus[0]
         self.move_queue = MoveQueue(self)
-        self.move_queue.set_flush_time(BUFFER_TIME_HIGH)
+        self.flush_tuner = FlushTuner(self)
+        self.move_queue.set_flush_time(self.flush_tuner.buffer_time_high)
         self.commanded_pos = [0., 0., 0., 0.]
         # Velocity and acceleration control
         self.max_velocity = config.getfloat('max_velocity', above=0.)
@@ -223,6 +232,15 @@ class ToolHead:
             'square_corner_velocity', 5., minval=0.)
         self.junction_deviation = 0.
         self._calc_junction_deviation()
+        # Acceleration profile (constant acceleration or jerk limited)
+        self.motion_profile = config.getchoice(
+            'motion_profile', {'trapezoid': 'trapezoid', 'scurve': 'scurve'},
+            'trapezoid')
+        self.max_jerk = 0.
+        if self.motion_profile == 'scurve':
+            self.max_jerk = config.getfloat('max_jerk', self.max_accel * 100.,
+                                            above=0.)
+        self.move_queue.set_jerk(self.max_jerk)
         # Input stall detection
         self.check_stall_time = 0.
         self.print_stall = 0
@@ -249,11 +267,25 @@ class ToolHead:
         self.trapq = ffi_main.gc(ffi_lib.trapq_alloc(), ffi_lib.trapq_free)
         self.trapq_append = ffi_lib.trapq_append
         self.trapq_finalize_moves = ffi_lib.trapq_finalize_moves
+        self.trapq_get_stats = ffi_lib.trapq_get_stats
+        self.stats_buf = ffi_main.new('char[256]')
+        self.ffi_main = ffi_main
         self.step_generators = []
+        self.stepgen_steppers = []
+        try:
+            default_threads = min(multiprocessing.cpu_count(), 4)
+        except NotImplementedError:
+            default_threads = 1
+        threads = config.getint('step_generation_threads', default_threads,
+                                minval=1)
+        self.stepgen_pool = ffi_main.gc(ffi_lib.stepgen_pool_alloc(threads),
+                                        ffi_lib.stepgen_pool_free)
+        self.stepgen_generate_steps = ffi_lib.stepgen_pool_generate_steps
         # Create kinematics class
         gcode = self.printer.lookup_object('gcode')
         self.Coord = gcode.Coord
         self.extruder = kinematics.extruder.DummyExtruder(self.printer)
+        self.extruder_trapq = ffi_main.NULL
         kin_name = config.get('kinematics')
         try:
             mod = importlib.import_module('kinematics.' + kin_name)
@@ -287,6 +319,13 @@ class ToolHead:
         sg_flush_want = min(flush_time + STEPCOMPRESS_FLUSH_TIME,
                             self.print_time - self.kin_flush_delay)
         sg_flush_time = max(sg_flush_want, flush_time)
+        if self.stepgen_steppers:
+            sks = [s.prep_generate_steps(sg_flush_time)
+                   for s in self.stepgen_steppers]
+            ret = self.stepgen_generate_steps(self.stepgen_pool, sks, len(sks),
+                                              sg_flush_time)
+            if ret:
+                raise mcu.error("Internal error in stepcompress")
         for sg in self.step_generators:
             sg(sg_flush_time)
         self.last_sg_flush_time = sg_flush_time
@@ -306,8 +345,9 @@ class ToolHead:
         flush_time = max(self.last_flush_time, self.print_time - pt_delay)
         self.print_time = max(self.print_time, next_print_time)
         want_flush_time = max(flush_time, self.print_time - pt_delay)
+        batch_time = self.flush_tuner.move_batch_time
         while 1:
-            flush_time = min(flush_time + MOVE_BATCH_TIME, want_flush_time)
+            flush_time = min(flush_time + batch_time, want_flush_time)
             self._advance_flush_time(flush_time)
             if flush_time >= want_flush_time:
                 break
@@ -330,24 +370,20 @@ class ToolHead:
                 self.need_check_pause = -1.
             self._calc_print_time()
         # Queue moves into trapezoid motion queue (trapq)
-        next_move_time = self.print_time
-        for move in moves:
-            if move.is_kinematic_move:
-                self.trapq_append(
-                    self.trapq, next_move_time,
-                    move.accel_t, move.cruise_t, move.decel_t,
-                    move.start_pos[0], move.start_pos[1], move.start_pos[2],
-                    move.axes_r[0], move.axes_r[1], move.axes_r[2],
-                    move.start_v, move.cruise_v, move.accel)
-            if move.axes_d[3]:
-                self.extruder.move(next_move_time, move)
-            next_move_time = (next_move_time + move.accel_t
-                              + move.cruise_t + move.decel_t)
+        next_move_time, end_times = self.move_queue.queue_moves(
+            len(moves), self.print_time, self.extruder_trapq)
+        for i, move in enumerate(moves):
             for cb in move.timing_callbacks:
-                cb(next_move_time)
+                cb(end_times[i])
+        for move in reversed(moves):
+            if move.axes_d[3]:
+                self.extruder.note_move_queued(move)
+                break
         # Generate steps for moves
         if self.special_queuing_state:
             self._update_drip_move_time(next_move_time)
+        else:
+            self.flush_tuner.note_move_time(next_move_time - self.print_time)
         self.note_kinematic_activity(next_move_time + self.kin_flush_delay,
                                      set_step_gen_time=True)
         self._advance_move_time(next_move_time)
@@ -356,7 +392,7 @@ class ToolHead:
         self.move_queue.flush()
         self.special_queuing_state = "NeedPrime"
         self.need_check_pause = -1.
-        self.move_queue.set_flush_time(BUFFER_TIME_HIGH)
+        self.move_queue.set_flush_time(self.flush_tuner.buffer_time_high)
         self.check_stall_time = 0.
     def flush_step_generation(self):
         self._flush_lookahead()
@@ -372,6 +408,8 @@ class ToolHead:
         eventtime = self.reactor.monotonic()
         est_print_time = self.mcu.estimated_print_time(eventtime)
         buffer_time = self.print_time - est_print_time
+        buffer_time_low = self.flush_tuner.buffer_time_low
+        buffer_time_high = self.flush_tuner.buffer_time_high
         if self.special_queuing_state:
             if self.check_stall_time:
                 # Was in "NeedPrime" state and got there from idle input
@@ -384,11 +422,11 @@ class ToolHead:
             if self.priming_timer is None:
                 self.priming_timer = self.reactor.register_timer(
                     self._priming_handler)
-            wtime = eventtime + max(0.100, buffer_time - BUFFER_TIME_LOW)
+            wtime = eventtime + max(0.100, buffer_time - buffer_time_low)
             self.reactor.update_timer(self.priming_timer, wtime)
         # Check if there are lots of queued moves and pause if so
         while 1:
-            pause_time = buffer_time - BUFFER_TIME_HIGH
+            pause_time = buffer_time - buffer_time_high
             if pause_time <= 0.:
                 break
             if not self.can_pause:
@@ -399,14 +437,17 @@ class ToolHead:
             buffer_time = self.print_time - est_print_time
         if not self.special_queuing_state:
             # In main state - defer pause checking until needed
-            self.need_check_pause = est_print_time + BUFFER_TIME_HIGH + 0.100
+            self.need_check_pause = est_print_time + buffer_time_high + 0.100
     def _priming_handler(self, eventtime):
         self.reactor.unregister_timer(self.priming_timer)
         self.priming_timer = None
         try:
             if self.special_queuing_state == "Priming":
+                start_time = self.reactor.monotonic()
                 self._flush_lookahead()
                 self.check_stall_time = self.print_time
+                self.flush_tuner.note_host_time(
+                    self.reactor.monotonic() - start_time)
         except:
             logging.exception("Exception in priming_handler")
             self.printer.invoke_shutdown("Exception in priming_handler")
@@ -418,13 +459,17 @@ class ToolHead:
                 # In "main" state - flush lookahead if buffer runs low
                 print_time = self.print_time
                 buffer_time = print_time - est_print_time
-                if buffer_time > BUFFER_TIME_LOW:
+                buffer_time_low = self.flush_tuner.buffer_time_low
+                if buffer_time > buffer_time_low:
                     # Running normally - reschedule check
-                    return eventtime + buffer_time - BUFFER_TIME_LOW
+                    return eventtime + buffer_time - buffer_time_low
                 # Under ran low buffer mark - flush lookahead queue
+                start_time = self.reactor.monotonic()
                 self._flush_lookahead()
                 if print_time != self.print_time:
                     self.check_stall_time = self.print_time
+                self.flush_tuner.note_host_time(
+                    self.reactor.monotonic() - start_time)
             # In "NeedPrime"/"Priming" state - flush queues if needed
             while 1:
                 if self.last_flush_time >= self.need_flush_time:
@@ -451,6 +496,7 @@ class ToolHead:
         self.kin.set_position(newpos, homing_axes)
         self.printer.send_event("toolhead:set_position")
     def move(self, newpos, speed):
+        start_time = self.reactor.monotonic()
         move = Move(self, self.commanded_pos, newpos, speed)
         if not move.move_d:
             return
@@ -460,6 +506,9 @@ class ToolHead:
             self.extruder.check_move(move)
         self.commanded_pos[:] = move.end_pos
         self.move_queue.add_move(move)
+        if self.special_queuing_state != "Drip":
+            self.flush_tuner.note_host_time(
+                self.reactor.monotonic() - start_time)
         if self.print_time > self.need_check_pause:
             self._check_pause()
     def manual_move(self, coord, speed):
@@ -483,6 +532,7 @@ class ToolHead:
             eventtime = self.reactor.pause(eventtime + 0.100)
     def set_extruder(self, extruder, extrude_pos):
         self.extruder = extruder
+        self.extruder_trapq = extruder.get_trapq()
         self.commanded_pos[3] = extrude_pos
     def get_extruder(self):
         return self.extruder
@@ -511,7 +561,7 @@ class ToolHead:
         self.need_check_pause = self.reactor.NEVER
         self.reactor.update_timer(self.flush_timer, self.reactor.NEVER)
         self.do_kick_flush_timer = False
-        self.move_queue.set_flush_time(BUFFER_TIME_HIGH)
+        self.move_queue.set_flush_time(self.flush_tuner.buffer_time_high)
         self.check_stall_time = 0.
         self.drip_completion = drip_completion
         # Submit move
@@ -541,8 +591,12 @@ class ToolHead:
         is_active = buffer_time > -60. or not self.special_queuing_state
         if self.special_queuing_state == "Drip":
             buffer_time = 0.
-        return is_active, "print_time=%.3f buffer_time=%.3f print_stall=%d" % (
-            self.print_time, max(buffer_time, 0.), self.print_stall)
+        self.trapq_get_stats(self.trapq, self.stats_buf, len(self.stats_buf))
+        trapq_stats = self.ffi_main.string(self.stats_buf).decode()
+        return is_active, (
+            "print_time=%.3f buffer_time=%.3f print_stall=%d %s %s" % (
+                self.print_time, max(buffer_time, 0.), self.print_stall,
+                self.flush_tuner.get_stats(), trapq_stats))
     def check_busy(self, eventtime):
         est_print_time = self.mcu.estimated_print_time(eventtime)
         lookahead_empty = not self.move_queue.queue
@@ -560,6 +614,7 @@ class ToolHead:
                      'max_accel': self.max_accel,
                      'max_accel_to_decel': self.requested_accel_to_decel,
                      'square_corner_velocity': self.square_corner_velocity})
+        res.update(self.flush_tuner.get_status())
         return res
     def _handle_shutdown(self):
         self.can_pause = False
@@ -570,6 +625,9 @@ class ToolHead:
         return self.trapq
     def register_step_generator(self, handler):
         self.step_generators.append(handler)
+    def register_stepper(self, stepper):
+        # Steps for registered steppers are generated in parallel
+        self.stepgen_steppers.append(stepper)
     def note_step_generation_scan_time(self, delay, old_delay=0.):
         self.flush_step_generation()
         cur_delay = self.kin_flush_delay
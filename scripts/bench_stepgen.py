@@ -0,0 +1,604 @@
+#!/usr/bin/env python3
+# Benchmark host step generation performance
+#
+# Copyright (C) 2026  agent <agent@local>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+from __future__ import print_function
+import optparse, os, sys, time
+sys.path.append(os.path.join(os.path.dirname(os.path.realpath(__file__)),
+                             '..', 'klippy'))
+import chelper
+from extras import shaper_defs
+
+MCU_FREQ = 16000000.
+MAX_ERROR = .000025
+FLUSH_TIME = .050
+MOVE_COUNT = 500
+START_TIME = 2.
+JUNCTION_V = 5.
+
+######################################################################
+# Synthetic moves
+######################################################################
+
+# Return the time and distance to change velocity from v to end_v
+# with the given acceleration and jerk limits
+def calc_phase(v, end_v, accel, jerk):
+    dv = end_v - v
+    if not jerk:
+        phase_t = dv / accel
+    elif dv * jerk >= accel * accel:
+        phase_t = dv / accel + accel / jerk
+    else:
+        phase_t = 2. * (dv / jerk)**.5
+    return phase_t, (v + end_v) * .5 * phase_t
+
+# Queue a series of short zig-zag moves (similar to infill) on a trapq.
+# The first move starts after START_TIME so that the initial null move
+# covers the input shaper window.  A non-zero jerk queues jerk limited
+# (S-curve) moves.
+def fill_trapq(ffi_lib, tq, velocity, accel, seg_len, jerk=0.):
+    print_time = START_TIME
+    x = y = 0.
+    junction_v = .25 * velocity
+    for i in range(MOVE_COUNT):
+        dx, dy = seg_len, (seg_len * .5) * (1 if i & 1 else -1)
+        dist = (dx*dx + dy*dy)**.5
+        cruise_v = velocity
+        accel_t, accel_d = calc_phase(junction_v, cruise_v, accel, jerk)
+        if 2. * accel_d > dist:
+            # Find the highest cruise velocity that fits in the move
+            low, high = junction_v, velocity
+            for j in range(40):
+                cruise_v = .5 * (low + high)
+                accel_t, accel_d = calc_phase(junction_v, cruise_v,
+                                              accel, jerk)
+                if 2. * accel_d > dist:
+                    high = cruise_v
+                else:
+                    low = cruise_v
+            cruise_v = low
+            accel_t, accel_d = calc_phase(junction_v, cruise_v, accel, jerk)
+        cruise_t = (dist - 2. * accel_d) / cruise_v
+        ffi_lib.trapq_append_scurve(tq, print_time, accel_t, cruise_t, accel_t,
+                                    x, y, 0., dx / dist, dy / dist, 0.,
+                                    junction_v, cruise_v, accel, jerk)
+        print_time += 2. * accel_t + cruise_t
+        x += dx
+        y += dy
+    return print_time
+
+######################################################################
+# Step generation setup
+######################################################################
+
+class StepGen:
+    def __init__(self, num_steppers, step_dist, threads, opts, shaper=None):
+        self.ffi_main, self.ffi_lib = ffi_main, ffi_lib = chelper.get_ffi()
+        self.tq = ffi_main.gc(ffi_lib.trapq_alloc(), ffi_lib.trapq_free)
+        self.end_time = self.fill_trapq(opts)
+        self.devnull = open(os.devnull, 'wb')
+        self.sq = ffi_lib.serialqueue_alloc(self.devnull.fileno(), b'f', 0)
+        self.scs = []
+        self.sks = []
+        self.orig_sks = []
+        self.gen_window = 0.
+        for i in range(num_steppers):
+            sc = ffi_main.gc(ffi_lib.stepcompress_alloc(i),
+                             ffi_lib.stepcompress_free)
+            ffi_lib.stepcompress_fill(sc, int(MAX_ERROR * MCU_FREQ), 1, 2)
+            sk = ffi_main.gc(self.alloc_sk(i, opts), ffi_lib.free)
+            if shaper is not None:
+                sk = self.alloc_shaper(sk, shaper, opts)
+            ffi_lib.itersolve_set_stepcompress(sk, sc, step_dist)
+            ffi_lib.itersolve_set_trapq(sk, self.tq)
+            self.scs.append(sc)
+            self.sks.append(sk)
+        self.ss = ffi_main.gc(
+            ffi_lib.steppersync_alloc(self.sq, self.scs, len(self.scs), 64),
+            ffi_lib.steppersync_free)
+        ffi_lib.steppersync_set_time(self.ss, 0., MCU_FREQ)
+        self.pool = ffi_main.gc(ffi_lib.stepgen_pool_alloc(threads),
+                                ffi_lib.stepgen_pool_free)
+    def fill_trapq(self, opts):
+        return fill_trapq(self.ffi_lib, self.tq, opts.velocity, opts.accel,
+                          opts.seg_len, opts.jerk)
+    def alloc_sk(self, index, opts):
+        if opts.kinematics == 'corexy':
+            return self.ffi_lib.corexy_stepper_alloc((b'+', b'-')[index & 1])
+        return self.ffi_lib.cartesian_stepper_alloc((b'x', b'y')[index & 1])
+    def alloc_shaper(self, orig_sk, shaper, opts):
+        ffi_main, ffi_lib = self.ffi_main, self.ffi_lib
+        self.orig_sks.append(orig_sk)
+        is_sk = ffi_main.gc(ffi_lib.input_shaper_alloc(), ffi_lib.free)
+        if ffi_lib.input_shaper_set_sk(is_sk, orig_sk) < 0:
+            raise Exception("Unable to setup input shaper")
+        A, T = shaper.init_func(opts.shaper_freq,
+                                shaper_defs.DEFAULT_DAMPING_RATIO)
+        for axis in [b'x', b'y', b'z']:
+            ffi_lib.input_shaper_set_shaper_params(is_sk, axis, len(A), A, T)
+        window = ffi_lib.input_shaper_get_step_generation_window(is_sk)
+        self.gen_window = max(self.gen_window, window)
+        return is_sk
+    def run(self):
+        ffi_lib = self.ffi_lib
+        flush_time = START_TIME - FLUSH_TIME
+        while flush_time < self.end_time + self.gen_window + FLUSH_TIME:
+            flush_time += FLUSH_TIME
+            ret = ffi_lib.stepgen_pool_generate_steps(
+                self.pool, self.sks, len(self.sks), flush_time)
+            if ret:
+                raise Exception("Error during step generation")
+            clock = int(flush_time * MCU_FREQ)
+            ffi_lib.steppersync_flush(self.ss, clock, 0)
+            ffi_lib.trapq_finalize_moves(self.tq, flush_time - self.gen_window,
+                                         0.)
+    def close(self):
+        self.ffi_lib.serialqueue_exit(self.sq)
+        self.ffi_lib.serialqueue_free(self.sq)
+        self.devnull.close()
+
+def time_stepgen(num_steppers, step_dist, threads, opts, shaper=None):
+    sg = StepGen(num_steppers, step_dist, threads, opts, shaper)
+    start_time = time.time()
+    sg.run()
+    duration = time.time() - start_time
+    sg.close()
+    return duration
+
+######################################################################
+# Benchmarks
+######################################################################
+
+def bench_threads(opts):
+    step_dist = opts.rotation_distance / (200. * opts.microsteps)
+    print("Step generation time vs stepper count (%d moves, %dx microsteps)"
+          % (MOVE_COUNT, opts.microsteps))
+    print("%8s %12s %12s %8s" % ("steppers", "1 thread", "%d threads"
+                                 % (opts.threads,), "speedup"))
+    for num_steppers in range(1, opts.max_steppers + 1):
+        single = time_stepgen(num_steppers, step_dist, 1, opts)
+        multi = time_stepgen(num_steppers, step_dist, opts.threads, opts)
+        print("%8d %11.3fs %11.3fs %7.2fx" % (num_steppers, single, multi,
+                                             single / multi))
+
+# Convolve two shapers (the result suppresses the vibrations of both)
+def convolve_shapers(shaper1, shaper2):
+    A1, T1 = shaper1
+    A2, T2 = shaper2
+    pulses = sorted([(t1 + t2, a1 * a2) for a1, t1 in zip(A1, T1)
+                     for a2, t2 in zip(A2, T2)])
+    return ([a for t, a in pulses], [t for t, a in pulses])
+
+def bench_shapers(opts):
+    step_dist = opts.rotation_distance / (200. * opts.microsteps)
+    num_steppers = 2
+    print("Step generation time vs input shaper (%d moves, %dx microsteps,"
+          " %.1fHz)" % (MOVE_COUNT, opts.microsteps, opts.shaper_freq))
+    print("%12s %7s %12s %10s" % ("shaper", "pulses", "time", "relative"))
+    # Also test multi-mode shapers (built by convolving two shapers)
+    def get_multi_mode_shaper(shaper_cfg):
+        def init_func(shaper_freq, damping_ratio):
+            return convolve_shapers(
+                shaper_cfg.init_func(shaper_freq, damping_ratio),
+                shaper_cfg.init_func(1.5 * shaper_freq, damping_ratio))
+        return shaper_defs.InputShaperCfg(shaper_cfg.name + "^2", init_func,
+                                          shaper_cfg.min_freq)
+    shapers = ([None] + shaper_defs.INPUT_SHAPERS
+               + [get_multi_mode_shaper(s) for s in shaper_defs.INPUT_SHAPERS])
+    base = None
+    for shaper in shapers:
+        duration = min([time_stepgen(num_steppers, step_dist, 1, opts, shaper)
+                        for i in range(opts.repeat)])
+        if base is None:
+            base = duration
+        name, pulses = "none", 0
+        if shaper is not None:
+            name = shaper.name
+            pulses = len(shaper.init_func(opts.shaper_freq,
+                                          shaper_defs.DEFAULT_DAMPING_RATIO)[0])
+        print("%12s %7d %11.3fs %9.2fx" % (name, pulses, duration,
+                                            duration / base))
+
+######################################################################
+# Extruder replay
+######################################################################
+
+# Extract the G0/G1 moves (as [x, y, z, e, speed] end positions) from
+# a sliced G-code file
+def load_gcode_moves(filename):
+    moves = []
+    pos = [0., 0., 0., 0.]
+    speed = 25.
+    absolute_coord = absolute_extrude = True
+    for line in open(filename, 'r'):
+        parts = line.split(';', 1)[0].upper().split()
+        if not parts:
+            continue
+        cmd, params = parts[0], {}
+        for p in parts[1:]:
+            try:
+                params[p[0]] = float(p[1:])
+            except ValueError:
+                pass
+        if cmd in ('G90', 'G91'):
+            absolute_coord = absolute_extrude = cmd == 'G90'
+        elif cmd in ('M82', 'M83'):
+            absolute_extrude = cmd == 'M82'
+        elif cmd == 'G92':
+            for i, axis in enumerate('XYZE'):
+                if axis in params:
+                    pos[i] = params[axis]
+        elif cmd in ('G0', 'G1'):
+            if 'F' in params:
+                speed = params['F'] / 60.
+            for i, axis in enumerate('XYZE'):
+                if axis not in params:
+                    continue
+                if (absolute_extrude if axis == 'E' else absolute_coord):
+                    pos[i] = params[axis]
+                else:
+                    pos[i] += params[axis]
+            moves.append(pos + [speed])
+    return moves
+
+# Queue the extruder motion of a list of G-code moves on a trapq.  A
+# simple planner is used - each move accelerates from (and decelerates
+# to) the same junction velocity.
+def fill_trapq_extruder(ffi_lib, tq, moves, opts):
+    print_time = START_TIME
+    last = [0., 0., 0., 0.]
+    for move in moves:
+        axes_d = [move[i] - last[i] for i in range(4)]
+        last = move[:4]
+        move_d = sum([d*d for d in axes_d[:3]])**.5
+        can_pressure_advance = move_d > 0. and axes_d[3] > 0.
+        if not move_d:
+            move_d = abs(axes_d[3])
+            if not move_d:
+                continue
+        axis_r = axes_d[3] / move_d
+        cruise_v = min(move[4], opts.velocity)
+        junction_v = min(JUNCTION_V, cruise_v)
+        accel_d = (cruise_v**2 - junction_v**2) / (2. * opts.accel)
+        if 2. * accel_d > move_d:
+            accel_d = .5 * move_d
+            cruise_v = (junction_v**2 + 2. * opts.accel * accel_d)**.5
+        accel_t = (cruise_v - junction_v) / opts.accel
+        cruise_t = (move_d - 2. * accel_d) / cruise_v
+        ffi_lib.trapq_append(tq, print_time, accel_t, cruise_t, accel_t,
+                             last[3] - axes_d[3], 0., 0.,
+                             1., can_pressure_advance, 0.,
+                             junction_v * axis_r, cruise_v * axis_r,
+                             opts.accel * axis_r)
+        print_time += 2. * accel_t + cruise_t
+    return print_time
+
+# Count the queue_step commands and steps in the history of a
+# stepcompress object
+def count_history(sc):
+    ffi_main, ffi_lib = chelper.get_ffi()
+    data = ffi_main.new('struct pull_history_steps[]', 4096)
+    moves, steps, end_clock = 0, 0, 0xffffffffffffffff
+    while 1:
+        count = ffi_lib.stepcompress_extract_old(sc, data, 4096, 0, end_clock)
+        moves += count
+        steps += sum([abs(data[i].step_count) for i in range(count)])
+        if count < 4096:
+            return moves, steps
+        end_clock = data[count-1].first_clock
+
+def count_steps(sc):
+    return count_history(sc)[1]
+
+class ExtruderStepGen(StepGen):
+    def __init__(self, moves, step_dist, opts, pressure_advance, taper=()):
+        self.moves = moves
+        self.pressure_advance = pressure_advance
+        self.taper = taper
+        StepGen.__init__(self, 1, step_dist, 1, opts)
+    def fill_trapq(self, opts):
+        return fill_trapq_extruder(self.ffi_lib, self.tq, self.moves, opts)
+    def alloc_sk(self, index, opts):
+        sk = self.ffi_lib.extruder_stepper_alloc()
+        if self.pressure_advance:
+            self.ffi_lib.extruder_set_pressure_advance(
+                sk, self.pressure_advance, opts.smooth_time)
+            self.gen_window = .5 * opts.smooth_time
+        if self.taper:
+            velocities, factors = zip(*self.taper)
+            self.ffi_lib.extruder_set_pressure_advance_taper(
+                sk, len(self.taper), velocities, factors)
+        return sk
+
+def bench_extruder(opts):
+    moves = load_gcode_moves(opts.gcode)
+    step_dist = opts.rotation_distance / (200. * opts.microsteps)
+    print("Extruder step generation of %s (%d moves, smooth_time=%.3f)"
+          % (opts.gcode, len(moves), opts.smooth_time))
+    print("%18s %6s %10s %12s %10s" % ("pressure_advance", "taper", "steps",
+                                       "time", "ns/step"))
+    tests = [(0., ()), (opts.pressure_advance, ())]
+    if opts.taper:
+        taper = [tuple(float(v) for v in band.split(':'))
+                 for band in opts.taper.split(',')]
+        tests.append((opts.pressure_advance, taper))
+    for pressure_advance, taper in tests:
+        best = steps = None
+        for i in range(opts.repeat):
+            sg = ExtruderStepGen(moves, step_dist, opts, pressure_advance,
+                                 taper)
+            start_time = time.time()
+            sg.run()
+            duration = time.time() - start_time
+            if best is None or duration < best:
+                best = duration
+            if steps is None:
+                steps = count_steps(sg.scs[0])
+            sg.close()
+        print("%18.4f %6d %10d %11.3fs %10.1f" % (
+            pressure_advance, len(taper), steps, best,
+            best * 1e9 / max(steps, 1)))
+
+######################################################################
+# Message queuing
+######################################################################
+
+MESSAGE_CHUNK = 1000
+
+# Generate irregular step times so that each queue_step command
+# covers only a couple of steps
+def gen_message_clocks(count, seed):
+    clock, clocks = 0, []
+    for i in range(count):
+        seed = (seed * 1103515245 + 12345) & 0x7fffffff
+        clock += 2000 + (seed >> 8) % 20000
+        clocks.append(clock)
+    return clocks
+
+# Time the queuing of queue_step commands through the steppersync and
+# serialqueue code (until the background thread has written them all)
+def bench_messages(opts):
+    ffi_main, ffi_lib = chelper.get_ffi()
+    num_steppers = opts.max_steppers
+    print("Message queuing of %d irregular steps (%d steppers)"
+          % (opts.messages, num_steppers))
+    print("%10s %10s %12s %12s %14s" % ("messages", "blocks", "wall time",
+                                        "msgs/sec", "msgs/cpu-sec"))
+    per_stepper = opts.messages // num_steppers
+    streams = [gen_message_clocks(per_stepper, i) for i in range(num_steppers)]
+    for i in range(opts.repeat):
+        devnull = open(os.devnull, 'wb')
+        sq = ffi_lib.serialqueue_alloc(devnull.fileno(), b'f', 0)
+        # All queued messages are immediately ready for transmission
+        ffi_lib.serialqueue_set_clock_est(sq, MCU_FREQ, ffi_lib.get_monotonic(),
+                                          1<<48, 0)
+        scs = []
+        for oid in range(num_steppers):
+            sc = ffi_main.gc(ffi_lib.stepcompress_alloc(oid),
+                             ffi_lib.stepcompress_free)
+            ffi_lib.stepcompress_fill(sc, int(MAX_ERROR * MCU_FREQ), 1, 2)
+            scs.append(sc)
+        ss = ffi_main.gc(ffi_lib.steppersync_alloc(sq, scs, len(scs), 64),
+                         ffi_lib.steppersync_free)
+        chunks = []
+        for pos in range(0, per_stepper, MESSAGE_CHUNK):
+            chunks.append([ffi_main.new("uint64_t[]",
+                                        stream[pos:pos+MESSAGE_CHUNK])
+                           for stream in streams])
+        stats = ffi_main.new('char[4096]')
+        start_time = time.time()
+        start_cpu = time.process_time()
+        for chunk in chunks:
+            for sc, clocks in zip(scs, chunk):
+                ret = ffi_lib.stepcompress_append_clocks(sc, 1, clocks,
+                                                          len(clocks))
+                if ret:
+                    raise Exception("Error during step compression")
+            last_clock = min([clocks[len(clocks)-1] for clocks in chunk])
+            ffi_lib.steppersync_flush(ss, last_clock, 0)
+        for sc in scs:
+            ffi_lib.stepcompress_reset(sc, 0)
+        ffi_lib.steppersync_flush(ss, 0xffffffffffffffff, 0)
+        while 1:
+            ffi_lib.serialqueue_get_stats(sq, stats, len(stats))
+            sstats = dict([p.split('=', 1) for p in
+                           ffi_main.string(stats).decode().split()])
+            if sstats['ready_bytes'] == sstats['upcoming_bytes'] == '0':
+                break
+            time.sleep(.001)
+        duration = time.time() - start_time
+        cpu = time.process_time() - start_cpu
+        ffi_lib.serialqueue_exit(sq)
+        ffi_lib.serialqueue_free(sq)
+        devnull.close()
+        del ss
+        messages = sum([count_history(sc)[0] for sc in scs])
+        print("%10d %10d %11.3fs %12.0f %14.0f" % (
+            messages, int(sstats['send_seq']) - 1, duration,
+            messages / duration, messages / cpu))
+
+######################################################################
+# Step compression replay
+######################################################################
+
+# Large negative values may be reported as unsigned in parsedump.py logs
+def int32(val):
+    return ((val + 0x80000000) & 0xffffffff) - 0x80000000
+
+# Extract the step clocks for each stepper from a parsedump.py log
+def load_step_streams(filename):
+    streams = {}
+    state = {}
+    for line in open(filename, 'r'):
+        parts = line.split()
+        if not parts or parts[0] not in ('queue_step', 'queue_step_add2',
+                                         'set_next_step_dir',
+                                         'reset_step_clock'):
+            continue
+        params = dict(p.split('=', 1) for p in parts[1:] if '=' in p)
+        oid = int(params['oid'])
+        if oid not in streams:
+            streams[oid] = {'runs': [], 'queue_steps': 0, 'steps': 0}
+            state[oid] = {'clock': 0, 'dir': 0}
+        st, stream = state[oid], streams[oid]
+        runs = stream['runs']
+        if parts[0] == 'reset_step_clock':
+            # Extend the 32bit mcu clock to 64bits
+            clock = int(params['clock'])
+            st['clock'] += (clock - st['clock']) & 0xffffffff
+            runs.append(('reset', st['clock'], []))
+        elif parts[0] == 'set_next_step_dir':
+            st['dir'] = int(params['dir'])
+        else:
+            interval = int(params['interval'])
+            count = int(params['count'])
+            add = int32(int(params['add']))
+            if not runs or runs[-1][0] != st['dir']:
+                runs.append((st['dir'], None, []))
+            clocks = runs[-1][2]
+            clock = st['clock']
+            if parts[0] == 'queue_step_add2':
+                # Fixed point (1/65536 tick) interval, add, and add2
+                add2 = int32(int(params['add2']))
+                pos = 0
+                for i in range(count):
+                    pos += interval
+                    clocks.append(clock + (pos >> 16))
+                    interval += add
+                    add += add2
+                clock = clocks[-1]
+            else:
+                for i in range(count):
+                    clock += interval
+                    clocks.append(clock)
+                    interval += add
+            st['clock'] = clock
+            stream['queue_steps'] += 1
+            stream['steps'] += count
+    return streams
+
+def replay_stream(oid, stream, max_error):
+    ffi_main, ffi_lib = chelper.get_ffi()
+    sc = ffi_main.gc(ffi_lib.stepcompress_alloc(oid),
+                     ffi_lib.stepcompress_free)
+    ffi_lib.stepcompress_fill(sc, max_error, 1, 2)
+    runs = [(sdir, reset_clock, ffi_main.new("uint64_t[]", clocks))
+            for sdir, reset_clock, clocks in stream['runs']]
+    start_time = time.time()
+    for sdir, reset_clock, clocks in runs:
+        if sdir == 'reset':
+            ret = ffi_lib.stepcompress_reset(sc, reset_clock)
+        else:
+            ret = ffi_lib.stepcompress_append_clocks(sc, sdir, clocks,
+                                                      len(clocks))
+        if ret:
+            raise Exception("Error during step compression")
+    ret = ffi_lib.stepcompress_reset(sc, 0)
+    if ret:
+        raise Exception("Error during step compression")
+    duration = time.time() - start_time
+    max_moves = stream['steps'] + len(runs) + 1
+    data = ffi_main.new('struct pull_history_steps[]', max_moves)
+    count = ffi_lib.stepcompress_extract_old(sc, data, max_moves,
+                                             0, 0xffffffffffffffff)
+    return duration, count
+
+def bench_replay(opts):
+    streams = load_step_streams(opts.replay)
+    max_error = int(MAX_ERROR * opts.mcu_freq)
+    print("Step compression replay of %s (max_error=%d ticks)"
+          % (opts.replay, max_error))
+    print("%4s %10s %12s %12s %10s" % ("oid", "steps", "recorded",
+                                       "queue_step", "ns/step"))
+    total_steps = total_moves = 0
+    total_time = 0.
+    for oid, stream in sorted(streams.items()):
+        steps = stream['steps']
+        if not steps:
+            continue
+        best = None
+        for i in range(opts.repeat):
+            duration, count = replay_stream(oid, stream, max_error)
+            if best is None or duration < best:
+                best = duration
+        print("%4d %10d %12d %12d %10.1f" % (oid, steps, stream['queue_steps'],
+                                             count, best * 1e9 / steps))
+        total_steps += steps
+        total_moves += count
+        total_time += best
+    if total_steps:
+        print("%4s %10d %12s %12d %10.1f" % ("all", total_steps, "",
+                                             total_moves,
+                                             total_time * 1e9 / total_steps))
+
+def main():
+    usage = "%prog [options]"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-t", "--threads", type="int", dest="threads", default=4,
+                    help="number of step generation threads")
+    opts.add_option("-n", "--steppers", type="int", dest="max_steppers",
+                    default=10, help="maximum number of steppers")
+    opts.add_option("-m", "--microsteps", type="int", dest="microsteps",
+                    default=16, help="stepper microsteps")
+    opts.add_option("--rotation-distance", type="float",
+                    dest="rotation_distance", default=40.,
+                    help="stepper rotation distance")
+    opts.add_option("-k", "--kinematics", type="choice", dest="kinematics",
+                    choices=["cartesian", "corexy"], default="cartesian",
+                    help="stepper kinematics")
+    opts.add_option("-v", "--velocity", type="float", dest="velocity",
+                    default=300., help="move velocity")
+    opts.add_option("-a", "--accel", type="float", dest="accel",
+                    default=5000., help="move acceleration")
+    opts.add_option("-j", "--jerk", type="float", dest="jerk", default=0.,
+                    help="queue jerk limited (S-curve) moves with the given"
+                    " jerk")
+    opts.add_option("-s", "--segment", type="float", dest="seg_len",
+                    default=5., help="move segment length")
+    opts.add_option("--replay", type="string", dest="replay",
+                    help="replay step times from a parsedump.py log through"
+                    " the step compression code")
+    opts.add_option("-f", "--mcu-freq", type="float", dest="mcu_freq",
+                    default=MCU_FREQ, help="mcu frequency of replayed log")
+    opts.add_option("-r", "--repeat", type="int", dest="repeat", default=5,
+                    help="number of times to repeat each replay")
+    opts.add_option("-i", "--input-shaper", action="store_true",
+                    dest="input_shaper", help="compare step generation time"
+                    " with and without input shaping on X/Y")
+    opts.add_option("--shaper-freq", type="float", dest="shaper_freq",
+                    default=50., help="input shaper frequency")
+    opts.add_option("-g", "--gcode", type="string", dest="gcode",
+                    help="generate the extruder steps for the moves of a"
+                    " sliced G-code file")
+    opts.add_option("--pressure-advance", type="float",
+                    dest="pressure_advance", default=.05,
+                    help="extruder pressure advance")
+    opts.add_option("--smooth-time", type="float", dest="smooth_time",
+                    default=.040, help="pressure advance smooth time")
+    opts.add_option("--pressure-advance-taper", type="string", dest="taper",
+                    default="", help="extruder pressure advance taper"
+                    " (velocity:factor,...)")
+    opts.add_option("-q", "--messages", type="int", dest="messages",
+                    default=0, help="time the queuing of the queue_step"
+                    " commands for the given number of irregular steps")
+    options, args = opts.parse_args()
+    if len(args) != 0:
+        opts.error("Incorrect number of arguments")
+    if options.replay is not None:
+        bench_replay(options)
+        return
+    if options.gcode is not None:
+        bench_extruder(options)
+        return
+    if options.messages:
+        bench_messages(options)
+        return
+    if options.input_shaper:
+        bench_shapers(options)
+        return
+    bench_threads(options)
+
+if __name__ == '__main__':
+    main()
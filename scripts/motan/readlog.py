@@ -57,7 +57,7 @@ class HandleTrapQ:
     def __init__(self, lmanager, name, name_parts):
         self.name = name
         self.jdispatch = lmanager.get_jdispatch()
-        self.cur_data = [(0., 0., 0., 0., (0., 0., 0.), (0., 0., 0.))]
+        self.cur_data = [(0., 0., 0., 0., (0., 0., 0.), (0., 0., 0.), 0.)]
         self.data_pos = 0
         tq, trapq_name, datasel = name_parts
         ptypes = {}
@@ -95,7 +95,7 @@ class HandleTrapQ:
         data_pos = self.data_pos
         while 1:
             move = self.cur_data[data_pos]
-            print_time, move_t, start_v, accel, start_pos, axes_r = move
+            print_time, move_t = move[:2]
             if req_time <= print_time + move_t:
                 return move, req_time >= print_time
             data_pos += 1
@@ -105,40 +105,71 @@ class HandleTrapQ:
             jmsg = self.jdispatch.pull_msg(req_time, self.name)
             if jmsg is None:
                 return move, False
-            self.cur_data = jmsg['data']
+            # Older logs do not contain the jerk field
+            self.cur_data = [m if len(m) > 6 else tuple(m) + (0.,)
+                             for m in jmsg['data']]
             self.data_pos = data_pos = 0
     def _pull_axis_position(self, req_time):
         move, in_range = self._find_move(req_time)
-        print_time, move_t, start_v, accel, start_pos, axes_r = move
+        print_time, move_t, start_v, accel, start_pos, axes_r, jerk = move
         mtime = max(0., min(move_t, req_time - print_time))
-        dist = (start_v + .5 * accel * mtime) * mtime;
+        dist = (start_v + (.5 * accel + jerk * mtime / 6.) * mtime) * mtime
         return start_pos[self.axis] + axes_r[self.axis] * dist
     def _pull_axis_velocity(self, req_time):
         move, in_range = self._find_move(req_time)
         if not in_range:
             return 0.
-        print_time, move_t, start_v, accel, start_pos, axes_r = move
-        return (start_v + accel * (req_time - print_time)) * axes_r[self.axis]
+        print_time, move_t, start_v, accel, start_pos, axes_r, jerk = move
+        mtime = req_time - print_time
+        velocity = start_v + (accel + .5 * jerk * mtime) * mtime
+        return velocity * axes_r[self.axis]
     def _pull_axis_accel(self, req_time):
         move, in_range = self._find_move(req_time)
         if not in_range:
             return 0.
-        print_time, move_t, start_v, accel, start_pos, axes_r = move
-        return accel * axes_r[self.axis]
+        print_time, move_t, start_v, accel, start_pos, axes_r, jerk = move
+        return (accel + jerk * (req_time - print_time)) * axes_r[self.axis]
     def _pull_velocity(self, req_time):
         move, in_range = self._find_move(req_time)
         if not in_range:
             return 0.
-        print_time, move_t, start_v, accel, start_pos, axes_r = move
-        return start_v + accel * (req_time - print_time)
+        print_time, move_t, start_v, accel, start_pos, axes_r, jerk = move
+        mtime = req_time - print_time
+        return start_v + (accel + .5 * jerk * mtime) * mtime
     def _pull_accel(self, req_time):
         move, in_range = self._find_move(req_time)
         if not in_range:
             return 0.
-        print_time, move_t, start_v, accel, start_pos, axes_r = move
-        return accel
+        print_time, move_t, start_v, accel, start_pos, axes_r, jerk = move
+        return accel + jerk * (req_time - print_time)
 LogHandlers["trapq"] = HandleTrapQ
 
+# Generate (step_clock, direction) for each step in a dump_stepper block
+def iter_steps(first_clock, data):
+    first = data[0]
+    if len(first) > 3 and first[3]:
+        step_clock = first_clock - (first[0] >> 16)
+    else:
+        step_clock = first_clock - first[0]
+    for qs in data:
+        interval, raw_count, add = qs[:3]
+        add2 = qs[3] if len(qs) > 3 else 0
+        sdir = -1 if raw_count < 0 else 1
+        if not add2:
+            for i in range(abs(raw_count)):
+                step_clock += interval
+                interval += add
+                yield step_clock, sdir
+            continue
+        # queue_step_add2 values are in units of 1/65536th of a tick
+        pos = 0
+        for i in range(abs(raw_count)):
+            pos += interval
+            interval += add
+            add += add2
+            yield step_clock + (pos >> 16), sdir
+        step_clock += pos >> 16
+
 # Extract positions from queue_step log
 class HandleStepQ:
     SubscriptionIdParts = 2
@@ -209,7 +240,6 @@ class HandleStepQ:
         # Process block into (time, half_position, position) 3-tuples
         first_time = step_time = jmsg['first_step_time']
         first_clock = jmsg['first_clock']
-        step_clock = first_clock - jmsg['data'][0][0]
         cdiff = jmsg['last_clock'] - first_clock
         tdiff = last_time - first_time
         inv_freq = 0.
@@ -219,19 +249,12 @@ class HandleStepQ:
         step_pos = jmsg['start_position']
         if not step_data[0][0]:
             step_data[0] = (0., step_pos, step_pos)
-        for interval, raw_count, add in jmsg['data']:
-            qs_dist = step_dist
-            count = raw_count
-            if count < 0:
-                qs_dist = -qs_dist
-                count = -count
-            for i in range(count):
-                step_clock += interval
-                interval += add
-                step_time = first_time + (step_clock - first_clock) * inv_freq
-                step_halfpos = step_pos + .5 * qs_dist
-                step_pos += qs_dist
-                step_data.append((step_time, step_halfpos, step_pos))
+        for step_clock, sdir in iter_steps(first_clock, jmsg['data']):
+            qs_dist = sdir * step_dist
+            step_time = first_time + (step_clock - first_clock) * inv_freq
+            step_halfpos = step_pos + .5 * qs_dist
+            step_pos += qs_dist
+            step_data.append((step_time, step_halfpos, step_pos))
 LogHandlers["stepq"] = HandleStepQ
 
 # Extract stepper motor phase position
@@ -311,7 +334,6 @@ class HandleStepPhase:
         # Process block into (time, position) 2-tuples
         first_time = step_time = jmsg['first_step_time']
         first_clock = jmsg['first_clock']
-        step_clock = first_clock - jmsg['data'][0][0]
         cdiff = jmsg['last_clock'] - first_clock
         tdiff = last_time - first_time
         inv_freq = 0.
@@ -320,18 +342,10 @@ class HandleStepPhase:
         step_pos = jmsg['start_mcu_position']
         if not step_data[0][0]:
             step_data[0] = (0., step_pos)
-        for interval, raw_count, add in jmsg['data']:
-            qs_dist = 1
-            count = raw_count
-            if count < 0:
-                qs_dist = -1
-                count = -count
-            for i in range(count):
-                step_clock += interval
-                interval += add
-                step_time = first_time + (step_clock - first_clock) * inv_freq
-                step_pos += qs_dist
-                step_data.append((step_time, step_pos))
+        for step_clock, sdir in iter_steps(first_clock, jmsg['data']):
+            step_time = first_time + (step_clock - first_clock) * inv_freq
+            step_pos += sdir
+            step_data.append((step_time, step_pos))
 LogHandlers["step_phase"] = HandleStepPhase
 
 # Extract accelerometer data
@@ -5,6 +5,7 @@
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
 #include <string.h> // memset
+#include "autoconf.h" // CONFIG_WANT_SACK
 #include "basecmd.h" // oid_lookup
 #include "board/irq.h" // irq_save
 #include "board/misc.h" // alloc_maxsize
@@ -355,6 +356,9 @@ command_identify(uint32_t *args)
 {
     uint32_t offset = args[0];
     uint8_t count = args[1];
+    if (CONFIG_WANT_SACK && !offset)
+        // New host session
+        command_reset_sack();
     uint32_t isize = READP(command_identify_size);
     if (offset >= isize)
         count = 0;
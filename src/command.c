@@ -6,6 +6,7 @@
 
 #include <stdarg.h> // va_start
 #include <string.h> // memcpy
+#include "autoconf.h" // CONFIG_WANT_SACK
 #include "board/io.h" // readb
 #include "board/irq.h" // irq_poll
 #include "board/misc.h" // crc16_ccitt
@@ -27,7 +28,7 @@ void *
 command_decode_ptr(uint32_t v)
 {
     if (sizeof(size_t) > sizeof(uint32_t))
-        return console_receive_buffer() + v;
+        return console_receive_buffer() + (int32_t)v;
     return (void*)(size_t)v;
 }
 
@@ -239,6 +240,101 @@ const struct command_encoder encode_acknak PROGMEM = {
     .max_size = MESSAGE_MIN,
 };
 
+
+/****************************************************************
+ * Selective acknowledgment
+ ****************************************************************/
+
+#if CONFIG_WANT_SACK
+
+// Once enabled by the host, message blocks that arrive after a lost
+// block are stored (instead of discarded) and reported to the host in
+// a "sack" message.  The host then only needs to retransmit the lost
+// blocks.  Bit N of the mask is set if block next_sequence+N is stored.
+//
+// Only blocks up to SACK_BLOCKS-1 ahead are stored.  A retransmitted
+// block may be up to MAX_PENDING_BLOCKS (in the host's
+// klippy/chelper/serialqueue.c) behind next_sequence, so
+// SACK_BLOCKS-1 + MAX_PENDING_BLOCKS must be less than 16 (the range
+// of the sequence number) or a stale block could be stored as a
+// future one.  The buffers are indexed by sequence number, so
+// SACK_BLOCKS must be a power of two.
+#define SACK_BLOCKS 4
+
+static struct {
+    uint8_t enabled, mask;
+    uint8_t blocks[SACK_BLOCKS][MESSAGE_MAX];
+} sack;
+
+void
+command_enable_sack(uint32_t *args)
+{
+    sack.enabled = 1;
+}
+DECL_COMMAND_FLAGS(command_enable_sack, HF_IN_SHUTDOWN, "enable_sack");
+
+// Disable selective acknowledgment (on start of a new host session)
+void
+command_reset_sack(void)
+{
+    sack.enabled = sack.mask = 0;
+}
+
+// Store an out of order message block and report the stored blocks
+// to the host (returns 0 if a regular nak should be sent instead)
+static int
+sack_store(uint8_t *buf, uint_fast8_t msglen, uint_fast8_t msgseq)
+{
+    if (!sack.enabled)
+        return 0;
+    uint_fast8_t delta = (msgseq - next_sequence) & MESSAGE_SEQ_MASK;
+    if (delta < SACK_BLOCKS && !(sack.mask & (1 << delta))) {
+        memcpy(sack.blocks[msgseq % SACK_BLOCKS], buf, msglen);
+        sack.mask |= 1 << delta;
+    }
+    if (!sack.mask)
+        return 0;
+    sendf("sack mask=%c", sack.mask);
+    return 1;
+}
+
+// Note that the next message block was received
+static void
+sack_advance(void)
+{
+    sack.mask >>= 1;
+}
+
+// Dispatch stored blocks that are now in sequence
+static void
+sack_dispatch(void)
+{
+    while (sack.mask & 1) {
+        uint8_t *buf = sack.blocks[next_sequence % SACK_BLOCKS];
+        uint_fast8_t seq = next_sequence + 1;
+        next_sequence = (seq & MESSAGE_SEQ_MASK) | MESSAGE_DEST;
+        sack.mask >>= 1;
+        command_dispatch(buf, buf[MESSAGE_POS_LEN]);
+    }
+}
+
+#else
+
+static int
+sack_store(uint8_t *buf, uint_fast8_t msglen, uint_fast8_t msgseq)
+{
+    return 0;
+}
+static void sack_advance(void) { }
+static void sack_dispatch(void) { }
+
+#endif
+
+
+/****************************************************************
+ * Message block framing
+ ****************************************************************/
+
 enum { CF_NEED_SYNC=1<<0, CF_NEED_VALID=1<<1 };
 
 // Find the next complete message block
@@ -269,10 +365,13 @@ command_find_block(uint8_t *buf, uint_fast8_t buf_len, uint_fast8_t *pop_count)
     *pop_count = msglen;
     // Check sequence number
     if (msgseq != next_sequence) {
-        // Lost message - discard messages until it is retransmitted
+        // Lost message - store or discard messages until it is retransmitted
+        if (sack_store(buf, msglen, msgseq))
+            return -1;
         goto nak;
     }
     next_sequence = ((msgseq + 1) & MESSAGE_SEQ_MASK) | MESSAGE_DEST;
+    sack_advance();
     return 1;
 
 need_more_data:
@@ -327,6 +426,7 @@ command_dispatch(uint8_t *buf, uint_fast8_t msglen)
 void
 command_send_ack(void)
 {
+    sack_dispatch();
     command_sendf(&encode_acknak);
 }
 
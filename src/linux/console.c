@@ -11,7 +11,11 @@
 #include <pty.h> // openpty
 #include <stdio.h> // fprintf
 #include <string.h> // memmove
+#include <sys/eventfd.h> // eventfd
+#include <sys/mman.h> // memfd_create
+#include <sys/socket.h> // sendmsg
 #include <sys/stat.h> // chmod
+#include <sys/un.h> // struct sockaddr_un
 #include <time.h> // struct timespec
 #include <unistd.h> // ttyname
 #include "board/irq.h" // irq_wait
@@ -20,8 +24,9 @@
 #include "internal.h" // console_setup
 #include "sched.h" // sched_wake_task
 
-static struct pollfd main_pfd[1];
-#define MP_TTY_IDX   0
+static struct pollfd main_pfd[2];
+#define MP_TTY_IDX    0
+#define MP_LISTEN_IDX 1
 
 // Report 'errno' in a message written to stderr
 void
@@ -85,6 +90,7 @@ console_setup(char *name)
         return -1;
     main_pfd[MP_TTY_IDX].fd = mfd;
     main_pfd[MP_TTY_IDX].events = POLLIN;
+    main_pfd[MP_LISTEN_IDX].fd = -1;
 
     // Create symlink to tty
     unlink(name);
@@ -113,6 +119,237 @@ console_setup(char *name)
 }
 
 
+/****************************************************************
+ * Shared memory console
+ ****************************************************************/
+
+// When started with "-S" the console is a shared memory region
+// (with a ring buffer in each direction) instead of a pseudo-tty.
+// The host connects to a unix domain socket and is sent the shared
+// memory fd along with an eventfd for each direction (used to wake
+// the receiver after data is added to a ring).  This layout must
+// match the one in klippy/chelper/sqtransport.c.
+
+#define SHM_CONSOLE_MAGIC 0x4d48534b // "KSHM"
+#define SHM_RING_SIZE 16384
+
+struct shm_ring {
+    uint32_t head; // updated by the producer
+    uint8_t pad1[60];
+    uint32_t tail; // updated by the consumer
+    uint8_t pad2[60];
+    uint8_t data[SHM_RING_SIZE];
+};
+
+struct shm_console {
+    uint32_t magic, size;
+    uint8_t pad[56];
+    struct shm_ring to_mcu, to_host;
+};
+
+static struct shm_console *shm;
+static int shm_wake_host_fd = -1, shm_conn_fd = -1, shm_accept_pending;
+
+int
+console_setup_shm(char *name)
+{
+    int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (lfd < 0) {
+        report_errno("socket", lfd);
+        return -1;
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(name) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", name);
+        goto fail;
+    }
+    strcpy(addr.sun_path, name);
+    unlink(name);
+    int ret = bind(lfd, (struct sockaddr*)&addr, sizeof(addr));
+    if (ret) {
+        report_errno("bind", ret);
+        goto fail;
+    }
+    ret = chmod(name, 0660);
+    if (ret) {
+        report_errno("chmod", ret);
+        goto fail;
+    }
+    ret = listen(lfd, 1);
+    if (ret) {
+        report_errno("listen", ret);
+        goto fail;
+    }
+
+    // Make sure stderr is non-blocking
+    ret = set_non_blocking(STDERR_FILENO);
+    if (ret)
+        goto fail;
+
+    main_pfd[MP_TTY_IDX].fd = -1;
+    main_pfd[MP_TTY_IDX].events = POLLIN;
+    main_pfd[MP_LISTEN_IDX].fd = lfd;
+    main_pfd[MP_LISTEN_IDX].events = POLLIN;
+    return 0;
+
+fail:
+    close(lfd);
+    return -1;
+}
+
+// Send a new shared memory region to a host that has connected
+static void
+shm_accept(void)
+{
+    int cfd = accept4(main_pfd[MP_LISTEN_IDX].fd, NULL, NULL, SOCK_CLOEXEC);
+    if (cfd < 0) {
+        if (errno != EWOULDBLOCK)
+            report_errno("accept", cfd);
+        return;
+    }
+    int mfd = memfd_create("klipper_console", MFD_CLOEXEC);
+    if (mfd < 0) {
+        report_errno("memfd_create", mfd);
+        goto fail;
+    }
+    int ret = ftruncate(mfd, sizeof(*shm));
+    if (ret) {
+        report_errno("ftruncate", ret);
+        goto fail;
+    }
+    struct shm_console *new_shm = mmap(NULL, sizeof(*shm)
+                                       , PROT_READ | PROT_WRITE, MAP_SHARED
+                                       , mfd, 0);
+    if (new_shm == MAP_FAILED) {
+        report_errno("mmap", -1);
+        goto fail;
+    }
+    new_shm->magic = SHM_CONSOLE_MAGIC;
+    new_shm->size = sizeof(*shm);
+    int wake_mcu_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    int wake_host_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_mcu_fd < 0 || wake_host_fd < 0) {
+        report_errno("eventfd", -1);
+        goto fail_fds;
+    }
+
+    // Send region and wakeup fds to host
+    int fds[3] = { mfd, wake_mcu_fd, wake_host_fd };
+    uint8_t dummy = 0;
+    struct iovec iov = { .iov_base = &dummy, .iov_len = sizeof(dummy) };
+    union {
+        struct cmsghdr align;
+        uint8_t buf[CMSG_SPACE(sizeof(fds))];
+    } cbuf;
+    memset(&cbuf, 0, sizeof(cbuf));
+    struct msghdr mh = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = cbuf.buf, .msg_controllen = sizeof(cbuf.buf),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    ret = sendmsg(cfd, &mh, MSG_NOSIGNAL);
+    if (ret < 0) {
+        report_errno("sendmsg", ret);
+        goto fail_fds;
+    }
+    close(mfd);
+
+    // Replace any previous connection.  The socket is kept open so
+    // that the host is notified (via EOF) if this process exits.
+    if (shm) {
+        munmap(shm, sizeof(*shm));
+        close(main_pfd[MP_TTY_IDX].fd);
+        close(shm_wake_host_fd);
+        close(shm_conn_fd);
+    }
+    shm = new_shm;
+    shm_wake_host_fd = wake_host_fd;
+    shm_conn_fd = cfd;
+    main_pfd[MP_TTY_IDX].fd = wake_mcu_fd;
+    return;
+
+fail_fds:
+    if (wake_mcu_fd >= 0)
+        close(wake_mcu_fd);
+    if (wake_host_fd >= 0)
+        close(wake_host_fd);
+    munmap(new_shm, sizeof(*shm));
+fail:
+    if (mfd >= 0)
+        close(mfd);
+    close(cfd);
+}
+
+// Copy available data out of a ring buffer
+static int
+shm_ring_read(struct shm_ring *r, uint8_t *buf, int len)
+{
+    uint32_t tail = r->tail, head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    uint32_t avail = head - tail;
+    if (avail > len)
+        avail = len;
+    uint32_t pos = tail % SHM_RING_SIZE, first = SHM_RING_SIZE - pos;
+    if (first > avail)
+        first = avail;
+    memcpy(buf, &r->data[pos], first);
+    memcpy(&buf[first], r->data, avail - first);
+    __atomic_store_n(&r->tail, tail + avail, __ATOMIC_RELEASE);
+    return avail;
+}
+
+// Add data to a ring buffer (if there is space for all of it)
+static int
+shm_ring_write(struct shm_ring *r, uint8_t *buf, int len)
+{
+    uint32_t head = r->head, tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (SHM_RING_SIZE - (head - tail) < len)
+        return -1;
+    uint32_t pos = head % SHM_RING_SIZE, first = SHM_RING_SIZE - pos;
+    if (first > len)
+        first = len;
+    memcpy(&r->data[pos], buf, first);
+    memcpy(r->data, &buf[first], len - first);
+    __atomic_store_n(&r->head, head + len, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Read data sent by the host
+static int
+shm_read(uint8_t *buf, int len)
+{
+    int ret = shm_ring_read(&shm->to_mcu, buf, len);
+    if (ret)
+        return ret;
+    // Ring is empty - clear the wakeup and then check again
+    uint64_t val;
+    ret = read(main_pfd[MP_TTY_IDX].fd, &val, sizeof(val));
+    if (ret < 0 && errno != EWOULDBLOCK)
+        report_errno("eventfd read", ret);
+    return shm_ring_read(&shm->to_mcu, buf, len);
+}
+
+// Send data to the host
+static void
+shm_write(uint8_t *buf, int len)
+{
+    int ret = shm_ring_write(&shm->to_host, buf, len);
+    if (ret) {
+        fprintf(stderr, "shm console ring full\n");
+        return;
+    }
+    uint64_t val = 1;
+    ret = write(shm_wake_host_fd, &val, sizeof(val));
+    if (ret < 0)
+        report_errno("eventfd write", ret);
+}
+
+
 /****************************************************************
  * Console handling
  ****************************************************************/
@@ -133,10 +370,22 @@ console_task(void)
 {
     if (!sched_check_wake(&console_wake))
         return;
+    if (shm_accept_pending) {
+        shm_accept_pending = 0;
+        shm_accept();
+    }
 
     // Read data
-    int ret = read(main_pfd[MP_TTY_IDX].fd, &receive_buf[receive_pos]
+    int ret;
+    if (main_pfd[MP_LISTEN_IDX].fd >= 0) {
+        if (!shm)
+            return;
+        ret = shm_read(&receive_buf[receive_pos]
+                       , sizeof(receive_buf) - receive_pos);
+    } else {
+        ret = read(main_pfd[MP_TTY_IDX].fd, &receive_buf[receive_pos]
                    , sizeof(receive_buf) - receive_pos);
+    }
     if (ret < 0) {
         if (errno == EWOULDBLOCK) {
             ret = 0;
@@ -173,6 +422,11 @@ console_sendf(const struct command_encoder *ce, va_list args)
     uint_fast8_t msglen = command_encode_and_frame(buf, ce, args);
 
     // Transmit message
+    if (main_pfd[MP_LISTEN_IDX].fd >= 0) {
+        if (shm)
+            shm_write(buf, msglen);
+        return;
+    }
     int ret = write(main_pfd[MP_TTY_IDX].fd, buf, msglen);
     if (ret < 0)
         report_errno("write", ret);
@@ -190,4 +444,8 @@ console_sleep(sigset_t *sigset)
     }
     if (main_pfd[MP_TTY_IDX].revents)
         sched_wake_task(&console_wake);
+    if (main_pfd[MP_LISTEN_IDX].revents) {
+        shm_accept_pending = 1;
+        sched_wake_task(&console_wake);
+    }
 }
@@ -19,6 +19,7 @@ void report_errno(char *where, int rc);
 int set_non_blocking(int fd);
 int set_close_on_exec(int fd);
 int console_setup(char *name);
+int console_setup_shm(char *name);
 void console_sleep(sigset_t *sigset);
 
 // timer.c
@@ -68,9 +68,9 @@ main(int argc, char **argv)
 {
     // Parse program args
     orig_argv = argv;
-    int opt, watchdog = 0, realtime = 0;
+    int opt, watchdog = 0, realtime = 0, shm = 0;
     char *serial = "/tmp/klipper_host_mcu";
-    while ((opt = getopt(argc, argv, "wrI:")) != -1) {
+    while ((opt = getopt(argc, argv, "wrSI:")) != -1) {
         switch (opt) {
         case 'w':
             watchdog = 1;
@@ -78,11 +78,14 @@ main(int argc, char **argv)
         case 'r':
             realtime = 1;
             break;
+        case 'S':
+            shm = 1;
+            break;
         case 'I':
             serial = optarg;
             break;
         default:
-            fprintf(stderr, "Usage: %s [-w] [-r] [-I path]\n", argv[0]);
+            fprintf(stderr, "Usage: %s [-w] [-r] [-S] [-I path]\n", argv[0]);
             return -1;
         }
     }
@@ -93,7 +96,7 @@ main(int argc, char **argv)
         if (ret)
             return ret;
     }
-    int ret = console_setup(serial);
+    int ret = shm ? console_setup_shm(serial) : console_setup(serial);
     if (ret)
         return -1;
     if (watchdog) {
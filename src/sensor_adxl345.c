@@ -10,12 +10,14 @@
 #include "basecmd.h" // oid_alloc
 #include "command.h" // DECL_COMMAND
 #include "sched.h" // DECL_TASK
+#include "sensor_bulk.h" // sensor_compress_sample
 #include "spicmds.h" // spidev_transfer
 
 struct adxl345 {
     struct timer timer;
     uint32_t rest_ticks;
     struct spidev_s *spi;
+    struct sensor_compress compress;
     uint16_t sequence, limit_count;
     uint8_t flags, data_count;
     uint8_t data[50];
@@ -47,6 +49,14 @@ command_config_adxl345(uint32_t *args)
 }
 DECL_COMMAND(command_config_adxl345, "config_adxl345 oid=%c spi_oid=%c");
 
+void
+command_config_adxl345_compress(uint32_t *args)
+{
+    struct adxl345 *ax = oid_lookup(args[0], command_config_adxl345);
+    ax->compress.enabled = 1;
+}
+DECL_COMMAND(command_config_adxl345_compress, "config_adxl345_compress oid=%c");
+
 // Report local measurement buffer
 static void
 adxl_report(struct adxl345 *ax, uint8_t oid)
@@ -54,7 +64,13 @@ adxl_report(struct adxl345 *ax, uint8_t oid)
     sendf("adxl345_data oid=%c sequence=%hu data=%*s"
           , oid, ax->sequence, ax->data_count, ax->data);
     ax->data_count = 0;
-    ax->sequence++;
+    if (ax->compress.enabled) {
+        // In compressed mode the sequence counts samples
+        ax->sequence += ax->compress.count;
+        sensor_compress_reset(&ax->compress);
+    } else {
+        ax->sequence++;
+    }
 }
 
 // Report buffer and fifo status
@@ -65,7 +81,8 @@ adxl_status(struct adxl345 *ax, uint_fast8_t oid
     sendf("adxl345_status oid=%c clock=%u query_ticks=%u next_sequence=%hu"
           " buffered=%c fifo=%c limit_count=%hu"
           , oid, time1, time2-time1, ax->sequence
-          , ax->data_count, fifo, ax->limit_count);
+          , ax->compress.enabled ? ax->compress.count : ax->data_count
+          , fifo, ax->limit_count);
 }
 
 // Helper code to reschedule the adxl345_event() timer
@@ -97,24 +114,37 @@ adxl_query(struct adxl345 *ax, uint8_t oid)
     // Extract x, y, z measurements
     uint_fast8_t fifo_status = msg[8] & ~0x80; // Ignore trigger bit
     uint8_t *d = &ax->data[ax->data_count];
-    if (((msg[2] & 0xf0) && (msg[2] & 0xf0) != 0xf0)
-        || ((msg[4] & 0xf0) && (msg[4] & 0xf0) != 0xf0)
-        || ((msg[6] & 0xf0) && (msg[6] & 0xf0) != 0xf0)
-        || (msg[7] != SET_FIFO_CTL) || (fifo_status > 32)) {
+    int is_error = (((msg[2] & 0xf0) && (msg[2] & 0xf0) != 0xf0)
+                    || ((msg[4] & 0xf0) && (msg[4] & 0xf0) != 0xf0)
+                    || ((msg[6] & 0xf0) && (msg[6] & 0xf0) != 0xf0)
+                    || (msg[7] != SET_FIFO_CTL) || (fifo_status > 32));
+    if (is_error)
         // Data error - may be a CS, MISO, MOSI, or SCLK glitch
-        d[0] = d[1] = d[2] = d[3] = d[4] = 0xff;
         fifo_status = 0;
+    if (ax->compress.enabled) {
+        if (is_error)
+            ax->data_count += sensor_compress_error(&ax->compress, d);
+        else
+            ax->data_count += sensor_compress_sample(
+                &ax->compress, d, msg[1] | (msg[2] << 8)
+                , msg[3] | (msg[4] << 8), msg[5] | (msg[6] << 8));
+        if (ax->data_count + SENSOR_COMPRESS_MAX > ARRAY_SIZE(ax->data))
+            adxl_report(ax, oid);
     } else {
-        // Copy data
-        d[0] = msg[1]; // x low bits
-        d[1] = msg[3]; // y low bits
-        d[2] = msg[5]; // z low bits
-        d[3] = (msg[2] & 0x1f) | (msg[6] << 5); // x high bits and z high bits
-        d[4] = (msg[4] & 0x1f) | ((msg[6] << 2) & 0x60); // y high and z high
+        if (is_error) {
+            d[0] = d[1] = d[2] = d[3] = d[4] = 0xff;
+        } else {
+            // Copy data
+            d[0] = msg[1]; // x low bits
+            d[1] = msg[3]; // y low bits
+            d[2] = msg[5]; // z low bits
+            d[3] = (msg[2] & 0x1f) | (msg[6] << 5); // x high and z high bits
+            d[4] = (msg[4] & 0x1f) | ((msg[6] << 2) & 0x60); // y high, z high
+        }
+        ax->data_count += 5;
+        if (ax->data_count + 5 > ARRAY_SIZE(ax->data))
+            adxl_report(ax, oid);
     }
-    ax->data_count += 5;
-    if (ax->data_count + 5 > ARRAY_SIZE(ax->data))
-        adxl_report(ax, oid);
     // Check fifo status
     if (fifo_status >= 31)
         ax->limit_count++;
@@ -186,6 +216,7 @@ command_query_adxl345(uint32_t *args)
     ax->flags = AX_HAVE_START;
     ax->sequence = ax->limit_count = 0;
     ax->data_count = 0;
+    sensor_compress_reset(&ax->compress);
     sched_add_timer(&ax->timer);
 }
 DECL_COMMAND(command_query_adxl345,
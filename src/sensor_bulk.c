@@ -0,0 +1,69 @@
+// Helper code for compressing bulk sensor measurements
+//
+// Copyright (C) 2026  agent <agent@local>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include "sensor_bulk.h" // sensor_compress_sample
+
+// Each three axis sample is stored as the difference from the
+// previous sample in the same message (the first sample of a message
+// is relative to zero).  Each difference is "zigzag" encoded (so
+// that small negative values are small positive values) and then
+// stored as a variable length integer (7 bits per byte with the high
+// bit set on all but the last byte).  The x axis difference is
+// shifted left by one bit - a value of 1 in place of the x axis
+// indicates a sample that could not be read (and no y or z values
+// follow).
+
+// Reset the compression state at the start of a new message
+void
+sensor_compress_reset(struct sensor_compress *sc)
+{
+    sc->last[0] = sc->last[1] = sc->last[2] = 0;
+    sc->count = 0;
+}
+
+// Store a variable length integer
+static uint8_t *
+encode_vlq(uint8_t *p, uint32_t v)
+{
+    while (v >= 0x80) {
+        *p++ = v | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+// Return the zigzag encoding of the difference between two samples
+static uint32_t
+zigzag(int16_t val, int16_t last)
+{
+    int32_t diff = (int32_t)val - last;
+    return ((uint32_t)diff << 1) ^ (uint32_t)(diff >> 31);
+}
+
+// Compress a sample into 'buf' (returns the number of bytes written)
+uint_fast8_t
+sensor_compress_sample(struct sensor_compress *sc, uint8_t *buf
+                       , int16_t x, int16_t y, int16_t z)
+{
+    uint8_t *p = encode_vlq(buf, zigzag(x, sc->last[0]) << 1);
+    p = encode_vlq(p, zigzag(y, sc->last[1]));
+    p = encode_vlq(p, zigzag(z, sc->last[2]));
+    sc->last[0] = x;
+    sc->last[1] = y;
+    sc->last[2] = z;
+    sc->count++;
+    return p - buf;
+}
+
+// Note a sample that could not be read (returns bytes written)
+uint_fast8_t
+sensor_compress_error(struct sensor_compress *sc, uint8_t *buf)
+{
+    buf[0] = 1;
+    sc->count++;
+    return 1;
+}
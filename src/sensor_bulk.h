@@ -0,0 +1,19 @@
+#ifndef __SENSOR_BULK_H
+#define __SENSOR_BULK_H
+
+#include <stdint.h> // int16_t
+
+struct sensor_compress {
+    int16_t last[3];
+    uint8_t enabled, count;
+};
+
+// Maximum number of bytes needed to store a compressed sample
+#define SENSOR_COMPRESS_MAX 9
+
+void sensor_compress_reset(struct sensor_compress *sc);
+uint_fast8_t sensor_compress_sample(struct sensor_compress *sc, uint8_t *buf
+                                    , int16_t x, int16_t y, int16_t z);
+uint_fast8_t sensor_compress_error(struct sensor_compress *sc, uint8_t *buf);
+
+#endif // sensor_bulk.h
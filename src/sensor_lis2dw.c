@@ -11,6 +11,7 @@
 #include "basecmd.h" // oid_alloc
 #include "command.h" // DECL_COMMAND
 #include "sched.h" // DECL_TASK
+#include "sensor_bulk.h" // sensor_compress_sample
 #include "spicmds.h" // spidev_transfer
 
 #define LIS_AR_DATAX0 0x28
@@ -22,6 +23,7 @@ struct lis2dw {
     struct timer timer;
     uint32_t rest_ticks;
     struct spidev_s *spi;
+    struct sensor_compress compress;
     uint16_t sequence, limit_count;
     uint8_t flags, data_count, fifo_disable;
     uint8_t data[48];
@@ -53,6 +55,14 @@ command_config_lis2dw(uint32_t *args)
 }
 DECL_COMMAND(command_config_lis2dw, "config_lis2dw oid=%c spi_oid=%c");
 
+void
+command_config_lis2dw_compress(uint32_t *args)
+{
+    struct lis2dw *ax = oid_lookup(args[0], command_config_lis2dw);
+    ax->compress.enabled = 1;
+}
+DECL_COMMAND(command_config_lis2dw_compress, "config_lis2dw_compress oid=%c");
+
 // Report local measurement buffer
 static void
 lis2dw_report(struct lis2dw *ax, uint8_t oid)
@@ -60,7 +70,13 @@ lis2dw_report(struct lis2dw *ax, uint8_t oid)
     sendf("lis2dw_data oid=%c sequence=%hu data=%*s"
           , oid, ax->sequence, ax->data_count, ax->data);
     ax->data_count = 0;
-    ax->sequence++;
+    if (ax->compress.enabled) {
+        // In compressed mode the sequence counts samples
+        ax->sequence += ax->compress.count;
+        sensor_compress_reset(&ax->compress);
+    } else {
+        ax->sequence++;
+    }
 }
 
 // Report buffer and fifo status
@@ -71,7 +87,8 @@ lis2dw_status(struct lis2dw *ax, uint_fast8_t oid
     sendf("lis2dw_status oid=%c clock=%u query_ticks=%u next_sequence=%hu"
           " buffered=%c fifo=%c limit_count=%hu"
           , oid, time1, time2-time1, ax->sequence
-          , ax->data_count, fifo, ax->limit_count);
+          , ax->compress.enabled ? ax->compress.count : ax->data_count
+          , fifo, ax->limit_count);
 }
 
 // Helper code to reschedule the lis2dw_event() timer
@@ -101,16 +118,24 @@ lis2dw_query(struct lis2dw *ax, uint8_t oid)
     fifo_empty = fifo[1]&0x3F;
     fifo_ovrn = fifo[1]&0x40;
 
-    d[0] = msg[1]; // x low bits
-    d[1] = msg[2]; // x high bits
-    d[2] = msg[3]; // y low bits
-    d[3] = msg[4]; // y high bits
-    d[4] = msg[5]; // z low bits
-    d[5] = msg[6]; // z high bits
-
-    ax->data_count += 6;
-    if (ax->data_count + 6 > ARRAY_SIZE(ax->data))
-        lis2dw_report(ax, oid);
+    if (ax->compress.enabled) {
+        ax->data_count += sensor_compress_sample(
+            &ax->compress, d, msg[1] | (msg[2] << 8)
+            , msg[3] | (msg[4] << 8), msg[5] | (msg[6] << 8));
+        if (ax->data_count + SENSOR_COMPRESS_MAX > ARRAY_SIZE(ax->data))
+            lis2dw_report(ax, oid);
+    } else {
+        d[0] = msg[1]; // x low bits
+        d[1] = msg[2]; // x high bits
+        d[2] = msg[3]; // y low bits
+        d[3] = msg[4]; // y high bits
+        d[4] = msg[5]; // z low bits
+        d[5] = msg[6]; // z high bits
+
+        ax->data_count += 6;
+        if (ax->data_count + 6 > ARRAY_SIZE(ax->data))
+            lis2dw_report(ax, oid);
+    }
 
     // Check fifo status
     if (fifo_ovrn)
@@ -184,6 +209,7 @@ command_query_lis2dw(uint32_t *args)
     ax->sequence = ax->limit_count = 0;
     ax->data_count = 0;
     ax->fifo_disable = 0;
+    sensor_compress_reset(&ax->compress);
     sched_add_timer(&ax->timer);
 }
 DECL_COMMAND(command_query_lis2dw,
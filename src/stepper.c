@@ -31,13 +31,22 @@
 
 struct stepper_move {
     struct move_node node;
-    uint32_t interval;
-    int16_t add;
-    uint16_t count;
-    uint8_t flags;
+    union {
+        struct {
+            uint32_t interval;
+            int16_t add;
+            uint16_t count;
+            uint8_t flags;
+        };
+        // A queue_step_add2 move is followed by a second queue entry
+        // that stores its add and add2 parameters
+        struct {
+            int32_t add32, add2;
+        };
+    };
 };
 
-enum { MF_DIR=1<<0 };
+enum { MF_DIR=1<<0, MF_ADD2=1<<1 };
 
 struct stepper {
     struct timer time;
@@ -45,6 +54,10 @@ struct stepper {
     int16_t add;
     uint32_t count;
     uint32_t next_step_time, step_pulse_ticks;
+#if CONFIG_WANT_STEPPER_ADD2
+    int32_t add32, add2;
+    uint16_t time_frac;
+#endif
     struct gpio_out step_pin, dir_pin;
     uint32_t position;
     struct move_queue_head mq;
@@ -57,9 +70,55 @@ enum { POSITION_BIAS=0x40000000 };
 
 enum {
     SF_LAST_DIR=1<<0, SF_NEXT_DIR=1<<1, SF_INVERT_STEP=1<<2, SF_NEED_RESET=1<<3,
-    SF_SINGLE_SCHED=1<<4, SF_HAVE_ADD=1<<5
+    SF_SINGLE_SCHED=1<<4, SF_HAVE_ADD=1<<5, SF_ADD2=1<<6
 };
 
+#if CONFIG_WANT_STEPPER_ADD2
+
+// Advance a queue_step_add2 sequence and return the ticks to the next
+// step.  The interval, add32, and add2 fields are all fixed point
+// values with 16 bits of fraction.
+static inline uint32_t
+stepper_next_add2(struct stepper *s)
+{
+    uint32_t frac = s->time_frac + s->interval;
+    s->time_frac = frac;
+    s->interval += s->add32;
+    s->add32 += s->add2;
+    return frac >> 16;
+}
+
+// Load a queue_step_add2 sequence and return the ticks to its first step
+static uint32_t
+stepper_load_add2(struct stepper *s, struct stepper_move *m)
+{
+    struct move_node *mn = move_queue_pop(&s->mq);
+    struct stepper_move *ext = container_of(mn, struct stepper_move, node);
+    s->flags |= SF_ADD2;
+    s->interval = m->interval;
+    s->add32 = ext->add32;
+    s->add2 = ext->add2;
+    s->time_frac = 0;
+    move_free(ext);
+    return stepper_next_add2(s);
+}
+
+#else
+
+static inline uint32_t
+stepper_next_add2(struct stepper *s)
+{
+    return 0;
+}
+
+static uint32_t
+stepper_load_add2(struct stepper *s, struct stepper_move *m)
+{
+    return 0;
+}
+
+#endif
+
 // Setup a stepper for the next move in its queue
 static uint_fast8_t
 stepper_load_next(struct stepper *s)
@@ -73,17 +132,24 @@ stepper_load_next(struct stepper *s)
     // Load next 'struct stepper_move' into 'struct stepper'
     struct move_node *mn = move_queue_pop(&s->mq);
     struct stepper_move *m = container_of(mn, struct stepper_move, node);
-    s->add = m->add;
-    s->interval = m->interval + m->add;
+    uint32_t first_interval = m->interval;
+    if (CONFIG_WANT_STEPPER_ADD2 && m->flags & MF_ADD2) {
+        first_interval = stepper_load_add2(s, m);
+    } else {
+        if (CONFIG_WANT_STEPPER_ADD2)
+            s->flags &= ~SF_ADD2;
+        s->add = m->add;
+        s->interval = m->interval + m->add;
+    }
     if (HAVE_SINGLE_SCHEDULE && s->flags & SF_SINGLE_SCHED) {
-        s->time.waketime += m->interval;
+        s->time.waketime += first_interval;
         if (HAVE_AVR_OPTIMIZATION)
             s->flags = m->add ? s->flags|SF_HAVE_ADD : s->flags & ~SF_HAVE_ADD;
         s->count = m->count;
     } else {
         // It is necessary to schedule unstep events and so there are
         // twice as many events.
-        s->next_step_time += m->interval;
+        s->next_step_time += first_interval;
         s->time.waketime = s->next_step_time;
         s->count = (uint32_t)m->count * 2;
     }
@@ -108,8 +174,12 @@ stepper_event_edge(struct timer *t)
     uint32_t count = s->count - 1;
     if (likely(count)) {
         s->count = count;
-        s->time.waketime += s->interval;
-        s->interval += s->add;
+        if (CONFIG_WANT_STEPPER_ADD2 && unlikely(s->flags & SF_ADD2)) {
+            s->time.waketime += stepper_next_add2(s);
+        } else {
+            s->time.waketime += s->interval;
+            s->interval += s->add;
+        }
         return SF_RESCHEDULE;
     }
     return stepper_load_next(s);
@@ -150,8 +220,12 @@ stepper_event_full(struct timer *t)
         // Schedule unstep event
         goto reschedule_min;
     if (likely(s->count)) {
-        s->next_step_time += s->interval;
-        s->interval += s->add;
+        if (CONFIG_WANT_STEPPER_ADD2 && unlikely(s->flags & SF_ADD2)) {
+            s->next_step_time += stepper_next_add2(s);
+        } else {
+            s->next_step_time += s->interval;
+            s->interval += s->add;
+        }
         if (unlikely(timer_is_before(s->next_step_time, min_next_time)))
             // The next step event is too close - push it back
             goto reschedule_min;
@@ -216,41 +290,74 @@ stepper_oid_lookup(uint8_t oid)
     return oid_lookup(oid, command_config_stepper);
 }
 
-// Schedule a set of steps with a given timing
-void
-command_queue_step(uint32_t *args)
+// Add a 'struct stepper_move' (and its optional extension entry) to
+// the stepper's queue
+static void
+stepper_queue_move(struct stepper *s, struct stepper_move *m
+                   , struct stepper_move *ext)
 {
-    struct stepper *s = stepper_oid_lookup(args[0]);
-    struct stepper_move *m = move_alloc();
-    m->interval = args[1];
-    m->count = args[2];
-    if (!m->count)
-        shutdown("Invalid count parameter");
-    m->add = args[3];
-    m->flags = 0;
-
     irq_disable();
     uint8_t flags = s->flags;
     if (!!(flags & SF_LAST_DIR) != !!(flags & SF_NEXT_DIR)) {
         flags ^= SF_LAST_DIR;
         m->flags |= MF_DIR;
     }
-    if (s->count) {
-        s->flags = flags;
-        move_queue_push(&m->node, &s->mq);
-    } else if (flags & SF_NEED_RESET) {
+    if (!s->count && flags & SF_NEED_RESET) {
         move_free(m);
+        if (ext)
+            move_free(ext);
     } else {
         s->flags = flags;
         move_queue_push(&m->node, &s->mq);
-        stepper_load_next(s);
-        sched_add_timer(&s->time);
+        if (ext)
+            move_queue_push(&ext->node, &s->mq);
+        if (!s->count) {
+            stepper_load_next(s);
+            sched_add_timer(&s->time);
+        }
     }
     irq_enable();
 }
+
+// Schedule a set of steps with a given timing
+void
+command_queue_step(uint32_t *args)
+{
+    struct stepper *s = stepper_oid_lookup(args[0]);
+    struct stepper_move *m = move_alloc();
+    m->interval = args[1];
+    m->count = args[2];
+    if (!m->count)
+        shutdown("Invalid count parameter");
+    m->add = args[3];
+    m->flags = 0;
+    stepper_queue_move(s, m, NULL);
+}
 DECL_COMMAND(command_queue_step,
              "queue_step oid=%c interval=%u count=%hu add=%hi");
 
+#if CONFIG_WANT_STEPPER_ADD2
+// Schedule a set of steps using a second order interval adjustment
+void
+command_queue_step_add2(uint32_t *args)
+{
+    struct stepper *s = stepper_oid_lookup(args[0]);
+    struct stepper_move *m = move_alloc();
+    m->interval = args[1];
+    m->count = args[2];
+    if (!m->count)
+        shutdown("Invalid count parameter");
+    m->add = 0;
+    m->flags = MF_ADD2;
+    struct stepper_move *ext = move_alloc();
+    ext->add32 = args[3];
+    ext->add2 = args[4];
+    stepper_queue_move(s, m, ext);
+}
+DECL_COMMAND(command_queue_step_add2,
+             "queue_step_add2 oid=%c interval=%u count=%hu add=%i add2=%i");
+#endif
+
 // Set the direction of the next queued step
 void
 command_set_next_step_dir(uint32_t *args)